@@ -0,0 +1,223 @@
+/*
+ * pidgin-aichat
+ *
+ * Copyright (C) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <string.h>
+#include "base64stream.h"
+
+typedef enum {
+	AICHAT_BASE64_STREAM_SEARCHING,  /* Looking for the quoted member name */
+	AICHAT_BASE64_STREAM_COLON,      /* Found it, expecting the colon */
+	AICHAT_BASE64_STREAM_QUOTE,      /* Expecting the opening quote of the value */
+	AICHAT_BASE64_STREAM_VALUE,      /* Decoding the value */
+	AICHAT_BASE64_STREAM_COMPLETE    /* Seen the closing quote */
+} AiChatBase64StreamState;
+
+struct _AiChatBase64Stream {
+	gchar *pattern;        /* The member name, with its quotes */
+	gsize pattern_len;
+	gsize matched;         /* Bytes of the pattern matched at the end of the last feed */
+	AiChatBase64StreamState state;
+
+	GByteArray *out;
+	gint decode_state;     /* g_base64_decode_step() carry-over */
+	guint decode_save;
+	gsize received;        /* Response bytes fed so far */
+};
+
+AiChatBase64Stream *
+aichat_base64_stream_new(const gchar *member)
+{
+	AiChatBase64Stream *stream = g_new0(AiChatBase64Stream, 1);
+
+	stream->pattern = g_strdup_printf("\"%s\"", member);
+	stream->pattern_len = strlen(stream->pattern);
+	stream->out = g_byte_array_new();
+
+	return stream;
+}
+
+void
+aichat_base64_stream_free(AiChatBase64Stream *stream)
+{
+	if (stream == NULL) {
+		return;
+	}
+
+	if (stream->out != NULL) {
+		g_byte_array_free(stream->out, TRUE);
+	}
+	g_free(stream->pattern);
+	g_free(stream);
+}
+
+void
+aichat_base64_stream_reset(AiChatBase64Stream *stream)
+{
+	g_return_if_fail(stream != NULL);
+
+	stream->matched = 0;
+	stream->state = AICHAT_BASE64_STREAM_SEARCHING;
+	if (stream->out != NULL) {
+		g_byte_array_set_size(stream->out, 0);
+	} else {
+		stream->out = g_byte_array_new();
+	}
+	stream->decode_state = 0;
+	stream->decode_save = 0;
+	stream->received = 0;
+}
+
+/* Decode a run of base64 text onto the end of the output */
+static void
+aichat_base64_stream_decode(AiChatBase64Stream *stream, const gchar *buf, gsize len)
+{
+	guint old_len = stream->out->len;
+	gsize written;
+
+	if (len == 0) {
+		return;
+	}
+
+	g_byte_array_set_size(stream->out, old_len + (len / 4) * 3 + 3);
+	written = g_base64_decode_step(buf, len, stream->out->data + old_len,
+		&stream->decode_state, &stream->decode_save);
+	g_byte_array_set_size(stream->out, old_len + written);
+}
+
+void
+aichat_base64_stream_feed(AiChatBase64Stream *stream, const gchar *buf, gsize len)
+{
+	const gchar *end = buf + len;
+
+	g_return_if_fail(stream != NULL);
+
+	stream->received += len;
+
+	while (buf < end) {
+		switch (stream->state) {
+		case AICHAT_BASE64_STREAM_SEARCHING:
+			/* Quotes only appear at the ends of the pattern, so a failed
+			 * match can only restart at the byte that broke it */
+			for (; buf < end && stream->matched < stream->pattern_len; buf++) {
+				if (*buf == stream->pattern[stream->matched]) {
+					stream->matched++;
+				} else {
+					stream->matched = *buf == '"' ? 1 : 0;
+				}
+			}
+			if (stream->matched == stream->pattern_len) {
+				stream->state = AICHAT_BASE64_STREAM_COLON;
+			}
+			break;
+
+		case AICHAT_BASE64_STREAM_COLON:
+		case AICHAT_BASE64_STREAM_QUOTE:
+			if (g_ascii_isspace(*buf)) {
+				buf++;
+			} else if (*buf == (stream->state == AICHAT_BASE64_STREAM_COLON ? ':' : '"')) {
+				stream->state++;
+				buf++;
+			} else {
+				/* Just a string with the same text, look on */
+				stream->matched = 0;
+				stream->state = AICHAT_BASE64_STREAM_SEARCHING;
+			}
+			break;
+
+		case AICHAT_BASE64_STREAM_VALUE: {
+			const gchar *run = buf;
+
+			/* JSON may escape the '/' of the base64 alphabet, and the
+			 * escape is the only thing in the way of decoding in place */
+			while (buf < end && *buf != '"' && *buf != '\\') {
+				buf++;
+			}
+			aichat_base64_stream_decode(stream, run, buf - run);
+
+			if (buf < end) {
+				if (*buf == '"') {
+					stream->state = AICHAT_BASE64_STREAM_COMPLETE;
+				}
+				buf++;
+			}
+			break;
+		}
+
+		case AICHAT_BASE64_STREAM_COMPLETE:
+			/* Whatever follows the value doesn't matter */
+			return;
+		}
+	}
+}
+
+gboolean
+aichat_base64_stream_is_complete(AiChatBase64Stream *stream)
+{
+	g_return_val_if_fail(stream != NULL, FALSE);
+
+	return stream->state == AICHAT_BASE64_STREAM_COMPLETE;
+}
+
+guchar *
+aichat_base64_stream_steal(AiChatBase64Stream *stream, gsize *len)
+{
+	guchar *data;
+
+	g_return_val_if_fail(stream != NULL, NULL);
+
+	if (stream->state != AICHAT_BASE64_STREAM_COMPLETE || stream->out == NULL) {
+		return NULL;
+	}
+
+	if (len) {
+		*len = stream->out->len;
+	}
+	data = g_byte_array_free(stream->out, FALSE);
+	stream->out = NULL;
+
+	return data;
+}
+
+static gboolean
+aichat_base64_stream_response_writer(PurpleHttpConnection *http_conn, PurpleHttpResponse *response,
+	const gchar *buffer, size_t offset, size_t length, gpointer user_data)
+{
+	AiChatBase64Stream *stream = user_data;
+
+	if (!purple_http_response_is_successful(response)) {
+		return TRUE;
+	}
+
+	/* @offset is where this piece ends, so a retried request, which gets
+	 * the whole body again, starts with one that ends at its own length */
+	if (offset == length && stream->received > 0) {
+		aichat_base64_stream_reset(stream);
+	}
+
+	aichat_base64_stream_feed(stream, buffer, length);
+
+	return TRUE;
+}
+
+void
+aichat_base64_stream_request_set(PurpleHttpRequest *request, AiChatBase64Stream *stream)
+{
+	purple_http_request_set_response_writer(request, aichat_base64_stream_response_writer, stream);
+}
@@ -0,0 +1,58 @@
+/*
+ * pidgin-aichat
+ *
+ * Copyright (C) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#ifndef _BASE64STREAM_H_
+#define _BASE64STREAM_H_
+
+#include <glib.h>
+#include "http.h"
+
+/* Decoding a base64 string member of a JSON response as the response
+ * arrives, for bodies that are mostly one large encoded blob (generated
+ * images).  The member is found by its quoted name without parsing the
+ * rest of the document, and its value is decoded piece by piece into a
+ * buffer that ends up holding the decoded bytes and nothing else, so the
+ * body is never kept whole, neither encoded nor as a JSON tree. */
+
+typedef struct _AiChatBase64Stream AiChatBase64Stream;
+
+/* Create a decoder for the first member called @member */
+AiChatBase64Stream *aichat_base64_stream_new(const gchar *member);
+
+/* Free a decoder and anything decoded so far */
+void aichat_base64_stream_free(AiChatBase64Stream *stream);
+
+/* Feed raw response bytes */
+void aichat_base64_stream_feed(AiChatBase64Stream *stream, const gchar *buf, gsize len);
+
+/* Start over, for a response that is being received again */
+void aichat_base64_stream_reset(AiChatBase64Stream *stream);
+
+/* Whether the whole of the member's value has been decoded */
+gboolean aichat_base64_stream_is_complete(AiChatBase64Stream *stream);
+
+/* Take the decoded bytes, to be freed with g_free(); NULL unless complete */
+guchar *aichat_base64_stream_steal(AiChatBase64Stream *stream, gsize *len);
+
+/* Route a request's response body through @stream.  Unsuccessful responses
+ * are ignored.  The decoder must outlive the request. */
+void aichat_base64_stream_request_set(PurpleHttpRequest *request, AiChatBase64Stream *stream);
+
+#endif /* _BASE64STREAM_H_ */
@@ -0,0 +1,193 @@
+/*
+ * pidgin-aichat
+ *
+ * Copyright (C) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <string.h>
+#include "context.h"
+
+/* Per-turn framing (role markers and separators) added by the chat templates */
+#define AICHAT_CONTEXT_TURN_OVERHEAD 4
+
+/* Room kept free for the reply, at most a quarter of the window */
+#define AICHAT_CONTEXT_MAX_RESERVE 4096
+
+/* When turns have to be left out, leave out enough that this part of the
+ * budget is free for the turns to come */
+#define AICHAT_CONTEXT_SLACK_DIVISOR 4
+
+/* Window sizes for models whose provider doesn't have a single one */
+static const struct {
+	const gchar *prefix;
+	gint tokens;
+} aichat_context_model_limits[] = {
+	{ "gpt-4o", 128000 },
+	{ "gpt-4-turbo", 128000 },
+	{ "gpt-4.1", 1047576 },
+	{ "gpt-4-32k", 32768 },
+	{ "gpt-4", 8192 },
+	{ "gpt-3.5-turbo", 16385 },
+	{ "o1", 200000 },
+	{ "o3", 200000 },
+	{ "o4", 200000 },
+};
+
+guint
+aichat_context_estimate_tokens(const gchar *text, gssize len)
+{
+	if (text == NULL) {
+		return 0;
+	}
+	if (len < 0) {
+		len = strlen(text);
+	}
+
+	/* About four bytes per token for English text with the BPE vocabularies
+	 * in use; rounded up so short turns aren't counted as free */
+	return (len + 3) / 4;
+}
+
+gint
+aichat_context_get_limit(AiChatAccount *cga, AiChatBuddy *buddy, LLMProvider *provider)
+{
+	gint limit = purple_account_get_int(cga->account, "context_tokens", 0);
+	guint i;
+
+	if (limit > 0) {
+		return limit;
+	}
+
+	if (buddy->model != NULL) {
+		for (i = 0; i < G_N_ELEMENTS(aichat_context_model_limits); i++) {
+			if (g_str_has_prefix(buddy->model, aichat_context_model_limits[i].prefix)) {
+				return aichat_context_model_limits[i].tokens;
+			}
+		}
+	}
+
+	return provider->max_context_length;
+}
+
+gsize
+aichat_context_get_history_size(AiChatAccount *cga, AiChatBuddy *buddy, LLMProvider *provider)
+{
+	gint limit = aichat_context_get_limit(cga, buddy, provider);
+
+	/* Twice what the estimate says fits, as it's only an estimate */
+	return limit > 0 ? (gsize) limit * 8 : 0;
+}
+
+guint
+aichat_context_count_tokens(AiChatAccount *cga, const gchar *text, gssize len)
+{
+	if (cga->tokenizer != NULL) {
+		return aichat_tokenizer_count(cga->tokenizer, text, len);
+	}
+
+	return aichat_context_estimate_tokens(text, len);
+}
+
+guint
+aichat_context_entry_tokens(AiChatAccount *cga, AiChatHistoryEntry *entry)
+{
+	/* The account's tokenizer doesn't change while it's connected, so
+	 * the count is good for the life of the entry */
+	if (entry->tokens == 0) {
+		entry->tokens = aichat_context_count_tokens(cga, entry->content, entry->content_len) +
+			AICHAT_CONTEXT_TURN_OVERHEAD;
+	}
+
+	return entry->tokens;
+}
+
+void
+aichat_context_fit(AiChatAccount *cga, AiChatBuddy *buddy, LLMProvider *provider)
+{
+	AiChatHistoryEntry *entries;
+	guint len, pinned, start, old_pinned, old_start, i;
+	gint64 budget, used;
+	gint limit;
+
+	len = aichat_history_get_length(buddy->history);
+	if (len == 0) {
+		return;
+	}
+	entries = aichat_history_get_entries(buddy->history);
+
+	limit = aichat_context_get_limit(cga, buddy, provider);
+	if (limit <= 0) {
+		aichat_history_set_window(buddy->history, 0, 0);
+		return;
+	}
+
+	budget = limit - MIN(AICHAT_CONTEXT_MAX_RESERVE, limit / 4) -
+		aichat_context_count_tokens(cga, buddy->instructions, -1) - AICHAT_CONTEXT_TURN_OVERHEAD;
+	if (aichat_history_get_recall(buddy->history) != NULL) {
+		budget -= aichat_context_count_tokens(cga, aichat_history_get_recall(buddy->history), -1);
+	}
+
+	used = 0;
+	for (i = 0; i < len; i++) {
+		used += aichat_context_entry_tokens(cga, &entries[i]);
+	}
+	if (used <= budget) {
+		aichat_history_set_window(buddy->history, 0, 0);
+		return;
+	}
+
+	/* The newest message is never dropped, even if it doesn't fit on its
+	 * own; the server gets to say so */
+	pinned = MIN(AICHAT_CONTEXT_PINNED_TURNS, len - 1);
+	used = 0;
+	for (i = 0; i < pinned; i++) {
+		used += entries[i].tokens;
+	}
+
+	/* Every turn dropped changes the start of the prompt, which the
+	 * provider's prompt cache is keyed on, so the window stays put for as
+	 * long as the new turns still fit after it */
+	aichat_history_get_window(buddy->history, &old_pinned, &old_start);
+	if (old_pinned == pinned && old_start > pinned && old_start < len) {
+		gint64 kept = used;
+
+		for (i = old_start; i < len; i++) {
+			kept += entries[i].tokens;
+		}
+		if (kept <= budget) {
+			return;
+		}
+	}
+	budget -= budget / AICHAT_CONTEXT_SLACK_DIVISOR;
+
+	start = len - 1;
+	used += entries[start].tokens;
+	while (start > pinned && used + entries[start - 1].tokens <= budget) {
+		start--;
+		used += entries[start].tokens;
+	}
+
+	/* Don't open the window on a reply to a message that was left out */
+	if (start < len - 1 && entries[start].role == AICHAT_ROLE_ASSISTANT) {
+		start++;
+	}
+
+	aichat_history_set_window(buddy->history, pinned, start);
+
+	purple_debug_info("aichat", "Left %u of %u turns out of the request to fit %d tokens\n",
+		start - pinned, len, limit);
+}
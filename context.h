@@ -0,0 +1,64 @@
+/*
+ * pidgin-aichat
+ *
+ * Copyright (C) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#ifndef _CONTEXT_H_
+#define _CONTEXT_H_
+
+#include <glib.h>
+#include "libaichat.h"
+#include "providers.h"
+
+/* Keeps requests inside the model's context window.
+ *
+ * Tokens are counted with the account's BPE vocabulary when one is set,
+ * and otherwise estimated from the text length, so the budget leaves some
+ * headroom.  Turns that don't fit stay in the buddy's history; they're
+ * only left out of the request through the history's window. */
+
+/* Turns always sent from the start of a conversation: the first exchange,
+ * which usually sets up what the rest of it is about */
+#define AICHAT_CONTEXT_PINNED_TURNS 2
+
+/* Estimate how many tokens @len bytes of @text take up.  A negative @len
+ * means @text is NUL-terminated. */
+guint aichat_context_estimate_tokens(const gchar *text, gssize len);
+
+/* Count the tokens in @text with @cga's tokenizer, or estimate them if it
+ * has none */
+guint aichat_context_count_tokens(AiChatAccount *cga, const gchar *text, gssize len);
+
+/* Get the tokens @entry takes up in a request, counting them the first
+ * time */
+guint aichat_context_entry_tokens(AiChatAccount *cga, AiChatHistoryEntry *entry);
+
+/* Get the context window size for @buddy's model, or 0 if it isn't known */
+gint aichat_context_get_limit(AiChatAccount *cga, AiChatBuddy *buddy, LLMProvider *provider);
+
+/* Get how many bytes of @buddy's newest turns are worth keeping in memory,
+ * or 0 if all of them are */
+gsize aichat_context_get_history_size(AiChatAccount *cga, AiChatBuddy *buddy, LLMProvider *provider);
+
+/* Pick which turns of @buddy's history go into the next request.  The
+ * first exchange and the newest message are always sent; the turns in
+ * between are dropped oldest first until the estimate fits the model's
+ * context window, less room for the reply and any recalled text. */
+void aichat_context_fit(AiChatAccount *cga, AiChatBuddy *buddy, LLMProvider *provider);
+
+#endif /* _CONTEXT_H_ */
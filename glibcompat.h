@@ -5,6 +5,14 @@
 #define g_memdup2(mem, size) g_memdup((mem), (size))
 #endif /* 2.68.0 */
 
+#if !GLIB_CHECK_VERSION(2, 64, 0)
+#ifdef _WIN32
+#define g_fsync(fd) _commit(fd)
+#else
+#define g_fsync(fd) fsync(fd)
+#endif
+#endif /* 2.64.0 */
+
 #if !GLIB_CHECK_VERSION(2, 32, 0)
 #define g_hash_table_contains(hash_table, key) g_hash_table_lookup_extended((hash_table), (key), NULL, NULL)
 #endif /* 2.32.0 */
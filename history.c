@@ -0,0 +1,302 @@
+/*
+ * pidgin-aichat
+ *
+ * Copyright (C) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <string.h>
+#include "history.h"
+
+/* Arena blocks start small, so a bot that is barely used costs little, and
+ * double up to this size as the conversation grows */
+#define AICHAT_HISTORY_MIN_BLOCK 1024
+#define AICHAT_HISTORY_MAX_BLOCK 65536
+
+struct _AiChatHistory {
+	AiChatHistoryEntry *entries;
+	guint len;
+	guint allocated;
+
+	GSList *blocks;         /* Arena blocks, the one being filled first */
+	gsize block_size;       /* Size of the block being filled */
+	gsize block_used;
+	gsize arena_size;       /* Total size of all blocks */
+
+	guint pinned;           /* Request window, see aichat_history_set_window() */
+	guint start;
+	gchar *recall;          /* See aichat_history_set_recall() */
+};
+
+typedef struct {
+	guint refs;
+	gchar str[];
+} AiChatInternedString;
+
+/* String -> the AiChatInternedString holding it */
+static GHashTable *aichat_string_pool = NULL;
+
+const gchar *
+aichat_role_to_string(AiChatRole role)
+{
+	switch (role) {
+	case AICHAT_ROLE_SYSTEM:
+		return "system";
+	case AICHAT_ROLE_ASSISTANT:
+		return "assistant";
+	case AICHAT_ROLE_USER:
+	default:
+		return "user";
+	}
+}
+
+AiChatHistory *
+aichat_history_new(void)
+{
+	return g_new0(AiChatHistory, 1);
+}
+
+void
+aichat_history_free(AiChatHistory *history)
+{
+	guint i;
+
+	if (history == NULL) {
+		return;
+	}
+
+	for (i = 0; i < history->len; i++) {
+		aichat_json_chunk_unref(history->entries[i].wire);
+	}
+	g_free(history->entries);
+	g_slist_free_full(history->blocks, g_free);
+	g_free(history->recall);
+	g_free(history);
+}
+
+/* Find room for @size bytes in the arena */
+static gchar *
+aichat_history_alloc(AiChatHistory *history, gsize size)
+{
+	gchar *block;
+	gsize block_size;
+
+	if (history->blocks != NULL && history->block_size - history->block_used >= size) {
+		block = (gchar *) history->blocks->data + history->block_used;
+		history->block_used += size;
+		return block;
+	}
+
+	block_size = CLAMP(history->arena_size, AICHAT_HISTORY_MIN_BLOCK, AICHAT_HISTORY_MAX_BLOCK);
+	if (size > block_size / 2) {
+		/* Big enough for a block of its own, leaving the current one
+		 * to be filled */
+		block = g_malloc(size);
+		history->arena_size += size;
+		if (history->blocks != NULL) {
+			history->blocks->next = g_slist_prepend(history->blocks->next, block);
+		} else {
+			/* Full, as far as anything else is concerned */
+			history->blocks = g_slist_prepend(history->blocks, block);
+			history->block_size = history->block_used = size;
+		}
+		return block;
+	}
+
+	block = g_malloc(block_size);
+	history->blocks = g_slist_prepend(history->blocks, block);
+	history->block_size = block_size;
+	history->block_used = size;
+	history->arena_size += block_size;
+
+	return block;
+}
+
+AiChatHistoryEntry *
+aichat_history_append(AiChatHistory *history, AiChatRole role, const gchar *content, gssize len)
+{
+	AiChatHistoryEntry *entry;
+	gchar *copy;
+
+	g_return_val_if_fail(history != NULL, NULL);
+	g_return_val_if_fail(content != NULL, NULL);
+
+	if (len < 0) {
+		len = strlen(content);
+	}
+
+	if (history->len == history->allocated) {
+		history->allocated = history->allocated ? history->allocated * 2 : 8;
+		history->entries = g_renew(AiChatHistoryEntry, history->entries, history->allocated);
+	}
+
+	copy = aichat_history_alloc(history, len + 1);
+	memcpy(copy, content, len);
+	copy[len] = '\0';
+
+	entry = &history->entries[history->len++];
+	entry->role = role;
+	entry->content = copy;
+	entry->content_len = len;
+	entry->wire = NULL;
+	entry->wire_writer = NULL;
+	entry->tokens = 0;
+
+	return entry;
+}
+
+void
+aichat_history_replace_head(AiChatHistory *history, guint n, AiChatRole role, const gchar *content, gssize len)
+{
+	AiChatHistoryEntry *old_entries;
+	GSList *old_blocks;
+	guint old_len, i;
+
+	g_return_if_fail(history != NULL);
+	g_return_if_fail(n <= history->len);
+
+	old_entries = history->entries;
+	old_len = history->len;
+	old_blocks = history->blocks;
+
+	history->allocated = old_len - n + 1;
+	history->entries = g_new(AiChatHistoryEntry, history->allocated);
+	history->len = 0;
+	history->blocks = NULL;
+	history->block_size = history->block_used = history->arena_size = 0;
+	history->pinned = history->start = 0;
+
+	aichat_history_append(history, role, content, len);
+	for (i = n; i < old_len; i++) {
+		AiChatHistoryEntry *entry = aichat_history_append(history, old_entries[i].role,
+			old_entries[i].content, old_entries[i].content_len);
+
+		/* The JSON and token count are still good, only the text moved */
+		entry->wire = old_entries[i].wire;
+		entry->wire_writer = old_entries[i].wire_writer;
+		entry->tokens = old_entries[i].tokens;
+	}
+
+	for (i = 0; i < n; i++) {
+		aichat_json_chunk_unref(old_entries[i].wire);
+	}
+	g_free(old_entries);
+	g_slist_free_full(old_blocks, g_free);
+}
+
+guint
+aichat_history_get_length(const AiChatHistory *history)
+{
+	return history != NULL ? history->len : 0;
+}
+
+AiChatHistoryEntry *
+aichat_history_get_entries(AiChatHistory *history)
+{
+	return history != NULL ? history->entries : NULL;
+}
+
+AiChatHistoryEntry *
+aichat_history_get_last(AiChatHistory *history)
+{
+	if (history == NULL || history->len == 0) {
+		return NULL;
+	}
+
+	return &history->entries[history->len - 1];
+}
+
+void
+aichat_history_set_window(AiChatHistory *history, guint pinned, guint start)
+{
+	g_return_if_fail(history != NULL);
+
+	history->pinned = pinned;
+	history->start = MAX(start, pinned);
+}
+
+void
+aichat_history_get_window(const AiChatHistory *history, guint *pinned, guint *start)
+{
+	*pinned = history != NULL ? history->pinned : 0;
+	*start = history != NULL ? history->start : 0;
+}
+
+void
+aichat_history_set_recall(AiChatHistory *history, const gchar *recall)
+{
+	g_return_if_fail(history != NULL);
+
+	g_free(history->recall);
+	history->recall = g_strdup(recall);
+}
+
+const gchar *
+aichat_history_get_recall(const AiChatHistory *history)
+{
+	return history != NULL ? history->recall : NULL;
+}
+
+const gchar *
+aichat_string_intern(const gchar *str)
+{
+	AiChatInternedString *interned;
+	gsize len;
+
+	if (str == NULL) {
+		return NULL;
+	}
+
+	if (aichat_string_pool == NULL) {
+		aichat_string_pool = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+	}
+
+	interned = g_hash_table_lookup(aichat_string_pool, str);
+	if (interned == NULL) {
+		len = strlen(str);
+		interned = g_malloc(G_STRUCT_OFFSET(AiChatInternedString, str) + len + 1);
+		interned->refs = 0;
+		memcpy(interned->str, str, len + 1);
+		g_hash_table_insert(aichat_string_pool, interned->str, interned);
+	}
+	interned->refs++;
+
+	return interned->str;
+}
+
+void
+aichat_string_release(const gchar *str)
+{
+	AiChatInternedString *interned;
+
+	if (str == NULL || aichat_string_pool == NULL) {
+		return;
+	}
+
+	interned = g_hash_table_lookup(aichat_string_pool, str);
+	g_return_if_fail(interned != NULL);
+
+	if (--interned->refs > 0) {
+		return;
+	}
+
+	g_hash_table_remove(aichat_string_pool, interned->str);
+	if (g_hash_table_size(aichat_string_pool) == 0) {
+		/* Nothing left behind when the plugin is unloaded */
+		g_hash_table_destroy(aichat_string_pool);
+		aichat_string_pool = NULL;
+	}
+}
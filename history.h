@@ -0,0 +1,97 @@
+/*
+ * pidgin-aichat
+ *
+ * Copyright (C) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#ifndef _HISTORY_H_
+#define _HISTORY_H_
+
+#include <glib.h>
+#include "jsonwriter.h"
+
+/* Conversation history kept for bots whose provider doesn't keep it.
+ *
+ * Entries live in one array, so appending is amortized O(1) and walking
+ * the conversation touches consecutive memory.  Their text is copied into
+ * an arena of large blocks owned by the history, rather than allocated a
+ * message at a time. */
+
+typedef enum {
+	AICHAT_ROLE_SYSTEM,
+	AICHAT_ROLE_USER,
+	AICHAT_ROLE_ASSISTANT
+} AiChatRole;
+
+/* Writes one turn of a conversation as JSON, in a provider's wire format */
+typedef void (*LLMTurnWriter)(AiChatJsonWriter *writer, AiChatRole role, const gchar *content);
+
+typedef struct _AiChatHistoryEntry {
+	AiChatRole role;
+	const gchar *content;      /* NUL-terminated, owned by the history */
+	gsize content_len;
+	AiChatJsonChunk *wire;     /* This turn as JSON, as last written by wire_writer */
+	LLMTurnWriter wire_writer;
+	guint tokens;              /* Estimated size in tokens, 0 until it's needed */
+} AiChatHistoryEntry;
+
+typedef struct _AiChatHistory AiChatHistory;
+
+/* Get the OpenAI name of a role ("system", "user" or "assistant") */
+const gchar *aichat_role_to_string(AiChatRole role);
+
+AiChatHistory *aichat_history_new(void);
+void aichat_history_free(AiChatHistory *history);
+
+/* Add a turn to the end of the conversation, copying @len bytes of @content
+ * (or all of it, if @len is -1).  The entry returned, like any other, stays
+ * valid until the next change to the history. */
+AiChatHistoryEntry *aichat_history_append(AiChatHistory *history, AiChatRole role, const gchar *content, gssize len);
+
+/* Number of turns; a NULL history is empty */
+guint aichat_history_get_length(const AiChatHistory *history);
+
+/* Get the turns, oldest first, as an array of aichat_history_get_length() entries */
+AiChatHistoryEntry *aichat_history_get_entries(AiChatHistory *history);
+
+/* Get the latest turn, or NULL if there is none */
+AiChatHistoryEntry *aichat_history_get_last(AiChatHistory *history);
+
+/* Replace the oldest @n turns with a single one, such as a summary of
+ * them.  The remaining turns are copied into a fresh arena so the space
+ * of the replaced ones is given back, and the window is reset. */
+void aichat_history_replace_head(AiChatHistory *history, guint n, AiChatRole role, const gchar *content, gssize len);
+
+/* Limit the turns that go into requests to the first @pinned and those
+ * from @start on, leaving out the ones in between.  The default, with both
+ * 0, is the whole conversation. */
+void aichat_history_set_window(AiChatHistory *history, guint pinned, guint start);
+void aichat_history_get_window(const AiChatHistory *history, guint *pinned, guint *start);
+
+/* Set text that requests put ahead of the newest turn without it being
+ * kept with the turn, such as what was recalled from long-term memory, or
+ * NULL for none */
+void aichat_history_set_recall(AiChatHistory *history, const gchar *recall);
+const gchar *aichat_history_get_recall(const AiChatHistory *history);
+
+/* Get a plugin-wide shared copy of @str, for strings that many bots have in
+ * common and never change (instructions, model names).  Each call must be
+ * matched by aichat_string_release(); NULL is passed through. */
+const gchar *aichat_string_intern(const gchar *str);
+void aichat_string_release(const gchar *str);
+
+#endif /* _HISTORY_H_ */
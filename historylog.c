@@ -0,0 +1,485 @@
+/*
+ * pidgin-aichat
+ *
+ * Copyright (C) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <glib/gstdio.h>
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+#include "purplecompat.h"
+#include "glibcompat.h"
+#if !PURPLE_VERSION_CHECK(3, 0, 0)
+#include "eventloop.h"
+#endif
+#include "historylog.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define AICHAT_HISTORY_LOG_MAGIC "AIHIST\r\x01"
+#define AICHAT_HISTORY_LOG_MAGIC_LEN 8
+#define AICHAT_HISTORY_LOG_HEADER_LEN 5
+
+/* Longest the last turns can go without being flushed to disk */
+#define AICHAT_HISTORY_LOG_SYNC_SECONDS 5
+
+/* Bytes of the log aichat_history_log_load_all() reads at a time */
+#define AICHAT_HISTORY_LOG_LOAD_SLICE (256 * 1024)
+
+struct _AiChatHistoryLog {
+	gchar *filename;
+	int fd;
+	GByteArray *record;  /* Reused to write each record in one go */
+	gboolean dirty;      /* Written since the last sync */
+	guint sync_timeout;
+	guint skipped;       /* Older turns left on disk, between the pinned ones and the rest */
+
+	/* Reading every turn, see aichat_history_log_load_all() */
+	GMappedFile *loading;
+	gsize load_pos;
+	guint load_timeout;
+	AiChatHistory *loaded;
+	AiChatHistory **load_into;
+	AiChatHistoryLogLoadedFunc load_callback;
+	gpointer load_data;
+};
+
+static guint32
+aichat_history_log_record_length(const guint8 *header)
+{
+	return header[0] | (header[1] << 8) | (header[2] << 16) | ((guint32) header[3] << 24);
+}
+
+/* Read the turns in @data into *@history, returning the length of the part
+ * made of whole records.  Only the first @pinned turns and as many of the
+ * last ones as fit in @max_bytes of text (0 for no limit) are read, and the
+ * number left out between them goes in *@skipped. */
+static gsize
+aichat_history_log_restore(const guint8 *data, gsize len, guint pinned, gsize max_bytes,
+	AiChatHistory **history, guint *skipped)
+{
+	GArray *offsets = g_array_new(FALSE, FALSE, sizeof(gsize));
+	gsize pos = AICHAT_HISTORY_LOG_MAGIC_LEN;
+	gsize tail_bytes = 0;
+	guint n, head, tail, i;
+
+	/* Find the records first, without copying anything */
+	while (len - pos >= AICHAT_HISTORY_LOG_HEADER_LEN) {
+		guint32 content_len = aichat_history_log_record_length(data + pos);
+
+		if (content_len > len - pos - AICHAT_HISTORY_LOG_HEADER_LEN || data[pos + 4] > AICHAT_ROLE_ASSISTANT) {
+			break;
+		}
+		g_array_append_val(offsets, pos);
+		pos += AICHAT_HISTORY_LOG_HEADER_LEN + content_len;
+	}
+	n = offsets->len;
+
+	/* The newest turns that fit, and always the last one */
+	for (tail = n; tail > 0; tail--) {
+		guint32 content_len = aichat_history_log_record_length(data + g_array_index(offsets, gsize, tail - 1));
+
+		if (max_bytes > 0 && tail < n && tail_bytes + content_len > max_bytes) {
+			break;
+		}
+		tail_bytes += content_len;
+	}
+	head = MIN(pinned, tail);
+	*skipped = tail - head;
+
+	for (i = 0; i < n; i++) {
+		const guint8 *header;
+
+		if (i == head) {
+			i = tail;
+			if (i == n) {
+				break;
+			}
+		}
+
+		header = data + g_array_index(offsets, gsize, i);
+		if (*history == NULL) {
+			*history = aichat_history_new();
+		}
+		aichat_history_append(*history, header[4], (const gchar *) header + AICHAT_HISTORY_LOG_HEADER_LEN,
+			aichat_history_log_record_length(header));
+	}
+	g_array_free(offsets, TRUE);
+
+	return pos;
+}
+
+static gboolean
+aichat_history_log_write(AiChatHistoryLog *log, const guint8 *data, gsize len, GError **error)
+{
+	while (len > 0) {
+		gssize written = write(log->fd, data, len);
+
+		if (written < 0) {
+			int saved_errno = errno;
+
+			if (saved_errno == EINTR) {
+				continue;
+			}
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+				"Couldn't write to %s: %s", log->filename, g_strerror(saved_errno));
+			return FALSE;
+		}
+		data += written;
+		len -= written;
+	}
+
+	return TRUE;
+}
+
+static void
+aichat_history_log_add_record(GByteArray *buffer, AiChatRole role, const gchar *content, gsize len)
+{
+	guint8 header[AICHAT_HISTORY_LOG_HEADER_LEN];
+
+	header[0] = len & 0xff;
+	header[1] = (len >> 8) & 0xff;
+	header[2] = (len >> 16) & 0xff;
+	header[3] = (len >> 24) & 0xff;
+	header[4] = role;
+
+	g_byte_array_append(buffer, header, sizeof(header));
+	g_byte_array_append(buffer, (const guint8 *) content, len);
+}
+
+static gboolean
+aichat_history_log_open_fd(AiChatHistoryLog *log, GError **error)
+{
+	log->fd = g_open(log->filename, O_WRONLY | O_APPEND | O_CREAT | O_BINARY, 0600);
+	if (log->fd < 0) {
+		int saved_errno = errno;
+
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+			"Couldn't open %s: %s", log->filename, g_strerror(saved_errno));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Map @filename and restore its turns into *@history, as for
+ * aichat_history_log_restore().  A file that doesn't exist yet has no
+ * turns, and *@len is set to 0. */
+static gboolean
+aichat_history_log_read(const gchar *filename, guint pinned, gsize max_bytes, AiChatHistory **history,
+	guint *skipped, gsize *len, gsize *valid, GError **error)
+{
+	GMappedFile *mapped;
+	GError *local_error = NULL;
+	const guint8 *data;
+
+	*len = *valid = 0;
+	*skipped = 0;
+
+	mapped = g_mapped_file_new(filename, FALSE, &local_error);
+	if (mapped == NULL) {
+		if (g_error_matches(local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+			g_error_free(local_error);
+			return TRUE;
+		}
+		g_propagate_error(error, local_error);
+		return FALSE;
+	}
+
+	data = (const guint8 *) g_mapped_file_get_contents(mapped);
+	*len = g_mapped_file_get_length(mapped);
+	if (*len > 0 && (*len < AICHAT_HISTORY_LOG_MAGIC_LEN ||
+			memcmp(data, AICHAT_HISTORY_LOG_MAGIC, AICHAT_HISTORY_LOG_MAGIC_LEN) != 0)) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s isn't a history log", filename);
+		g_mapped_file_unref(mapped);
+		return FALSE;
+	}
+	if (*len > 0) {
+		*valid = aichat_history_log_restore(data, *len, pinned, max_bytes, history, skipped);
+	}
+	g_mapped_file_unref(mapped);
+
+	return TRUE;
+}
+
+AiChatHistoryLog *
+aichat_history_log_open(const gchar *filename, guint pinned, gsize max_bytes, AiChatHistory **history, GError **error)
+{
+	AiChatHistoryLog *log;
+	gsize len, valid;
+	guint skipped;
+	gboolean opened;
+	gchar *dirname;
+
+	*history = NULL;
+
+	dirname = g_path_get_dirname(filename);
+	g_mkdir_with_parents(dirname, 0700);
+	g_free(dirname);
+
+	if (!aichat_history_log_read(filename, pinned, max_bytes, history, &skipped, &len, &valid, error)) {
+		return NULL;
+	}
+	if (valid < len && skipped > 0) {
+		/* It'll be written out again below, which takes all of it */
+		aichat_history_free(*history);
+		*history = NULL;
+		if (!aichat_history_log_read(filename, 0, 0, history, &skipped, &len, &valid, error)) {
+			return NULL;
+		}
+	}
+
+	log = g_new0(AiChatHistoryLog, 1);
+	log->filename = g_strdup(filename);
+	log->record = g_byte_array_new();
+	log->fd = -1;
+	log->skipped = skipped;
+
+	if (len == 0) {
+		/* New file */
+		opened = aichat_history_log_open_fd(log, error) &&
+			aichat_history_log_write(log, (const guint8 *) AICHAT_HISTORY_LOG_MAGIC, AICHAT_HISTORY_LOG_MAGIC_LEN, error);
+		log->dirty = TRUE;
+	} else if (valid < len) {
+		/* Cut off the half-written turn at the end, so new ones line up */
+		opened = aichat_history_log_rewrite(log, *history, error);
+	} else {
+		opened = aichat_history_log_open_fd(log, error);
+	}
+
+	if (!opened) {
+		aichat_history_log_close(log);
+		aichat_history_free(*history);
+		*history = NULL;
+		return NULL;
+	}
+
+	return log;
+}
+
+guint
+aichat_history_log_get_skipped(const AiChatHistoryLog *log)
+{
+	g_return_val_if_fail(log != NULL, 0);
+
+	return log->skipped;
+}
+
+static void
+aichat_history_log_load_cancel(AiChatHistoryLog *log)
+{
+	if (log->load_timeout) {
+		g_source_remove(log->load_timeout);
+		log->load_timeout = 0;
+	}
+	if (log->loading != NULL) {
+		g_mapped_file_unref(log->loading);
+		log->loading = NULL;
+	}
+	aichat_history_free(log->loaded);
+	log->loaded = NULL;
+}
+
+static gboolean
+aichat_history_log_load_timeout(gpointer user_data)
+{
+	AiChatHistoryLog *log = user_data;
+	const guint8 *data = (const guint8 *) g_mapped_file_get_contents(log->loading);
+	gsize len = g_mapped_file_get_length(log->loading);
+	gsize slice_end = MIN(len, log->load_pos + AICHAT_HISTORY_LOG_LOAD_SLICE);
+	AiChatHistory *live = *log->load_into;
+	AiChatHistoryEntry *entries;
+	guint live_len, loaded_len, added, i;
+
+	while (log->load_pos < slice_end && len - log->load_pos >= AICHAT_HISTORY_LOG_HEADER_LEN) {
+		const guint8 *header = data + log->load_pos;
+		guint32 content_len = aichat_history_log_record_length(header);
+
+		/* A half-written turn at the end was cut off when the log was opened */
+		if (content_len > len - log->load_pos - AICHAT_HISTORY_LOG_HEADER_LEN || header[4] > AICHAT_ROLE_ASSISTANT) {
+			log->load_pos = len;
+			break;
+		}
+		aichat_history_append(log->loaded, header[4], (const gchar *) header + AICHAT_HISTORY_LOG_HEADER_LEN, content_len);
+		log->load_pos += AICHAT_HISTORY_LOG_HEADER_LEN + content_len;
+	}
+	if (log->load_pos < len && len - log->load_pos >= AICHAT_HISTORY_LOG_HEADER_LEN) {
+		return TRUE;
+	}
+
+	/* Turns added while it was loading are only in the live history, as
+	 * are any that couldn't be written out */
+	live_len = aichat_history_get_length(live);
+	loaded_len = aichat_history_get_length(log->loaded);
+	added = log->skipped + live_len > loaded_len ? MIN(log->skipped + live_len - loaded_len, live_len) : 0;
+	entries = aichat_history_get_entries(live);
+	for (i = live_len - added; i < live_len; i++) {
+		aichat_history_append(log->loaded, entries[i].role, entries[i].content, entries[i].content_len);
+	}
+
+	aichat_history_free(live);
+	*log->load_into = log->loaded;
+	log->loaded = NULL;
+	log->skipped = 0;
+	log->load_timeout = 0;
+	g_mapped_file_unref(log->loading);
+	log->loading = NULL;
+
+	log->load_callback(log, NULL, log->load_data);
+
+	return FALSE;
+}
+
+gboolean
+aichat_history_log_load_all(AiChatHistoryLog *log, AiChatHistory **history,
+	AiChatHistoryLogLoadedFunc callback, gpointer user_data)
+{
+	GError *error = NULL;
+
+	g_return_val_if_fail(log != NULL, FALSE);
+
+	if (log->loading != NULL) {
+		return FALSE;
+	}
+	if (log->skipped == 0) {
+		callback(log, NULL, user_data);
+		return TRUE;
+	}
+
+	/* Everything in memory has been written out, so the file has it all */
+	log->loading = g_mapped_file_new(log->filename, FALSE, &error);
+	if (log->loading == NULL) {
+		callback(log, error, user_data);
+		g_error_free(error);
+		return TRUE;
+	}
+
+	log->load_pos = AICHAT_HISTORY_LOG_MAGIC_LEN;
+	log->loaded = aichat_history_new();
+	log->load_into = history;
+	log->load_callback = callback;
+	log->load_data = user_data;
+	log->load_timeout = g_timeout_add(0, aichat_history_log_load_timeout, log);
+
+	return TRUE;
+}
+
+static gboolean
+aichat_history_log_sync_timeout(gpointer user_data)
+{
+	AiChatHistoryLog *log = user_data;
+
+	log->sync_timeout = 0;
+	if (log->dirty && log->fd >= 0) {
+		g_fsync(log->fd);
+		log->dirty = FALSE;
+	}
+
+	return FALSE;
+}
+
+void
+aichat_history_log_close(AiChatHistoryLog *log)
+{
+	if (log == NULL) {
+		return;
+	}
+
+	aichat_history_log_load_cancel(log);
+	if (log->sync_timeout) {
+		g_source_remove(log->sync_timeout);
+	}
+	if (log->fd >= 0) {
+		if (log->dirty) {
+			g_fsync(log->fd);
+		}
+		close(log->fd);
+	}
+	g_byte_array_free(log->record, TRUE);
+	g_free(log->filename);
+	g_free(log);
+}
+
+gboolean
+aichat_history_log_append(AiChatHistoryLog *log, AiChatRole role, const gchar *content, gssize len, GError **error)
+{
+	g_return_val_if_fail(log != NULL, FALSE);
+
+	if (log->fd < 0 && !aichat_history_log_open_fd(log, error)) {
+		return FALSE;
+	}
+	if (len < 0) {
+		len = strlen(content);
+	}
+
+	g_byte_array_set_size(log->record, 0);
+	aichat_history_log_add_record(log->record, role, content, len);
+	if (!aichat_history_log_write(log, log->record->data, log->record->len, error)) {
+		return FALSE;
+	}
+
+	log->dirty = TRUE;
+	if (log->sync_timeout == 0) {
+		log->sync_timeout = g_timeout_add_seconds(AICHAT_HISTORY_LOG_SYNC_SECONDS, aichat_history_log_sync_timeout, log);
+	}
+
+	return TRUE;
+}
+
+gboolean
+aichat_history_log_rewrite(AiChatHistoryLog *log, AiChatHistory *history, GError **error)
+{
+	AiChatHistoryEntry *entries = aichat_history_get_entries(history);
+	guint len = aichat_history_get_length(history);
+	GByteArray *contents;
+	gboolean written;
+	guint i;
+
+	g_return_val_if_fail(log != NULL, FALSE);
+	g_return_val_if_fail(log->skipped == 0, FALSE);
+
+	contents = g_byte_array_sized_new(AICHAT_HISTORY_LOG_MAGIC_LEN);
+	g_byte_array_append(contents, (const guint8 *) AICHAT_HISTORY_LOG_MAGIC, AICHAT_HISTORY_LOG_MAGIC_LEN);
+	for (i = 0; i < len; i++) {
+		aichat_history_log_add_record(contents, entries[i].role, entries[i].content, entries[i].content_len);
+	}
+
+	/* Closed first, as Windows won't replace a file that's open */
+	if (log->fd >= 0) {
+		close(log->fd);
+		log->fd = -1;
+	}
+
+	/* Written to a new file that then takes the old one's place, which
+	 * also syncs it */
+	written = g_file_set_contents(log->filename, (const gchar *) contents->data, contents->len, error);
+	g_byte_array_free(contents, TRUE);
+	if (!written) {
+		return FALSE;
+	}
+	log->dirty = FALSE;
+
+	return aichat_history_log_open_fd(log, error);
+}
@@ -0,0 +1,78 @@
+/*
+ * pidgin-aichat
+ *
+ * Copyright (C) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#ifndef _HISTORYLOG_H_
+#define _HISTORYLOG_H_
+
+#include <glib.h>
+#include "history.h"
+
+/* A conversation history kept on disk, so bots remember it across restarts.
+ *
+ * The file is a short magic number followed by one record per turn: the
+ * length of its text as 4 little-endian bytes, its role as one byte, then
+ * the text itself.  Turns are appended as they're added and the file is
+ * flushed to disk every few seconds rather than after every write; a turn
+ * that was only partly written when the program stopped is dropped the
+ * next time the file is opened.  Opening maps the file and copies the
+ * turns straight into the history's arena.
+ *
+ * Only the turns that requests can use need to be read: the first few,
+ * which the context window keeps, and as many of the newest as fit the
+ * model.  The rest stay on disk until aichat_history_log_load_all(). */
+
+typedef struct _AiChatHistoryLog AiChatHistoryLog;
+
+/* Called once aichat_history_log_load_all() is done, with @error set if it
+ * failed */
+typedef void (*AiChatHistoryLogLoadedFunc)(AiChatHistoryLog *log, const GError *error, gpointer user_data);
+
+/* Open the log in @filename, creating it (and its directory) if needed.
+ * The first @pinned turns already in it, and the newest ones up to
+ * @max_bytes of text (0 for all), are restored into a new history returned
+ * in @history, or NULL if there are none.  Returns NULL and sets @error if
+ * the file can't be read, written, or isn't a history log. */
+AiChatHistoryLog *aichat_history_log_open(const gchar *filename, guint pinned, gsize max_bytes,
+	AiChatHistory **history, GError **error);
+
+/* Get the number of turns that were left on disk, after the pinned ones */
+guint aichat_history_log_get_skipped(const AiChatHistoryLog *log);
+
+/* Replace *@history, which must be the one the log was opened with (plus
+ * any turns appended since), by one with every turn in the log, then call
+ * @callback.  The turns left on disk are read a slice at a time from the
+ * main loop, so a long conversation doesn't hold it up; *@history stays in
+ * use until then.  Closing the log cancels it without calling @callback.
+ * Returns FALSE if it's already loading. */
+gboolean aichat_history_log_load_all(AiChatHistoryLog *log, AiChatHistory **history,
+	AiChatHistoryLogLoadedFunc callback, gpointer user_data);
+
+/* Flush the log to disk and close it */
+void aichat_history_log_close(AiChatHistoryLog *log);
+
+/* Add a turn at the end of the log */
+gboolean aichat_history_log_append(AiChatHistoryLog *log, AiChatRole role, const gchar *content, gssize len, GError **error);
+
+/* Replace the log's contents with all of @history, such as after its older
+ * turns were replaced by a summary.  None of the log's turns may have been
+ * left on disk. */
+gboolean aichat_history_log_rewrite(AiChatHistoryLog *log, AiChatHistory *history, GError **error);
+
+#endif /* _HISTORYLOG_H_ */
@@ -0,0 +1,544 @@
+/*
+ * pidgin-aichat
+ *
+ * Copyright (C) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <string.h>
+#include "jsonpull.h"
+
+/* Deepest nesting scanned before the document is given up on */
+#define AICHAT_JSON_PULL_MAX_NESTING 256
+
+/* Component index values that aren't array indices */
+#define AICHAT_JSON_PULL_KEY -1
+#define AICHAT_JSON_PULL_ANY -2
+
+typedef struct {
+	const gchar *p;
+	const gchar *end;
+	const AiChatJsonPullPaths *paths;
+	AiChatJsonPullFunc func;
+	gpointer user_data;
+	gboolean stopped;
+} AiChatJsonPullContext;
+
+/* Break the paths up into components, once for the life of @paths */
+static gboolean
+aichat_json_pull_compile(AiChatJsonPullPaths *paths)
+{
+	guint i;
+
+	if (paths->compiled) {
+		return TRUE;
+	}
+
+	for (i = 0; paths->paths[i] != NULL; i++) {
+		const gchar *name = paths->paths[i];
+		guint depth = 0;
+
+		g_return_val_if_fail(i < AICHAT_JSON_PULL_MAX_PATHS, FALSE);
+
+		/* The empty path is the document itself */
+		while (*name) {
+			AiChatJsonPullComponent *component;
+			const gchar *dot = strchr(name, '.');
+			gsize len = dot ? (gsize) (dot - name) : strlen(name);
+			gsize j;
+
+			g_return_val_if_fail(depth < AICHAT_JSON_PULL_MAX_PATH_DEPTH, FALSE);
+
+			component = &paths->components[i][depth++];
+			component->name = name;
+			component->len = len;
+			if (len == 1 && *name == '*') {
+				component->index = AICHAT_JSON_PULL_ANY;
+			} else {
+				component->index = len > 0 && len < 9 ? 0 : AICHAT_JSON_PULL_KEY;
+				for (j = 0; j < len && component->index >= 0; j++) {
+					if (g_ascii_isdigit(name[j])) {
+						component->index = component->index * 10 + (name[j] - '0');
+					} else {
+						component->index = AICHAT_JSON_PULL_KEY;
+					}
+				}
+			}
+
+			name += len;
+			if (*name == '.') {
+				name++;
+			}
+		}
+		paths->depths[i] = depth;
+	}
+	paths->n_paths = i;
+	paths->compiled = TRUE;
+
+	return TRUE;
+}
+
+static inline void
+aichat_json_pull_skip_whitespace(AiChatJsonPullContext *ctx)
+{
+	while (ctx->p < ctx->end && (*ctx->p == ' ' || *ctx->p == '\n' || *ctx->p == '\r' || *ctx->p == '\t')) {
+		ctx->p++;
+	}
+}
+
+/* Scan the string starting at the opening quote, leaving out the quotes */
+static gboolean
+aichat_json_pull_scan_string(AiChatJsonPullContext *ctx, const gchar **start, gsize *len)
+{
+	const gchar *p = ctx->p + 1;
+
+	*start = p;
+	while (p < ctx->end) {
+		if (*p == '"') {
+			*len = p - *start;
+			ctx->p = p + 1;
+			return TRUE;
+		}
+		/* The escape itself is checked when unescaping; here it only
+		 * matters that an escaped quote doesn't end the string */
+		p += *p == '\\' ? 2 : 1;
+	}
+
+	return FALSE;
+}
+
+static gboolean
+aichat_json_pull_scan_literal(AiChatJsonPullContext *ctx, const gchar *literal, gsize len)
+{
+	if ((gsize) (ctx->end - ctx->p) < len || memcmp(ctx->p, literal, len) != 0) {
+		return FALSE;
+	}
+	ctx->p += len;
+
+	return TRUE;
+}
+
+/* Paths of @mask whose component at @depth names the member @name */
+static guint32
+aichat_json_pull_match_member(AiChatJsonPullContext *ctx, guint32 mask, guint depth, const gchar *name, gsize len)
+{
+	guint32 matched = 0;
+	guint i;
+
+	for (i = 0; mask != 0; i++, mask >>= 1) {
+		const AiChatJsonPullComponent *component = &ctx->paths->components[i][depth];
+
+		if ((mask & 1) && (component->index == AICHAT_JSON_PULL_ANY ||
+				(component->len == len && memcmp(component->name, name, len) == 0))) {
+			matched |= 1u << i;
+		}
+	}
+
+	return matched;
+}
+
+/* Paths of @mask whose component at @depth is element @index */
+static guint32
+aichat_json_pull_match_element(AiChatJsonPullContext *ctx, guint32 mask, guint depth, gint index)
+{
+	guint32 matched = 0;
+	guint i;
+
+	for (i = 0; mask != 0; i++, mask >>= 1) {
+		const AiChatJsonPullComponent *component = &ctx->paths->components[i][depth];
+
+		if ((mask & 1) && (component->index == AICHAT_JSON_PULL_ANY || component->index == index)) {
+			matched |= 1u << i;
+		}
+	}
+
+	return matched;
+}
+
+/* Scan the value at the current position, which is @depth levels down and
+ * on the way to the paths in @mask */
+static gboolean
+aichat_json_pull_scan_value(AiChatJsonPullContext *ctx, guint depth, guint32 mask)
+{
+	AiChatJsonPullValue value;
+	guint32 here = 0;
+	guint32 below = 0;
+	guint i;
+
+	if (depth > AICHAT_JSON_PULL_MAX_NESTING) {
+		return FALSE;
+	}
+
+	for (i = 0; i < ctx->paths->n_paths; i++) {
+		if (mask & (1u << i)) {
+			if (ctx->paths->depths[i] == depth) {
+				here |= 1u << i;
+			} else if (depth < AICHAT_JSON_PULL_MAX_PATH_DEPTH) {
+				below |= 1u << i;
+			}
+		}
+	}
+
+	aichat_json_pull_skip_whitespace(ctx);
+	if (ctx->p >= ctx->end) {
+		return FALSE;
+	}
+
+	value.data = ctx->p;
+
+	switch (*ctx->p) {
+	case '{':
+		value.type = AICHAT_JSON_PULL_OBJECT;
+		ctx->p++;
+		aichat_json_pull_skip_whitespace(ctx);
+		if (ctx->p < ctx->end && *ctx->p == '}') {
+			ctx->p++;
+			break;
+		}
+		for (;;) {
+			const gchar *name;
+			gsize name_len;
+
+			aichat_json_pull_skip_whitespace(ctx);
+			if (ctx->p >= ctx->end || *ctx->p != '"' ||
+					!aichat_json_pull_scan_string(ctx, &name, &name_len)) {
+				return FALSE;
+			}
+			aichat_json_pull_skip_whitespace(ctx);
+			if (ctx->p >= ctx->end || *ctx->p != ':') {
+				return FALSE;
+			}
+			ctx->p++;
+
+			if (!aichat_json_pull_scan_value(ctx, depth + 1,
+					below ? aichat_json_pull_match_member(ctx, below, depth, name, name_len) : 0)) {
+				return FALSE;
+			}
+			if (ctx->stopped) {
+				return TRUE;
+			}
+
+			aichat_json_pull_skip_whitespace(ctx);
+			if (ctx->p < ctx->end && *ctx->p == ',') {
+				ctx->p++;
+			} else if (ctx->p < ctx->end && *ctx->p == '}') {
+				ctx->p++;
+				break;
+			} else {
+				return FALSE;
+			}
+		}
+		break;
+
+	case '[':
+		value.type = AICHAT_JSON_PULL_ARRAY;
+		ctx->p++;
+		aichat_json_pull_skip_whitespace(ctx);
+		if (ctx->p < ctx->end && *ctx->p == ']') {
+			ctx->p++;
+			break;
+		}
+		for (i = 0; ; i++) {
+			if (!aichat_json_pull_scan_value(ctx, depth + 1,
+					below ? aichat_json_pull_match_element(ctx, below, depth, i) : 0)) {
+				return FALSE;
+			}
+			if (ctx->stopped) {
+				return TRUE;
+			}
+
+			aichat_json_pull_skip_whitespace(ctx);
+			if (ctx->p < ctx->end && *ctx->p == ',') {
+				ctx->p++;
+			} else if (ctx->p < ctx->end && *ctx->p == ']') {
+				ctx->p++;
+				break;
+			} else {
+				return FALSE;
+			}
+		}
+		break;
+
+	case '"':
+		value.type = AICHAT_JSON_PULL_STRING;
+		if (!aichat_json_pull_scan_string(ctx, &value.data, &value.len)) {
+			return FALSE;
+		}
+		break;
+
+	case 't':
+		value.type = AICHAT_JSON_PULL_BOOLEAN;
+		if (!aichat_json_pull_scan_literal(ctx, "true", 4)) {
+			return FALSE;
+		}
+		break;
+
+	case 'f':
+		value.type = AICHAT_JSON_PULL_BOOLEAN;
+		if (!aichat_json_pull_scan_literal(ctx, "false", 5)) {
+			return FALSE;
+		}
+		break;
+
+	case 'n':
+		value.type = AICHAT_JSON_PULL_NULL;
+		if (!aichat_json_pull_scan_literal(ctx, "null", 4)) {
+			return FALSE;
+		}
+		break;
+
+	default:
+		if (*ctx->p != '-' && !g_ascii_isdigit(*ctx->p)) {
+			return FALSE;
+		}
+		value.type = AICHAT_JSON_PULL_NUMBER;
+		ctx->p++;
+		while (ctx->p < ctx->end && (g_ascii_isdigit(*ctx->p) || *ctx->p == '.' ||
+				*ctx->p == 'e' || *ctx->p == 'E' || *ctx->p == '+' || *ctx->p == '-')) {
+			ctx->p++;
+		}
+		break;
+	}
+
+	if (value.type != AICHAT_JSON_PULL_STRING) {
+		value.len = ctx->p - value.data;
+	}
+
+	for (i = 0; here != 0; i++, here >>= 1) {
+		if ((here & 1) && !ctx->func(i, &value, ctx->user_data)) {
+			ctx->stopped = TRUE;
+			break;
+		}
+	}
+
+	return TRUE;
+}
+
+gboolean
+aichat_json_pull_foreach(const gchar *data, gssize len, AiChatJsonPullPaths *paths,
+	AiChatJsonPullFunc func, gpointer user_data)
+{
+	AiChatJsonPullContext ctx;
+
+	g_return_val_if_fail(paths != NULL, FALSE);
+	g_return_val_if_fail(func != NULL, FALSE);
+
+	if (data == NULL) {
+		return FALSE;
+	}
+	if (len < 0) {
+		len = strlen(data);
+	}
+
+	if (!aichat_json_pull_compile(paths)) {
+		return FALSE;
+	}
+	ctx.paths = paths;
+	ctx.p = data;
+	ctx.end = data + len;
+	ctx.func = func;
+	ctx.user_data = user_data;
+	ctx.stopped = FALSE;
+
+	if (!aichat_json_pull_scan_value(&ctx, 0, (1u << paths->n_paths) - 1)) {
+		return FALSE;
+	}
+	if (ctx.stopped) {
+		return TRUE;
+	}
+
+	aichat_json_pull_skip_whitespace(&ctx);
+
+	return ctx.p == ctx.end;
+}
+
+typedef struct {
+	AiChatJsonPullValue *values;
+	guint32 missing;
+} AiChatJsonPullFirst;
+
+static gboolean
+aichat_json_pull_first_cb(guint path, const AiChatJsonPullValue *value, gpointer user_data)
+{
+	AiChatJsonPullFirst *first = user_data;
+
+	if (first->missing & (1u << path)) {
+		first->values[path] = *value;
+		first->missing &= ~(1u << path);
+	}
+
+	return first->missing != 0;
+}
+
+gboolean
+aichat_json_pull(const gchar *data, gssize len, AiChatJsonPullPaths *paths, AiChatJsonPullValue *values)
+{
+	AiChatJsonPullFirst first;
+
+	if (!aichat_json_pull_compile(paths)) {
+		return FALSE;
+	}
+
+	memset(values, 0, paths->n_paths * sizeof(AiChatJsonPullValue));
+	first.values = values;
+	first.missing = (1u << paths->n_paths) - 1;
+
+	return aichat_json_pull_foreach(data, len, paths, aichat_json_pull_first_cb, &first);
+}
+
+static gint
+aichat_json_pull_hex(const gchar *p)
+{
+	gint value = 0;
+	gint i;
+
+	for (i = 0; i < 4; i++) {
+		gint digit = g_ascii_xdigit_value(p[i]);
+		if (digit < 0) {
+			return -1;
+		}
+		value = value * 16 + digit;
+	}
+
+	return value;
+}
+
+gboolean
+aichat_json_pull_append_string(GString *out, const AiChatJsonPullValue *value)
+{
+	const gchar *p, *end, *escape;
+	gsize start_len;
+
+	g_return_val_if_fail(out != NULL, FALSE);
+
+	if (value == NULL || value->type != AICHAT_JSON_PULL_STRING) {
+		return FALSE;
+	}
+
+	start_len = out->len;
+	p = value->data;
+	end = p + value->len;
+
+	while ((escape = memchr(p, '\\', end - p)) != NULL) {
+		gunichar c;
+		gint hex;
+
+		g_string_append_len(out, p, escape - p);
+		p = escape + 1;
+		if (p >= end) {
+			goto invalid;
+		}
+
+		switch (*p++) {
+		case '"':  g_string_append_c(out, '"'); continue;
+		case '\\': g_string_append_c(out, '\\'); continue;
+		case '/':  g_string_append_c(out, '/'); continue;
+		case 'b':  g_string_append_c(out, '\b'); continue;
+		case 'f':  g_string_append_c(out, '\f'); continue;
+		case 'n':  g_string_append_c(out, '\n'); continue;
+		case 'r':  g_string_append_c(out, '\r'); continue;
+		case 't':  g_string_append_c(out, '\t'); continue;
+		case 'u':  break;
+		default:   goto invalid;
+		}
+
+		if (end - p < 4 || (hex = aichat_json_pull_hex(p)) < 0) {
+			goto invalid;
+		}
+		c = hex;
+		p += 4;
+
+		/* Characters outside the BMP come as a surrogate pair */
+		if (c >= 0xD800 && c < 0xDC00) {
+			if (end - p < 6 || p[0] != '\\' || p[1] != 'u' ||
+					(hex = aichat_json_pull_hex(p + 2)) < 0xDC00 || hex >= 0xE000) {
+				goto invalid;
+			}
+			c = 0x10000 + ((c - 0xD800) << 10) + (hex - 0xDC00);
+			p += 6;
+		} else if (c >= 0xDC00 && c < 0xE000) {
+			goto invalid;
+		}
+
+		g_string_append_unichar(out, c);
+	}
+	g_string_append_len(out, p, end - p);
+
+	return TRUE;
+
+invalid:
+	g_string_truncate(out, start_len);
+	return FALSE;
+}
+
+gchar *
+aichat_json_pull_dup_string(const AiChatJsonPullValue *value)
+{
+	GString *out;
+
+	if (value == NULL || value->type != AICHAT_JSON_PULL_STRING) {
+		return NULL;
+	}
+
+	out = g_string_sized_new(value->len);
+	if (!aichat_json_pull_append_string(out, value)) {
+		g_string_free(out, TRUE);
+		return NULL;
+	}
+
+	return g_string_free(out, FALSE);
+}
+
+gint64
+aichat_json_pull_get_int(const AiChatJsonPullValue *value)
+{
+	gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+	if (value == NULL || value->type != AICHAT_JSON_PULL_NUMBER || value->len >= sizeof(buf)) {
+		return 0;
+	}
+
+	/* The input needn't be NUL-terminated after the number */
+	memcpy(buf, value->data, value->len);
+	buf[value->len] = '\0';
+
+	if (strpbrk(buf, ".eE") != NULL) {
+		return (gint64) g_ascii_strtod(buf, NULL);
+	}
+
+	return g_ascii_strtoll(buf, NULL, 10);
+}
+
+gdouble
+aichat_json_pull_get_double(const AiChatJsonPullValue *value)
+{
+	gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+	if (value == NULL || value->type != AICHAT_JSON_PULL_NUMBER || value->len >= sizeof(buf)) {
+		return 0;
+	}
+
+	memcpy(buf, value->data, value->len);
+	buf[value->len] = '\0';
+
+	return g_ascii_strtod(buf, NULL);
+}
+
+gboolean
+aichat_json_pull_get_boolean(const AiChatJsonPullValue *value)
+{
+	return value != NULL && value->type == AICHAT_JSON_PULL_BOOLEAN && value->data[0] == 't';
+}
@@ -0,0 +1,116 @@
+/*
+ * pidgin-aichat
+ *
+ * Copyright (C) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#ifndef _JSONPULL_H_
+#define _JSONPULL_H_
+
+#include <glib.h>
+
+/* Pulling individual values out of a JSON document without building a tree.
+ *
+ * The caller names the values it wants by path, with the members and array
+ * indices leading to them separated by dots, as in "choices.0.delta.content".
+ * A "*" stands for any member or element.  The document is scanned once;
+ * everything that isn't on one of the paths is skipped over in place, and
+ * the values that are come back as spans of the input, so nothing is
+ * allocated unless a string has to be unescaped.  Member names are compared
+ * as written, without unescaping them.
+ *
+ * Each list of paths is held in an AiChatJsonPullPaths, usually a static
+ * one next to the list, which is compiled the first time it's used:
+ *
+ *   static const gchar * const paths[] = { "choices.0.delta.content", NULL };
+ *   static AiChatJsonPullPaths compiled = AICHAT_JSON_PULL_PATHS_INIT(paths);
+ */
+
+/* Most paths that can be pulled in one pass */
+#define AICHAT_JSON_PULL_MAX_PATHS 16
+
+/* Most components a path can have */
+#define AICHAT_JSON_PULL_MAX_PATH_DEPTH 8
+
+typedef enum {
+	AICHAT_JSON_PULL_NONE = 0,  /* Not found */
+	AICHAT_JSON_PULL_NULL,
+	AICHAT_JSON_PULL_BOOLEAN,
+	AICHAT_JSON_PULL_NUMBER,
+	AICHAT_JSON_PULL_STRING,
+	AICHAT_JSON_PULL_OBJECT,
+	AICHAT_JSON_PULL_ARRAY
+} AiChatJsonPullType;
+
+typedef struct _AiChatJsonPullComponent {
+	const gchar *name;
+	gsize len;
+	gint index;       /* Array index, or a negative value for members and "*" */
+} AiChatJsonPullComponent;
+
+/* A NULL-terminated list of paths, which must outlive it, and the list
+ * broken up into components */
+typedef struct _AiChatJsonPullPaths {
+	const gchar * const *paths;
+	gboolean compiled;
+	guint n_paths;
+	guint depths[AICHAT_JSON_PULL_MAX_PATHS];
+	AiChatJsonPullComponent components[AICHAT_JSON_PULL_MAX_PATHS][AICHAT_JSON_PULL_MAX_PATH_DEPTH];
+} AiChatJsonPullPaths;
+
+#define AICHAT_JSON_PULL_PATHS_INIT(paths) { (paths), FALSE, 0, { 0 }, { { { NULL, 0, 0 } } } }
+
+/* A value found in the input.  @data points into the input and is not
+ * NUL-terminated; for strings the quotes are left out, for objects and
+ * arrays it covers the whole value as written. */
+typedef struct _AiChatJsonPullValue {
+	AiChatJsonPullType type;
+	const gchar *data;
+	gsize len;
+} AiChatJsonPullValue;
+
+/* Called for every value on path number @path, in document order.  Return
+ * FALSE to stop scanning. */
+typedef gboolean (*AiChatJsonPullFunc)(guint path, const AiChatJsonPullValue *value, gpointer user_data);
+
+/* Scan @data (@len bytes, or NUL-terminated if @len is -1) for the values on
+ * @paths.  Returns FALSE if the document turned out not to be valid JSON;
+ * whatever was found before the error has already been passed to @func. */
+gboolean aichat_json_pull_foreach(const gchar *data, gssize len, AiChatJsonPullPaths *paths,
+	AiChatJsonPullFunc func, gpointer user_data);
+
+/* Fill @values, which has one slot per path, with the first value found on
+ * each of @paths.  Scanning stops once all of them have been found. */
+gboolean aichat_json_pull(const gchar *data, gssize len, AiChatJsonPullPaths *paths, AiChatJsonPullValue *values);
+
+/* Append a string value to @out, unescaped.  Returns FALSE (appending
+ * nothing) if it isn't a string or holds an invalid escape. */
+gboolean aichat_json_pull_append_string(GString *out, const AiChatJsonPullValue *value);
+
+/* Get a string value unescaped, or NULL */
+gchar *aichat_json_pull_dup_string(const AiChatJsonPullValue *value);
+
+/* Get a number value as an integer, or 0 if it isn't a number */
+gint64 aichat_json_pull_get_int(const AiChatJsonPullValue *value);
+
+/* Get a number value as a double, or 0 if it isn't a number */
+gdouble aichat_json_pull_get_double(const AiChatJsonPullValue *value);
+
+/* Get a boolean value, or FALSE if it isn't a boolean */
+gboolean aichat_json_pull_get_boolean(const AiChatJsonPullValue *value);
+
+#endif /* _JSONPULL_H_ */
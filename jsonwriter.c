@@ -0,0 +1,499 @@
+/*
+ * pidgin-aichat
+ *
+ * Copyright (C) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <string.h>
+#include <zlib.h>
+#include "jsonwriter.h"
+
+/* Containers nested deeper than this aren't tracked for separators */
+#define AICHAT_JSON_WRITER_MAX_DEPTH 64
+
+struct _AiChatJsonChunk {
+	gint ref_count;
+	gsize len;
+	gchar *data;
+};
+
+struct _AiChatJsonBody {
+	GPtrArray *chunks;      /* AiChatJsonChunk, in order */
+	gsize length;
+	guint cursor;           /* Chunk where the last read ended */
+	gsize cursor_offset;    /* Offset of that chunk in the body */
+};
+
+struct _AiChatJsonWriter {
+	GString *out;           /* Written since the last shared chunk */
+	GPtrArray *chunks;      /* Pieces before out, or NULL if there are none yet */
+	gsize chunks_len;
+	guint depth;
+	guint64 not_empty;      /* Bit n: the container at depth n has a value already */
+	gboolean after_member;  /* A member name was just written, so no separator */
+};
+
+static AiChatJsonChunk *
+aichat_json_chunk_new_take(gchar *data, gsize len)
+{
+	AiChatJsonChunk *chunk = g_new(AiChatJsonChunk, 1);
+
+	chunk->ref_count = 1;
+	chunk->len = len;
+	chunk->data = data;
+
+	return chunk;
+}
+
+AiChatJsonChunk *
+aichat_json_chunk_ref(AiChatJsonChunk *chunk)
+{
+	g_return_val_if_fail(chunk != NULL, NULL);
+
+	chunk->ref_count++;
+
+	return chunk;
+}
+
+void
+aichat_json_chunk_unref(AiChatJsonChunk *chunk)
+{
+	if (chunk == NULL || --chunk->ref_count > 0) {
+		return;
+	}
+
+	g_free(chunk->data);
+	g_free(chunk);
+}
+
+const gchar *
+aichat_json_chunk_get_data(const AiChatJsonChunk *chunk, gsize *length)
+{
+	g_return_val_if_fail(chunk != NULL, NULL);
+
+	if (length) {
+		*length = chunk->len;
+	}
+	return chunk->data;
+}
+
+AiChatJsonWriter *
+aichat_json_writer_new(gsize reserve)
+{
+	AiChatJsonWriter *writer = g_new0(AiChatJsonWriter, 1);
+
+	writer->out = g_string_sized_new(reserve);
+
+	return writer;
+}
+
+void
+aichat_json_writer_free(AiChatJsonWriter *writer)
+{
+	if (writer == NULL) {
+		return;
+	}
+
+	if (writer->chunks != NULL) {
+		g_ptr_array_free(writer->chunks, TRUE);
+	}
+	g_string_free(writer->out, TRUE);
+	g_free(writer);
+}
+
+/* Move what's been written since the last shared chunk into a chunk of its own */
+static void
+aichat_json_writer_seal(AiChatJsonWriter *writer, gsize reserve)
+{
+	gsize len;
+
+	if (writer->chunks == NULL) {
+		writer->chunks = g_ptr_array_new_with_free_func((GDestroyNotify) aichat_json_chunk_unref);
+	}
+	len = writer->out->len;
+	if (len == 0) {
+		return;
+	}
+
+	g_ptr_array_add(writer->chunks, aichat_json_chunk_new_take(g_string_free(writer->out, FALSE), len));
+	writer->chunks_len += len;
+	writer->out = g_string_sized_new(reserve);
+}
+
+gchar *
+aichat_json_writer_free_to_data(AiChatJsonWriter *writer, gsize *length)
+{
+	gchar *data;
+
+	g_return_val_if_fail(writer != NULL, NULL);
+
+	if (writer->chunks != NULL) {
+		/* Put the pieces back together in front of the rest */
+		GString *whole = g_string_sized_new(writer->chunks_len + writer->out->len);
+		guint i;
+
+		for (i = 0; i < writer->chunks->len; i++) {
+			AiChatJsonChunk *chunk = g_ptr_array_index(writer->chunks, i);
+			g_string_append_len(whole, chunk->data, chunk->len);
+		}
+		g_string_append_len(whole, writer->out->str, writer->out->len);
+		g_string_free(writer->out, TRUE);
+		writer->out = whole;
+		g_ptr_array_free(writer->chunks, TRUE);
+	}
+
+	if (length) {
+		*length = writer->out->len;
+	}
+	data = g_string_free(writer->out, FALSE);
+	g_free(writer);
+
+	return data;
+}
+
+AiChatJsonChunk *
+aichat_json_writer_free_to_chunk(AiChatJsonWriter *writer)
+{
+	gsize len;
+	gchar *data = aichat_json_writer_free_to_data(writer, &len);
+
+	return aichat_json_chunk_new_take(data, len);
+}
+
+AiChatJsonBody *
+aichat_json_writer_free_to_body(AiChatJsonWriter *writer)
+{
+	AiChatJsonBody *body;
+
+	g_return_val_if_fail(writer != NULL, NULL);
+
+	aichat_json_writer_seal(writer, 0);
+
+	body = g_new0(AiChatJsonBody, 1);
+	body->chunks = writer->chunks;
+	body->length = writer->chunks_len;
+
+	g_string_free(writer->out, TRUE);
+	g_free(writer);
+
+	return body;
+}
+
+void
+aichat_json_body_free(AiChatJsonBody *body)
+{
+	if (body == NULL) {
+		return;
+	}
+
+	g_ptr_array_free(body->chunks, TRUE);
+	g_free(body);
+}
+
+gsize
+aichat_json_body_get_length(const AiChatJsonBody *body)
+{
+	g_return_val_if_fail(body != NULL, 0);
+
+	return body->length;
+}
+
+gsize
+aichat_json_body_read(AiChatJsonBody *body, gsize offset, gchar *buffer, gsize length)
+{
+	gsize copied = 0;
+
+	g_return_val_if_fail(body != NULL, 0);
+
+	/* Reads normally carry on from the last one, but a retried request starts over */
+	if (offset < body->cursor_offset) {
+		body->cursor = 0;
+		body->cursor_offset = 0;
+	}
+
+	while (copied < length && body->cursor < body->chunks->len) {
+		AiChatJsonChunk *chunk = g_ptr_array_index(body->chunks, body->cursor);
+		gsize skip, n;
+
+		if (offset >= body->cursor_offset + chunk->len) {
+			body->cursor_offset += chunk->len;
+			body->cursor++;
+			continue;
+		}
+
+		skip = offset - body->cursor_offset;
+		n = MIN(chunk->len - skip, length - copied);
+		memcpy(buffer + copied, chunk->data + skip, n);
+		copied += n;
+		offset += n;
+	}
+
+	return copied;
+}
+
+AiChatJsonBody *
+aichat_json_body_gzip(const AiChatJsonBody *body)
+{
+	AiChatJsonBody *compressed;
+	z_stream zs;
+	gchar *out;
+	gsize bound;
+	guint i;
+	int ret = Z_OK;
+
+	g_return_val_if_fail(body != NULL, NULL);
+
+	memset(&zs, 0, sizeof(zs));
+	/* 16 + MAX_WBITS asks for a gzip header and trailer rather than zlib's */
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return NULL;
+	}
+
+	/* With room for the worst case, every chunk goes in with one call */
+	bound = deflateBound(&zs, body->length);
+	out = g_malloc(bound);
+	zs.next_out = (Bytef *) out;
+	zs.avail_out = bound;
+
+	for (i = 0; i < body->chunks->len && ret == Z_OK; i++) {
+		AiChatJsonChunk *chunk = g_ptr_array_index(body->chunks, i);
+
+		zs.next_in = (Bytef *) chunk->data;
+		zs.avail_in = chunk->len;
+		ret = deflate(&zs, i + 1 == body->chunks->len ? Z_FINISH : Z_NO_FLUSH);
+	}
+	if (body->chunks->len == 0) {
+		ret = deflate(&zs, Z_FINISH);
+	}
+	deflateEnd(&zs);
+
+	if (ret != Z_STREAM_END) {
+		g_free(out);
+		return NULL;
+	}
+
+	compressed = g_new0(AiChatJsonBody, 1);
+	compressed->chunks = g_ptr_array_new_with_free_func((GDestroyNotify) aichat_json_chunk_unref);
+	g_ptr_array_add(compressed->chunks, aichat_json_chunk_new_take(g_realloc(out, zs.total_out), zs.total_out));
+	compressed->length = zs.total_out;
+
+	return compressed;
+}
+
+/* Write the separator needed before a value, and note that the current
+ * container isn't empty any more */
+static void
+aichat_json_writer_value(AiChatJsonWriter *writer)
+{
+	guint64 bit = G_GUINT64_CONSTANT(1) << MIN(writer->depth, AICHAT_JSON_WRITER_MAX_DEPTH - 1);
+
+	if (writer->after_member) {
+		writer->after_member = FALSE;
+	} else if (writer->not_empty & bit) {
+		g_string_append_c(writer->out, ',');
+	}
+	writer->not_empty |= bit;
+}
+
+static void
+aichat_json_writer_open(AiChatJsonWriter *writer, gchar c)
+{
+	aichat_json_writer_value(writer);
+	g_string_append_c(writer->out, c);
+	writer->depth++;
+	if (writer->depth < AICHAT_JSON_WRITER_MAX_DEPTH) {
+		writer->not_empty &= ~(G_GUINT64_CONSTANT(1) << writer->depth);
+	}
+}
+
+static void
+aichat_json_writer_close(AiChatJsonWriter *writer, gchar c)
+{
+	g_return_if_fail(writer->depth > 0);
+
+	writer->depth--;
+	g_string_append_c(writer->out, c);
+}
+
+void
+aichat_json_writer_begin_object(AiChatJsonWriter *writer)
+{
+	aichat_json_writer_open(writer, '{');
+}
+
+void
+aichat_json_writer_end_object(AiChatJsonWriter *writer)
+{
+	aichat_json_writer_close(writer, '}');
+}
+
+void
+aichat_json_writer_begin_array(AiChatJsonWriter *writer)
+{
+	aichat_json_writer_open(writer, '[');
+}
+
+void
+aichat_json_writer_end_array(AiChatJsonWriter *writer)
+{
+	aichat_json_writer_close(writer, ']');
+}
+
+void
+aichat_json_writer_member(AiChatJsonWriter *writer, const gchar *name)
+{
+	aichat_json_writer_value(writer);
+	aichat_json_append_string(writer->out, name);
+	g_string_append_c(writer->out, ':');
+	writer->after_member = TRUE;
+}
+
+void
+aichat_json_writer_string(AiChatJsonWriter *writer, const gchar *value)
+{
+	aichat_json_writer_value(writer);
+	if (value == NULL) {
+		g_string_append(writer->out, "null");
+	} else {
+		aichat_json_append_string(writer->out, value);
+	}
+}
+
+void
+aichat_json_writer_int(AiChatJsonWriter *writer, gint64 value)
+{
+	aichat_json_writer_value(writer);
+	g_string_append_printf(writer->out, "%" G_GINT64_FORMAT, value);
+}
+
+void
+aichat_json_writer_double(AiChatJsonWriter *writer, gdouble value)
+{
+	gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+	aichat_json_writer_value(writer);
+	/* %.15g keeps 0.7 as 0.7, where g_ascii_dtostr() would round-trip it as 0.69999999999999996 */
+	g_string_append(writer->out, g_ascii_formatd(buf, sizeof(buf), "%.15g", value));
+}
+
+void
+aichat_json_writer_boolean(AiChatJsonWriter *writer, gboolean value)
+{
+	aichat_json_writer_value(writer);
+	g_string_append(writer->out, value ? "true" : "false");
+}
+
+void
+aichat_json_writer_null(AiChatJsonWriter *writer)
+{
+	aichat_json_writer_value(writer);
+	g_string_append(writer->out, "null");
+}
+
+void
+aichat_json_writer_raw(AiChatJsonWriter *writer, const gchar *json, gsize len)
+{
+	aichat_json_writer_value(writer);
+	g_string_append_len(writer->out, json, len);
+}
+
+void
+aichat_json_writer_chunk(AiChatJsonWriter *writer, AiChatJsonChunk *chunk)
+{
+	g_return_if_fail(chunk != NULL);
+
+	aichat_json_writer_value(writer);
+	aichat_json_writer_seal(writer, 256);
+	g_ptr_array_add(writer->chunks, aichat_json_chunk_ref(chunk));
+	writer->chunks_len += chunk->len;
+}
+
+void
+aichat_json_writer_string_member(AiChatJsonWriter *writer, const gchar *name, const gchar *value)
+{
+	aichat_json_writer_member(writer, name);
+	aichat_json_writer_string(writer, value);
+}
+
+void
+aichat_json_writer_int_member(AiChatJsonWriter *writer, const gchar *name, gint64 value)
+{
+	aichat_json_writer_member(writer, name);
+	aichat_json_writer_int(writer, value);
+}
+
+void
+aichat_json_writer_double_member(AiChatJsonWriter *writer, const gchar *name, gdouble value)
+{
+	aichat_json_writer_member(writer, name);
+	aichat_json_writer_double(writer, value);
+}
+
+void
+aichat_json_writer_boolean_member(AiChatJsonWriter *writer, const gchar *name, gboolean value)
+{
+	aichat_json_writer_member(writer, name);
+	aichat_json_writer_boolean(writer, value);
+}
+
+void
+aichat_json_append_string(GString *out, const gchar *value)
+{
+	/* What each byte is written as: 0 as itself, 'u' as \u00XX, else as '\\' and that character */
+	static const gchar escapes[256] = {
+		'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+		'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+		0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0,
+		/* Everything from 0x60 up, UTF-8 included, is copied as is */
+	};
+	static const gchar hex[] = "0123456789abcdef";
+	const guchar *p = (const guchar *) value;
+	const guchar *run = p;
+
+	g_string_append_c(out, '"');
+
+	/* Copy runs of characters that need no escaping in one go */
+	for (; *p; p++) {
+		gchar escape = escapes[*p];
+		gchar buf[6];
+
+		if (G_LIKELY(escape == 0)) {
+			continue;
+		}
+
+		g_string_append_len(out, (const gchar *) run, p - run);
+		run = p + 1;
+
+		buf[0] = '\\';
+		buf[1] = escape;
+		if (escape == 'u') {
+			buf[2] = '0';
+			buf[3] = '0';
+			buf[4] = hex[*p >> 4];
+			buf[5] = hex[*p & 0xf];
+			g_string_append_len(out, buf, 6);
+		} else {
+			g_string_append_len(out, buf, 2);
+		}
+	}
+	g_string_append_len(out, (const gchar *) run, p - run);
+
+	g_string_append_c(out, '"');
+}
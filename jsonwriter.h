@@ -0,0 +1,105 @@
+/*
+ * pidgin-aichat
+ *
+ * Copyright (C) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#ifndef _JSONWRITER_H_
+#define _JSONWRITER_H_
+
+#include <glib.h>
+
+/* Streaming JSON output, for request bodies.
+ *
+ * Values are written out in the order they're given, so a body costs one
+ * pass over its contents and no intermediate tree.  Already serialized
+ * values (e.g. a conversation turn written for an earlier request) can be
+ * spliced in, either copied with aichat_json_writer_raw() or shared with
+ * aichat_json_writer_chunk().  The writer only takes care of separators;
+ * it's up to the caller to produce well formed documents. */
+
+typedef struct _AiChatJsonWriter AiChatJsonWriter;
+
+/* An immutable, reference counted piece of serialized JSON */
+typedef struct _AiChatJsonChunk AiChatJsonChunk;
+
+/* A finished document, kept as the pieces it was written in so that large
+ * bodies never have to be put together in one buffer */
+typedef struct _AiChatJsonBody AiChatJsonBody;
+
+/* Create a writer, with room for @reserve bytes before it needs to grow */
+AiChatJsonWriter *aichat_json_writer_new(gsize reserve);
+
+/* Free a writer and what it has written */
+void aichat_json_writer_free(AiChatJsonWriter *writer);
+
+/* Free a writer, returning what it has written as one string */
+gchar *aichat_json_writer_free_to_data(AiChatJsonWriter *writer, gsize *length);
+
+/* Free a writer, returning what it has written as a chunk */
+AiChatJsonChunk *aichat_json_writer_free_to_chunk(AiChatJsonWriter *writer);
+
+/* Free a writer, returning what it has written as a body */
+AiChatJsonBody *aichat_json_writer_free_to_body(AiChatJsonWriter *writer);
+
+void aichat_json_writer_begin_object(AiChatJsonWriter *writer);
+void aichat_json_writer_end_object(AiChatJsonWriter *writer);
+void aichat_json_writer_begin_array(AiChatJsonWriter *writer);
+void aichat_json_writer_end_array(AiChatJsonWriter *writer);
+
+/* Start a member of the current object; its value is whatever is written next */
+void aichat_json_writer_member(AiChatJsonWriter *writer, const gchar *name);
+
+void aichat_json_writer_string(AiChatJsonWriter *writer, const gchar *value);
+void aichat_json_writer_int(AiChatJsonWriter *writer, gint64 value);
+void aichat_json_writer_double(AiChatJsonWriter *writer, gdouble value);
+void aichat_json_writer_boolean(AiChatJsonWriter *writer, gboolean value);
+void aichat_json_writer_null(AiChatJsonWriter *writer);
+
+/* Write a value that is already serialized */
+void aichat_json_writer_raw(AiChatJsonWriter *writer, const gchar *json, gsize len);
+
+/* Write a value that is already serialized, taking a reference to @chunk
+ * rather than copying it */
+void aichat_json_writer_chunk(AiChatJsonWriter *writer, AiChatJsonChunk *chunk);
+
+/* Shorthands for members with scalar values */
+void aichat_json_writer_string_member(AiChatJsonWriter *writer, const gchar *name, const gchar *value);
+void aichat_json_writer_int_member(AiChatJsonWriter *writer, const gchar *name, gint64 value);
+void aichat_json_writer_double_member(AiChatJsonWriter *writer, const gchar *name, gdouble value);
+void aichat_json_writer_boolean_member(AiChatJsonWriter *writer, const gchar *name, gboolean value);
+
+AiChatJsonChunk *aichat_json_chunk_ref(AiChatJsonChunk *chunk);
+void aichat_json_chunk_unref(AiChatJsonChunk *chunk);
+const gchar *aichat_json_chunk_get_data(const AiChatJsonChunk *chunk, gsize *length);
+
+void aichat_json_body_free(AiChatJsonBody *body);
+gsize aichat_json_body_get_length(const AiChatJsonBody *body);
+
+/* Copy up to @length bytes of the body, starting at @offset, into @buffer.
+ * Returns the number of bytes copied, which is less than @length only at
+ * the end of the body.  Reading on from where the last read ended is cheap. */
+gsize aichat_json_body_read(AiChatJsonBody *body, gsize offset, gchar *buffer, gsize length);
+
+/* Compress a body with gzip, for sending with "Content-Encoding: gzip".
+ * Returns a new body, or NULL if compressing failed. */
+AiChatJsonBody *aichat_json_body_gzip(const AiChatJsonBody *body);
+
+/* Append @value to @out as a quoted JSON string */
+void aichat_json_append_string(GString *out, const gchar *value);
+
+#endif /* _JSONWRITER_H_ */
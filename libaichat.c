@@ -23,6 +23,9 @@
 #include "purplecompat.h"
 #include <http.h>
 #include "markdown.h"
+#include "sse.h"
+#include "base64stream.h"
+#include "context.h"
 
 /******************************************************************************/
 /* JSON functions */
@@ -62,7 +65,12 @@ json_decode(const gchar *data, gssize len)
 	} else {
 		root = json_parser_get_root(parser);
 		if (root != NULL) {
+#if JSON_CHECK_VERSION(1, 2, 0)
+			/* Outlives the parser without copying the tree */
+			root = json_node_ref(root);
+#else
 			root = json_node_copy(root);
+#endif
 		}
 	}
 	g_object_unref(parser);
@@ -71,27 +79,70 @@ json_decode(const gchar *data, gssize len)
 }
 
 JsonObject *
-json_string_to_object(const gchar *data, gssize len)
+json_parser_load_object(JsonParser *parser, const gchar *data, gssize len)
 {
-	JsonNode *root = json_decode(data, len);
-	JsonObject *ret;
+	JsonNode *root;
+	JsonObject *ret = NULL;
 	
-	g_return_val_if_fail(root, NULL);
+	if (parser == NULL) {
+		return json_string_to_object(data, len);
+	}
 	
-	if (!JSON_NODE_HOLDS_OBJECT(root)) {
-		json_node_free(root);
+	if (!data || !json_parser_load_from_data(parser, data, len, NULL)) {
+		purple_debug_error("aichat", "Error parsing JSON: %s\n", data ? data : "(null)");
 		return NULL;
 	}
 	
-	ret = json_node_dup_object(root);
-
-	json_node_free(root);
+	/* The object is handed over as it is, rather than copied */
+#if JSON_CHECK_VERSION(1, 4, 0)
+	root = json_parser_steal_root(parser);
+#else
+	/* The parser keeps the tree alive until it next loads something */
+	root = json_parser_get_root(parser);
+#endif
+	if (root == NULL) {
+		return NULL;
+	}
+	if (JSON_NODE_HOLDS_OBJECT(root)) {
+		ret = json_object_ref(json_node_get_object(root));
+	}
+#if JSON_CHECK_VERSION(1, 4, 0)
+	json_node_unref(root);
+#endif
+	
+	return ret;
+}
 
+JsonObject *
+json_string_to_object(const gchar *data, gssize len)
+{
+	JsonParser *parser = json_parser_new();
+	JsonObject *ret = json_parser_load_object(parser, data, len);
+	
+	g_object_unref(parser);
+	
 	return ret;
 }
 
 /******************************************************************************/
 
+/* Streamed replies can take as long as they like, so long as they keep
+ * coming; these replace the fixed timeout and the 1 MB body limit, which
+ * a long reply runs into with the event framing around every token */
+#define AICHAT_STREAM_IDLE_TIMEOUT 300                 /* Seconds without an event */
+#define AICHAT_STREAM_MAX_LEN      (256 * 1024 * 1024) /* Bytes */
+
+static void
+aichat_api_connection_free(AiChatApiConnection *conn)
+{
+	if (conn->idle_timeout) {
+		g_source_remove(conn->idle_timeout);
+	}
+	aichat_sse_parser_free(conn->sse);
+	aichat_json_body_free(conn->body);
+	g_free(conn);
+}
+
 static void
 aichat_http_request_cb(PurpleHttpConnection *http_conn, PurpleHttpResponse *response, gpointer user_data)
 {
@@ -100,8 +151,34 @@ aichat_http_request_cb(PurpleHttpConnection *http_conn, PurpleHttpResponse *resp
 	gsize len;
 	JsonObject *obj;
 	
-	data = purple_http_response_get_data(response, &len);
-	obj = json_string_to_object(data, len);
+	if (conn->sse != NULL && aichat_sse_parser_is_streaming(conn->sse)) {
+		const gchar *error = conn->timed_out ? "Timed out waiting for the rest of the reply" :
+			purple_http_response_get_error(response);
+
+		/* Every event has already been handed out, a NULL object marks the
+		 * end; a stream that was cut off gets the error instead */
+		if (error != NULL) {
+			purple_debug_warning("aichat", "Stream cut off: %s\n", error);
+			if (conn->error_callback != NULL) {
+				conn->error_callback(conn->cga, error, -1, conn->user_data);
+			} else if (conn->callback != NULL) {
+				conn->callback(conn->cga, NULL, conn->user_data);
+			}
+		} else {
+			aichat_sse_parser_finish(conn->sse);
+			if (conn->callback != NULL) {
+				conn->callback(conn->cga, NULL, conn->user_data);
+			}
+		}
+		aichat_api_connection_free(conn);
+		return;
+	}
+	
+	if (conn->sse != NULL) {
+		data = aichat_sse_parser_get_raw(conn->sse, &len);
+	} else {
+		data = purple_http_response_get_data(response, &len);
+	}
 
 	if (data == NULL || len == 0) {
 		if (conn->error_callback != NULL) {
@@ -109,36 +186,149 @@ aichat_http_request_cb(PurpleHttpConnection *http_conn, PurpleHttpResponse *resp
 		} else {
 			purple_debug_error("aichat", "Error parsing response: %s\n", data);
 		}
-	} else {
-		if (conn->callback != NULL) {
-			conn->callback(conn->cga, obj, conn->user_data);
+	} else if (conn->raw_callback != NULL) {
+		conn->raw_callback(conn->cga, data, len, conn->user_data);
+	} else if (conn->callback != NULL) {
+		obj = json_parser_load_object(conn->cga->parser, data, len);
+		conn->callback(conn->cga, obj, conn->user_data);
+		if (obj != NULL) {
+			json_object_unref(obj);
 		}
 	}
-
-	json_object_unref(obj);
 	// purple_http_connection_set_remove(conn->cga->conns, conn->http_conn);
-	g_free(conn);
+	aichat_api_connection_free(conn);
+}
+
+static gboolean
+aichat_http_stream_idle_cb(gpointer user_data)
+{
+	AiChatApiConnection *conn = user_data;
+
+	/* Cancelling calls aichat_http_request_cb, which frees conn */
+	conn->idle_timeout = 0;
+	conn->timed_out = TRUE;
+	purple_http_conn_cancel(conn->http_conn);
+
+	return FALSE;
+}
+
+static void
+aichat_http_stream_event_cb(const gchar *event, const gchar *data, gsize data_len, gpointer user_data)
+{
+	AiChatApiConnection *conn = user_data;
+
+	if (conn->idle_timeout) {
+		g_source_remove(conn->idle_timeout);
+	}
+	conn->idle_timeout = g_timeout_add_seconds(AICHAT_STREAM_IDLE_TIMEOUT, aichat_http_stream_idle_cb, conn);
+
+	if (conn->stream_callback != NULL) {
+		conn->stream_callback(conn->cga, event, data, data_len, conn->user_data);
+	}
+}
+
+static void
+aichat_http_progress_cb(PurpleHttpConnection *http_conn, gboolean reading_state, int processed, int total, gpointer user_data)
+{
+	AiChatApiConnection *conn = user_data;
+
+	if (!reading_state) {
+		/* Writing the request has started, on a new or a pooled connection */
+		aichat_request_stats_mark(&conn->stats->connected);
+	} else if (processed > 0) {
+		aichat_request_stats_mark(&conn->stats->first_byte);
+	}
+}
+
+/* Send @request for @conn, timing it if @conn has stats */
+static void
+aichat_api_connection_send(AiChatApiConnection *conn, PurpleHttpRequest *request)
+{
+	AiChatAccount *cga = conn->cga;
+	PurpleHttpConnection *http_conn;
+
+	if (conn->stats != NULL) {
+		aichat_request_stats_mark(&conn->stats->built);
+	}
+
+	/* If the request fails straight away, the callback has already freed conn */
+	http_conn = purple_http_request(cga->pc, request, aichat_http_request_cb, conn);
+	if (http_conn != NULL) {
+		conn->http_conn = http_conn;
+		purple_http_connection_set_add(cga->conns, http_conn);
+		if (conn->stats != NULL) {
+			purple_http_conn_set_progress_watcher(http_conn, aichat_http_progress_cb, conn, 0);
+		}
+		if (conn->sse != NULL && !conn->idle_after_first_event) {
+			conn->idle_timeout = g_timeout_add_seconds(AICHAT_STREAM_IDLE_TIMEOUT, aichat_http_stream_idle_cb, conn);
+		}
+	}
+	purple_http_request_unref(request);
+}
+
+/* Have the response to @request parsed as it arrives and passed to @stream_callback */
+static void
+aichat_api_connection_set_stream(AiChatApiConnection *conn, PurpleHttpRequest *request, LLMStreamFormat format, AiChatStreamEventFunc stream_callback)
+{
+	conn->stream_callback = stream_callback;
+	if (format == LLM_STREAM_NDJSON) {
+		/* Local models send nothing while they read the prompt, which on a
+		 * CPU can take longer than any idle timeout */
+		conn->idle_after_first_event = TRUE;
+		conn->sse = aichat_sse_parser_new_ndjson(aichat_http_stream_event_cb, conn);
+		purple_http_request_header_set(request, "Accept", "application/x-ndjson");
+	} else {
+		conn->sse = aichat_sse_parser_new(aichat_http_stream_event_cb, conn);
+		purple_http_request_header_set(request, "Accept", "text/event-stream");
+	}
+	aichat_sse_request_set_parser(request, conn->sse);
+	purple_http_request_set_timeout(request, -1);
+	purple_http_request_set_max_len(request, AICHAT_STREAM_MAX_LEN);
+}
+
+/* PurpleHttpContentReader for request bodies held as an AiChatJsonBody */
+static void
+aichat_http_body_reader(PurpleHttpConnection *http_conn, gchar *buffer, size_t offset, size_t length, gpointer user_data, PurpleHttpContentReaderCb cb)
+{
+	AiChatJsonBody *body = user_data;
+	gsize stored = aichat_json_body_read(body, offset, buffer, length);
+
+	cb(http_conn, TRUE, offset + stored >= aichat_json_body_get_length(body), stored);
 }
 
-/* Provider-aware HTTP request function */
+/* HTTP request to @provider, with its headers, which takes over @body.  If
+ * @stream_callback is set the reply is requested as an event stream and
+ * each event is passed to it as it arrives; @callback then gets a NULL
+ * object once the stream has ended.  A response that isn't streamed goes to
+ * @raw_callback as it is, if that's set, rather than being parsed for
+ * @callback. */
 static AiChatApiConnection *
-aichat_provider_http_request(AiChatAccount *cga, const gchar *full_url, const JsonObject *obj, AiChatCallbackFunc callback, gpointer user_data)
+aichat_llm_http_request(AiChatAccount *cga, LLMProvider *provider, const gchar *full_url, AiChatJsonBody *body, AiChatStreamEventFunc stream_callback, AiChatCallbackFunc callback, AiChatRawCallbackFunc raw_callback, AiChatCallbackErrorFunc error_callback, AiChatRequestStats *stats, gpointer user_data)
 {
-	PurpleConnection *pc = cga->pc;
 	AiChatApiConnection *conn;
 	PurpleHttpRequest *request;
-	LLMProvider *provider;
-	
-	provider = llm_provider_get(cga->provider_type);
 	
 	request = purple_http_request_new(full_url);
 	purple_http_request_set_keepalive_pool(request, cga->keepalive_pool);
-	if (obj != NULL) {
-		gsize len;
-		gchar *body = json_object_to_string(obj, &len);
+	if (body != NULL) {
+		gint compress_kb = purple_account_get_int(cga->account, "compress_requests_kb", 0);
+
+		/* Only for servers known to take it, which is up to the user */
+		if (compress_kb > 0 && aichat_json_body_get_length(body) >= (gsize) compress_kb * 1024) {
+			AiChatJsonBody *compressed = aichat_json_body_gzip(body);
+
+			if (compressed != NULL) {
+				purple_debug_info("aichat", "Compressed request body from %" G_GSIZE_FORMAT " to %" G_GSIZE_FORMAT " bytes\n",
+					aichat_json_body_get_length(body), aichat_json_body_get_length(compressed));
+				aichat_json_body_free(body);
+				body = compressed;
+				purple_http_request_header_set(request, "Content-Encoding", "gzip");
+			}
+		}
 
+		/* Handed over a slice at a time as the socket takes it, rather than copied */
 		purple_http_request_set_method(request, "POST");
-		purple_http_request_set_contents(request, body, len);
+		purple_http_request_set_contents_reader(request, aichat_http_body_reader, aichat_json_body_get_length(body), body);
 		purple_http_request_header_set(request, "Content-Type", "application/json");
 	}
 	purple_http_request_set_max_redirects(request, 0);
@@ -162,23 +352,35 @@ aichat_provider_http_request(AiChatAccount *cga, const gchar *full_url, const Js
 	conn->cga = cga;
 	conn->user_data = user_data;
 	conn->callback = callback;
+	conn->raw_callback = raw_callback;
+	conn->error_callback = error_callback;
+	conn->stats = stats;
+	conn->body = body;
 	
-	conn->http_conn = purple_http_request(pc, request, aichat_http_request_cb, conn);
-	if (conn->http_conn != NULL) {
-		purple_http_connection_set_add(cga->conns, conn->http_conn);
+	if (stream_callback != NULL) {
+		aichat_api_connection_set_stream(conn, request, provider ? provider->stream_format : LLM_STREAM_SSE, stream_callback);
 	}
-	purple_http_request_unref(request);
+	
+	aichat_api_connection_send(conn, request);
 
 	return conn;
 }
 
-/* Legacy HTTP request function for OpenAI assistants API compatibility */
+/* Provider-aware HTTP request function, as aichat_llm_http_request() for
+ * the account's provider */
 static AiChatApiConnection *
-aichat_http_request(AiChatAccount *cga, const gchar *path, const JsonObject *obj, AiChatCallbackFunc callback, gpointer user_data)
+aichat_provider_http_request(AiChatAccount *cga, const gchar *full_url, AiChatJsonBody *body, AiChatStreamEventFunc stream_callback, AiChatCallbackFunc callback, AiChatRawCallbackFunc raw_callback, AiChatCallbackErrorFunc error_callback, AiChatRequestStats *stats, gpointer user_data)
+{
+	return aichat_llm_http_request(cga, llm_provider_get(cga->provider_type), full_url, body,
+		stream_callback, callback, raw_callback, error_callback, stats, user_data);
+}
+
+/* Build a request against the OpenAI API, for callers that need to handle the
+ * raw response themselves */
+static PurpleHttpRequest *
+aichat_http_request_build(AiChatAccount *cga, const gchar *path, const JsonObject *obj)
 {
-	PurpleConnection *pc = cga->pc;
 	PurpleAccount *account = cga->account;
-	AiChatApiConnection *conn;
 	PurpleHttpRequest *request;
 	gchar *url;
 	const gchar *api_key;
@@ -210,6 +412,7 @@ aichat_http_request(AiChatAccount *cga, const gchar *path, const JsonObject *obj
 		purple_http_request_set_method(request, "POST");
 		purple_http_request_set_contents(request, body, len);
 		purple_http_request_header_set(request, "Content-Type", "application/json");
+		g_free(body);
 	}
 	purple_http_request_set_max_redirects(request, 0);
 	purple_http_request_set_timeout(request, 120);
@@ -236,46 +439,84 @@ aichat_http_request(AiChatAccount *cga, const gchar *path, const JsonObject *obj
 		purple_http_request_header_set(request, "OpenAI-Beta", "assistants=v2");
 	}
 	
+	g_free(url);
+	return request;
+}
+
+/* Legacy HTTP request function for OpenAI assistants API compatibility.  As
+ * with aichat_provider_http_request, a @stream_callback asks for an event
+ * stream and a @raw_callback gets the response unparsed. */
+static AiChatApiConnection *
+aichat_http_request_full(AiChatAccount *cga, const gchar *path, const JsonObject *obj, AiChatStreamEventFunc stream_callback, AiChatCallbackFunc callback, AiChatRawCallbackFunc raw_callback, AiChatCallbackErrorFunc error_callback, AiChatRequestStats *stats, gpointer user_data)
+{
+	AiChatApiConnection *conn;
+	PurpleHttpRequest *request;
+	
+	request = aichat_http_request_build(cga, path, obj);
+	
 	conn = g_new0(AiChatApiConnection, 1);
 	conn->cga = cga;
 	conn->user_data = user_data;
 	conn->callback = callback;
+	conn->raw_callback = raw_callback;
+	conn->error_callback = error_callback;
+	conn->stats = stats;
 	
-	conn->http_conn = purple_http_request(pc, request, aichat_http_request_cb, conn);
-	if (conn->http_conn != NULL) {
-		purple_http_connection_set_add(cga->conns, conn->http_conn);
+	if (stream_callback != NULL) {
+		aichat_api_connection_set_stream(conn, request, LLM_STREAM_SSE, stream_callback);
 	}
-	purple_http_request_unref(request);
+	
+	aichat_api_connection_send(conn, request);
 
-	g_free(url);
 	return conn;
 }
 
+static AiChatApiConnection *
+aichat_http_request(AiChatAccount *cga, const gchar *path, const JsonObject *obj, AiChatCallbackFunc callback, gpointer user_data)
+{
+	return aichat_http_request_full(cga, path, obj, NULL, callback, NULL, NULL, NULL, user_data);
+}
+
 
 /******************************************************************************/
 /* AiChat functions */
 /******************************************************************************/
 
+/* A generated icon being downloaded */
+typedef struct {
+	AiChatAccount *cga;
+	gchar *id;
+	AiChatBase64Stream *b64;
+} AiChatIconRequest;
+
 static void
-aichat_create_icon_cb(AiChatAccount *cga, JsonObject *obj, gpointer user_data)
+aichat_create_icon_cb(PurpleHttpConnection *http_conn, PurpleHttpResponse *response, gpointer user_data)
 {
-	gchar *id = user_data;
-	JsonArray *data_arr = json_object_get_array_member(obj, "data");
-	JsonObject *data_obj = json_array_get_object_element(data_arr, 0);
-	const gchar *b64 = json_object_get_string_member(data_obj, "b64_json");
+	AiChatIconRequest *icon = user_data;
+	guchar *data;
+	gsize len;
 
-	if (b64) {
-		gsize len;
-		guchar *data = g_base64_decode(b64, &len);
-		purple_buddy_icons_set_for_user(cga->account, id, data, len, NULL);
+	/* Decoded as it arrived; the buffer goes to the icon cache as it is */
+	data = aichat_base64_stream_steal(icon->b64, &len);
+	if (data != NULL) {
+		purple_buddy_icons_set_for_user(icon->cga->account, icon->id, data, len, NULL);
+	} else {
+		purple_debug_error("aichat", "Error generating icon for %s (%d)\n",
+			icon->id, purple_http_response_get_code(response));
 	}
 
-	g_free(id);
+	aichat_base64_stream_free(icon->b64);
+	g_free(icon->id);
+	g_free(icon);
 }
 
 static void
 aichat_create_icon(AiChatAccount *cga, const gchar *id, const gchar *instructions)
 {
+	AiChatIconRequest *icon;
+	PurpleHttpRequest *request;
+	PurpleHttpConnection *http_conn;
+
 	if (!purple_account_get_bool(cga->account, "generate_icons", TRUE)) {
 		return;
 	}
@@ -288,8 +529,23 @@ aichat_create_icon(AiChatAccount *cga, const gchar *id, const gchar *instruction
 	json_object_set_string_member(obj, "size", "256x256");
 	json_object_set_string_member(obj, "model", "dall-e-2");
 	json_object_set_string_member(obj, "response_format", "b64_json");
-	
-	aichat_http_request(cga, "/v1/images/generations", obj, aichat_create_icon_cb, g_strdup(id));
+	g_free(prompt);
+
+	icon = g_new0(AiChatIconRequest, 1);
+	icon->cga = cga;
+	icon->id = g_strdup(id);
+	icon->b64 = aichat_base64_stream_new("b64_json");
+
+	/* The response is mostly the image, so it's decoded as it comes in
+	 * instead of being parsed once it's all there */
+	request = aichat_http_request_build(cga, "/v1/images/generations", obj);
+	aichat_base64_stream_request_set(request, icon->b64);
+	http_conn = purple_http_request(cga->pc, request, aichat_create_icon_cb, icon);
+	if (http_conn != NULL) {
+		purple_http_connection_set_add(cga->conns, http_conn);
+	}
+	purple_http_request_unref(request);
+	json_object_unref(obj);
 }
 
 static void
@@ -338,10 +594,10 @@ aichat_create_assistant_cb(AiChatAccount *cga, JsonObject *obj, gpointer user_da
 	purple_buddy_set_protocol_data(buddy, cbuddy);
 	
 	cbuddy->buddy = buddy;
-	cbuddy->instructions = g_strdup(json_object_get_string_member(obj, "instructions"));
-	cbuddy->name = g_strdup(json_object_get_string_member(obj, "name"));
-	cbuddy->description = g_strdup(json_object_get_string_member(obj, "description"));
-	cbuddy->model = g_strdup(json_object_get_string_member(obj, "model"));
+	cbuddy->instructions = aichat_string_intern(json_object_get_string_member(obj, "instructions"));
+	cbuddy->name = aichat_string_intern(json_object_get_string_member(obj, "name"));
+	cbuddy->description = aichat_string_intern(json_object_get_string_member(obj, "description"));
+	cbuddy->model = aichat_string_intern(json_object_get_string_member(obj, "model"));
 
 	JsonObject *thread_obj = json_object_new();
 	// create a thread for the assistant
@@ -361,56 +617,1242 @@ aichat_create_assistant(AiChatAccount *cga, const gchar *instructions)
 	json_object_unref(obj);
 }
 
+/* How a streamed reply is split into messages.  IMs can't be edited, so the
+ * text is shown as a series of messages; these keep the series short. */
+#define AICHAT_REPLY_INTERVAL   250    /* Minimum milliseconds between pieces */
+#define AICHAT_REPLY_MAX_PIECE  8192   /* Longest piece shown as one message, in bytes */
+
+/* State of one reply, shared by the streamed and one-shot paths */
+typedef struct {
+	AiChatAccount *cga;
+	gchar *buddy_id;
+	LLMProvider *provider;
+	LLMStreamState state;
+	GString *text;        /* Reply text received so far */
+	gsize delivered;      /* Length of text already shown in the conversation */
+	gsize scanned;        /* Length of text checked for paragraph breaks */
+	gsize sentence_scanned;  /* Length of text checked for sentence ends */
+	gboolean in_fence;    /* scanned ends inside a ``` code block */
+	gsize paragraph_cut;  /* End of the last paragraph outside a code block */
+	gsize sentence_cut;   /* End of the last sentence outside a code block */
+	gboolean by_sentence; /* Show each sentence as it's done, rather than each paragraph */
+	gint64 last_delivery; /* When the last piece was shown */
+	guint flush_timeout;  /* Shows what's waiting once AICHAT_REPLY_INTERVAL is up */
+	guint pieces;         /* Messages shown so far */
+	gboolean finishing;   /* Complete, and in the account's finishing list until the rest is shown */
+	gboolean logged;      /* The reply was shown (and so logged) as one message */
+	gboolean remote_history; /* The server keeps the conversation (assistant threads) */
+	MarkdownStream *markdown;  /* Converts the text as it's delivered */
+	gchar *reopen_tags;   /* Formatting left open by the last delivered piece */
+	GString *html;        /* The reply as one piece of HTML, for the log */
+	gchar *error;
+	AiChatRequestStats stats;
+} AiChatReply;
+
+static AiChatReply *
+aichat_reply_new(AiChatAccount *cga, const gchar *buddy_id, LLMProvider *provider)
+{
+	AiChatReply *reply = g_new0(AiChatReply, 1);
+
+	reply->cga = cga;
+	reply->buddy_id = g_strdup(buddy_id);
+	reply->provider = provider;
+	reply->state.delta = g_string_new(NULL);
+	reply->state.parser = g_object_ref(cga->parser);
+	reply->text = g_string_new(NULL);
+	reply->html = g_string_new(NULL);
+	reply->markdown = markdown_stream_new(TRUE, FALSE);
+	reply->by_sentence = purple_strequal(purple_account_get_string(cga->account, "stream_pace", "paragraph"), "sentence");
+	aichat_request_stats_start(&reply->stats);
+
+	return reply;
+}
+
 static void
-aichat_send_message_cb(AiChatAccount *cga, JsonObject *obj, gpointer user_data)
+aichat_reply_free(AiChatReply *reply)
 {
-	gchar *assistant_id = user_data;
-	JsonArray *data_arr = json_object_get_array_member(obj, "data");
-	JsonObject *data_obj = json_array_get_object_element(data_arr, 0);
-	JsonArray *content = json_object_get_array_member(data_obj, "content");
-	JsonObject *content_obj = json_array_get_object_element(content, 0);
-	JsonObject *text = json_object_get_object_member(content_obj, "text");
-	const gchar *text_value = json_object_get_string_member(text, "value");
+	if (reply->flush_timeout) {
+		g_source_remove(reply->flush_timeout);
+	}
+	g_string_free(reply->state.delta, TRUE);
+	g_object_unref(reply->state.parser);
+	g_string_free(reply->text, TRUE);
+	g_string_free(reply->html, TRUE);
+	markdown_stream_free(reply->markdown);
+	g_free(reply->reopen_tags);
+	g_free(reply->buddy_id);
+	g_free(reply->error);
+	g_free(reply);
+}
 
-	if (text_value == NULL) {
-		serv_got_typing_stopped(cga->pc, assistant_id);
-		purple_debug_error("aichat", "No content found in message\n");
-		g_free(assistant_id);
+/* Show the text up to @end as a message of its own.  The text goes through
+ * one markdown stream for the whole reply, so formatting carries across
+ * pieces; whatever is still open at the cut is closed here and reopened at
+ * the start of the next piece.  Only a reply shown in one go is logged as
+ * it's shown, otherwise aichat_reply_finish() logs the whole of it. */
+static void
+aichat_reply_deliver(AiChatReply *reply, gsize end, gboolean last)
+{
+	const gchar *chunk = reply->text->str + reply->delivered;
+	gsize chunk_len = end - reply->delivered;
+	GString *html = g_string_new(reply->reopen_tags);
+	gsize start = html->len;
+	gchar *piece;
+	gsize i;
+
+	piece = markdown_stream_append(reply->markdown, chunk, chunk_len);
+	g_string_append(html, piece);
+	g_string_append(reply->html, piece);
+	g_free(piece);
+	if (last) {
+		piece = markdown_stream_finish(reply->markdown);
+		g_string_append(html, piece);
+		g_string_append(reply->html, piece);
+		g_free(piece);
+	}
+
+	/* The blank lines separating pieces are implied by them being separate messages */
+	while (g_str_has_prefix(html->str + start, "<br>")) {
+		g_string_erase(html, start, 4);
+	}
+	while (html->len >= start + 4 && g_str_has_suffix(html->str, "<br>")) {
+		g_string_truncate(html, html->len - 4);
+	}
+
+	for (i = start; i < html->len && g_ascii_isspace(html->str[i]); i++);
+	if (i < html->len) {
+		PurpleMessageFlags flags = PURPLE_MESSAGE_RECV;
+
+		piece = markdown_stream_close_tags(reply->markdown);
+		g_string_append(html, piece);
+		g_free(piece);
+
+		if (last && reply->pieces == 0) {
+			reply->logged = TRUE;
+		} else {
+			flags |= PURPLE_MESSAGE_NO_LOG;
+		}
+		purple_serv_got_im(reply->cga->pc, reply->buddy_id, html->str, flags, time(NULL));
+		reply->pieces++;
+
+		g_free(reply->reopen_tags);
+		reply->reopen_tags = markdown_stream_reopen_tags(reply->markdown);
+	}
+
+	reply->delivered = end;
+	reply->last_delivery = g_get_monotonic_time();
+	g_string_free(html, TRUE);
+
+	if (!last) {
+		/* Still working on the rest */
+		purple_serv_got_typing(reply->cga->pc, reply->buddy_id, 0, PURPLE_TYPING);
+	}
+}
+
+/* Length of the piece to cut off the front of @text, which is longer than
+ * AICHAT_REPLY_MAX_PIECE: at the last paragraph break that fits, failing
+ * that the last line break, then the last space, then anywhere that isn't
+ * in the middle of a character */
+static gsize
+aichat_reply_split_point(const gchar *text)
+{
+	gsize max = AICHAT_REPLY_MAX_PIECE;
+	gsize i;
+
+	for (i = max; i > 1; i--) {
+		if (text[i - 1] == '\n' && text[i - 2] == '\n') {
+			return i;
+		}
+	}
+	for (i = max; i > 0; i--) {
+		if (text[i - 1] == '\n') {
+			return i;
+		}
+	}
+	for (i = max; i > 0; i--) {
+		if (text[i - 1] == ' ') {
+			return i;
+		}
+	}
+	for (i = max; i > 1 && (text[i] & 0xC0) == 0x80; i--);
+	return i;
+}
+
+/* End of the last sentence in text[start, end), or 0 if there isn't one.  A
+ * sentence ends at a '.', '!' or '?' followed by whitespace, which is kept with it. */
+static gsize
+aichat_reply_find_sentence(const gchar *text, gsize start, gsize end)
+{
+	gsize i;
+
+	for (i = end; i > start + 1; i--) {
+		if ((text[i - 1] == ' ' || text[i - 1] == '\n') && strchr(".!?", text[i - 2]) != NULL) {
+			return i;
+		}
+	}
+
+	return 0;
+}
+
+/* Find the paragraph and sentence ends in the text received since the last
+ * scan.  Code blocks are never cut, so that each piece renders as markdown
+ * on its own. */
+static void
+aichat_reply_scan(AiChatReply *reply)
+{
+	GString *text = reply->text;
+	gsize sentence;
+	gint i;
+
+	while (reply->scanned < text->len) {
+		const gchar *line = text->str + reply->scanned;
+		const gchar *eol = memchr(line, '\n', text->len - reply->scanned);
+		gboolean fence;
+
+		if (eol == NULL) {
+			/* Wait for the rest of the line */
+			break;
+		}
+
+		/* Code fences may be indented by up to three spaces */
+		for (i = 0; i < 3 && line[i] == ' '; i++);
+		fence = strncmp(line + i, "```", 3) == 0;
+
+		if (!reply->in_fence && !fence) {
+			sentence = aichat_reply_find_sentence(text->str, MAX(reply->scanned, reply->sentence_scanned), eol + 1 - text->str);
+			if (sentence != 0) {
+				reply->sentence_cut = sentence;
+			}
+		}
+
+		reply->scanned = eol + 1 - text->str;
+		if (fence) {
+			reply->in_fence = !reply->in_fence;
+		}
+
+		if (eol == line && !reply->in_fence) {
+			reply->paragraph_cut = reply->scanned;
+		}
+	}
+
+	/* Sentences can end part way through a line */
+	if (!reply->in_fence) {
+		sentence = aichat_reply_find_sentence(text->str, MAX(reply->scanned, reply->sentence_scanned), text->len);
+		if (sentence != 0) {
+			reply->sentence_cut = sentence;
+		}
+	}
+	/* The last character can't end a sentence until the next one is known */
+	reply->sentence_scanned = text->len > 0 ? text->len - 1 : 0;
+}
+
+static gboolean aichat_reply_flush_timeout(gpointer data);
+static void aichat_reply_finish(AiChatReply *reply);
+
+/* Show whatever is ready to be shown: text that has grown past the byte
+ * budget straight away, complete paragraphs (or sentences) once
+ * AICHAT_REPLY_INTERVAL has passed since the last piece. */
+static void
+aichat_reply_flush(AiChatReply *reply)
+{
+	gint64 wait;
+	gsize cut;
+
+	aichat_reply_scan(reply);
+
+	while (reply->text->len - reply->delivered > AICHAT_REPLY_MAX_PIECE) {
+		aichat_reply_deliver(reply, reply->delivered + aichat_reply_split_point(reply->text->str + reply->delivered), FALSE);
+	}
+
+	cut = reply->paragraph_cut;
+	if (reply->by_sentence) {
+		cut = MAX(cut, reply->sentence_cut);
+	}
+	if (cut <= reply->delivered) {
 		return;
 	}
 
-	// convert markdown to html
-	gchar *html = markdown_convert_markdown(text_value, TRUE, FALSE);
+	wait = reply->last_delivery + AICHAT_REPLY_INTERVAL * 1000 - g_get_monotonic_time();
+	if (wait > 0) {
+		if (reply->flush_timeout == 0) {
+			reply->flush_timeout = g_timeout_add(wait / 1000 + 1, aichat_reply_flush_timeout, reply);
+		}
+		return;
+	}
 
-	// send the message to the user
-	purple_serv_got_im(cga->pc, assistant_id, html, PURPLE_MESSAGE_RECV, time(NULL));
+	aichat_reply_deliver(reply, cut, FALSE);
+}
+
+static gboolean
+aichat_reply_flush_timeout(gpointer data)
+{
+	AiChatReply *reply = data;
+
+	reply->flush_timeout = 0;
+	if (reply->finishing) {
+		aichat_reply_finish(reply);
+	} else {
+		aichat_reply_flush(reply);
+	}
+
+	return FALSE;
+}
+
+/* Add @len bytes of reply text */
+static void
+aichat_reply_append(AiChatReply *reply, const gchar *text, gssize len)
+{
+	if (len < 0) {
+		len = strlen(text);
+	}
+	if (len > 0) {
+		aichat_request_stats_mark(&reply->stats.first_token);
+		g_string_append_len(reply->text, text, len);
+	}
+}
+
+/* Get the file a bot keeps its conversation (".history") or memory (with
+ * the embedding model, then ".memory") in */
+static gchar *
+aichat_buddy_filename(AiChatAccount *cga, const gchar *buddy_id, const gchar *extension)
+{
+	gchar *account_dir = g_strdup(purple_escape_filename(purple_account_get_username(cga->account)));
+	gchar *basename = g_strconcat(purple_escape_filename(buddy_id), extension, NULL);
+	gchar *filename = g_build_filename(purple_user_dir(), "aichat", account_dir, basename, NULL);
+
+	g_free(account_dir);
+	g_free(basename);
+
+	return filename;
+}
+
+/* Open @cgb's log, if it keeps one, and read the part of its conversation
+ * that fits the model.  Bots are only set up at login, so an account with
+ * many of them doesn't read any conversation until it's used. */
+static void
+aichat_buddy_load_history(AiChatAccount *cga, AiChatBuddy *cgb)
+{
+	LLMProvider *provider = cgb->provider ? cgb->provider : llm_provider_get(cga->provider_type);
+	const gchar *buddy_id = purple_buddy_get_name(cgb->buddy);
+	gsize max_bytes = provider ? aichat_context_get_history_size(cga, cgb, provider) : 0;
+	gchar *filename;
+	GError *error = NULL;
+
+	if (!cgb->saves_history || cgb->log != NULL) {
+		return;
+	}
+
+	filename = aichat_buddy_filename(cga, buddy_id, ".history");
+	cgb->log = aichat_history_log_open(filename, AICHAT_CONTEXT_PINNED_TURNS, max_bytes, &cgb->history, &error);
+	if (cgb->log == NULL) {
+		purple_debug_warning("aichat", "Conversation won't be saved: %s\n", error->message);
+		g_error_free(error);
+		cgb->saves_history = FALSE;
+	} else if (cgb->history != NULL) {
+		purple_debug_info("aichat", "Restored %u turns with %s, leaving %u older ones on disk\n",
+			aichat_history_get_length(cgb->history), buddy_id, aichat_history_log_get_skipped(cgb->log));
+	}
+	g_free(filename);
+}
+
+/* Add a turn to @cgb's conversation, and to its log if it has one */
+static void
+aichat_buddy_add_turn(AiChatBuddy *cgb, AiChatRole role, const gchar *content, gssize len)
+{
+	GError *error = NULL;
+
+	if (cgb->history == NULL) {
+		cgb->history = aichat_history_new();
+	}
+	aichat_history_append(cgb->history, role, content, len);
+
+	if (cgb->log != NULL && !aichat_history_log_append(cgb->log, role, content, len, &error)) {
+		purple_debug_warning("aichat", "Couldn't save conversation: %s\n", error->message);
+		g_error_free(error);
+	}
+}
+
+/* Conversations longer than the "summarize_after" option have their older
+ * turns replaced by a summary, written by the provider's cheaper model in
+ * a request of its own once a reply is done.  Turns are only ever added at
+ * the end while it's running, so the ones summarized are still there,
+ * unchanged, when it comes back. */
+#define AICHAT_SUMMARY_INSTRUCTIONS \
+	"Summarize the conversation below for the assistant taking part in it, " \
+	"who will read your summary in place of the conversation before carrying " \
+	"on with it. Keep names, facts, decisions, open questions and anything " \
+	"the user asked to be remembered. Reply with the summary only."
+#define AICHAT_SUMMARY_PREFIX "Summary of the earlier conversation:\n\n"
+
+typedef struct {
+	gchar *buddy_id;
+	AiChatHistory *history;  /* To tell whether the buddy's history is still the one summarized */
+	LLMProvider *provider;
+	guint turns;             /* Number of turns summarized, from the start */
+} AiChatSummary;
+
+/* Put @summary's @text, or the @error in getting it, in place and free @summary */
+static void
+aichat_summary_done(AiChatAccount *cga, AiChatSummary *summary, const gchar *text, GError *error)
+{
+	PurpleBuddy *buddy = purple_find_buddy(cga->account, summary->buddy_id);
+	AiChatBuddy *cgb = buddy ? purple_buddy_get_protocol_data(buddy) : NULL;
+
+	if (cgb != NULL && cgb->summarizing && cgb->history == summary->history) {
+		cgb->summarizing = FALSE;
+
+		if (text != NULL && *text) {
+			gchar *content = g_strconcat(AICHAT_SUMMARY_PREFIX, text, NULL);
+
+			GError *save_error = NULL;
+
+			aichat_history_replace_head(cgb->history, summary->turns, AICHAT_ROLE_SYSTEM, content, -1);
+			if (cgb->log != NULL && !aichat_history_log_rewrite(cgb->log, cgb->history, &save_error)) {
+				purple_debug_warning("aichat", "Couldn't save conversation: %s\n", save_error->message);
+				g_error_free(save_error);
+			}
+			purple_debug_info("aichat", "Summarized the first %u turns with %s\n", summary->turns, summary->buddy_id);
+			g_free(content);
+		} else {
+			/* Tried again after the next reply */
+			purple_debug_warning("aichat", "Couldn't summarize the conversation with %s: %s\n",
+				summary->buddy_id, error ? error->message : "No summary in response");
+		}
+	}
+
+	g_free(summary->buddy_id);
+	g_free(summary);
+}
+
+static void
+aichat_summary_cb(AiChatAccount *cga, JsonObject *obj, gpointer user_data)
+{
+	AiChatSummary *summary = user_data;
+	LLMProvider *provider = summary->provider;
+	gchar *text = NULL;
+	GError *error = NULL;
+
+	if (obj != NULL && (provider->validate_response == NULL || provider->validate_response(obj, &error)) &&
+			provider->parse_response != NULL) {
+		text = provider->parse_response(obj, &error);
+	}
+
+	aichat_summary_done(cga, summary, text, error);
+	g_clear_error(&error);
+	g_free(text);
+}
+
+static void
+aichat_summary_raw_cb(AiChatAccount *cga, const gchar *data, gsize len, gpointer user_data)
+{
+	AiChatSummary *summary = user_data;
+	LLMStreamState state = { 0 };
+	GError *error = NULL;
+
+	state.delta = g_string_new(NULL);
+	if (summary->provider->parse_response_raw(data, len, &state, &error)) {
+		aichat_summary_done(cga, summary, state.delta->str, NULL);
+	} else {
+		aichat_summary_done(cga, summary, NULL, error);
+		g_clear_error(&error);
+	}
+	g_string_free(state.delta, TRUE);
+}
+
+static void
+aichat_summary_error_cb(AiChatAccount *cga, const gchar *data, gssize data_len, gpointer user_data)
+{
+	aichat_summary_done(cga, user_data, NULL, NULL);
+}
+
+/* Summarize the older part of @cgb's history, now that all of it is in memory */
+static void
+aichat_summary_start(AiChatAccount *cga, AiChatBuddy *cgb)
+{
+	gint threshold = purple_account_get_int(cga->account, "summarize_after", 0);
+	LLMProvider *provider = cgb->provider;
+	AiChatHistoryEntry *entries;
+	AiChatBuddy request_buddy;
+	AiChatSummary *summary;
+	AiChatJsonBody *body;
+	GString *transcript;
+	guint len, turns, i;
+	gchar *url;
+
+	cgb->summarizing = FALSE;
+	len = aichat_history_get_length(cgb->history);
+	if (threshold <= 0 || len <= (guint) threshold) {
+		return;
+	}
+
+	/* Keep the newer half, starting on a message from the user */
+	entries = aichat_history_get_entries(cgb->history);
+	turns = len - MAX(threshold / 2, 1);
+	if (entries[turns].role == AICHAT_ROLE_ASSISTANT) {
+		turns++;
+	}
+	if (turns < 2) {
+		return;
+	}
+
+	/* The turns go in as a single message, which every provider takes */
+	transcript = g_string_new(NULL);
+	for (i = 0; i < turns; i++) {
+		g_string_append(transcript, entries[i].role == AICHAT_ROLE_USER ? "User: " :
+			entries[i].role == AICHAT_ROLE_ASSISTANT ? "Assistant: " : "");
+		g_string_append_len(transcript, entries[i].content, entries[i].content_len);
+		g_string_append(transcript, "\n\n");
+	}
+
+	request_buddy = *cgb;
+	request_buddy.instructions = AICHAT_SUMMARY_INSTRUCTIONS;
+	request_buddy.model = provider->small_model ? provider->small_model : cgb->model;
+	request_buddy.history = aichat_history_new();
+	aichat_history_append(request_buddy.history, AICHAT_ROLE_USER, transcript->str, transcript->len);
+	g_string_free(transcript, TRUE);
+
+	body = provider->format_request(&request_buddy, FALSE);
+	if (provider->get_chat_url) {
+		url = provider->get_chat_url(provider, &request_buddy);
+	} else {
+		url = g_strdup_printf("%s%s", provider->endpoint_url, provider->chat_endpoint);
+	}
+	aichat_history_free(request_buddy.history);
+
+	if (body == NULL) {
+		g_free(url);
+		return;
+	}
+
+	summary = g_new0(AiChatSummary, 1);
+	summary->buddy_id = g_strdup(purple_buddy_get_name(cgb->buddy));
+	summary->history = cgb->history;
+	summary->provider = provider;
+	summary->turns = turns;
+	cgb->summarizing = TRUE;
+
+	purple_debug_info("aichat", "Summarizing the first %u of %u turns with %s\n", turns, len, summary->buddy_id);
+	aichat_provider_http_request(cga, url, body, NULL, aichat_summary_cb,
+		provider->parse_response_raw ? aichat_summary_raw_cb : NULL, aichat_summary_error_cb, NULL, summary);
+
+	g_free(url);
+}
+
+/* Called once the turns left on disk have been read */
+static void
+aichat_summary_loaded_cb(AiChatHistoryLog *log, const GError *error, gpointer user_data)
+{
+	AiChatBuddy *cgb = user_data;
+	PurpleConnection *pc = purple_account_get_connection(purple_buddy_get_account(cgb->buddy));
+
+	if (error != NULL) {
+		purple_debug_warning("aichat", "Couldn't read the conversation with %s: %s\n",
+			purple_buddy_get_name(cgb->buddy), error->message);
+	}
+	/* The account may have gone offline while it was reading */
+	if (error != NULL || pc == NULL || purple_connection_get_protocol_data(pc) == NULL) {
+		cgb->summarizing = FALSE;
+		return;
+	}
+
+	aichat_summary_start(purple_connection_get_protocol_data(pc), cgb);
+}
+
+/* Start summarizing the older part of @cgb's history if it's grown past
+ * the account's threshold.  The turns left on disk are the ones to
+ * summarize, so they're read first, without holding up the main loop. */
+static void
+aichat_summarize_history(AiChatAccount *cga, AiChatBuddy *cgb)
+{
+	gint threshold = purple_account_get_int(cga->account, "summarize_after", 0);
+	LLMProvider *provider = cgb->provider;
+	guint len;
+
+	len = aichat_history_get_length(cgb->history);
+	if (cgb->log != NULL) {
+		len += aichat_history_log_get_skipped(cgb->log);
+	}
+	if (threshold <= 0 || len <= (guint) threshold || cgb->summarizing ||
+			provider == NULL || provider->format_request == NULL) {
+		return;
+	}
+
+	/* Set while reading too, so it isn't started twice */
+	cgb->summarizing = TRUE;
+	if (cgb->log != NULL) {
+		aichat_history_log_load_all(cgb->log, &cgb->history, aichat_summary_loaded_cb, cgb);
+	} else {
+		aichat_summary_start(cga, cgb);
+	}
+}
+
+/* Bots with the "long_term_memory" option embed every exchange once the
+ * reply is done and keep it in a memory file, one per embedding model.
+ * When the context window leaves older turns out of a request, the ones
+ * nearest to the message being sent are recalled into it.  Embeddings come from the provider, or
+ * from a local Ollama if the provider has no embeddings endpoint. */
+#define AICHAT_MEMORY_RECALL 4
+/* Longest snippet kept, in bytes, well within what embedding models take */
+#define AICHAT_MEMORY_MAX_SNIPPET 4000
+/* Most snippets kept per bot, which bounds both the memory the vectors take
+ * and the time a search does; the oldest go first */
+#define AICHAT_MEMORY_MAX_SNIPPETS 16384
+#define AICHAT_MEMORY_RECALL_PREFIX "From earlier in our conversation, in case it's relevant:\n\n"
+#define AICHAT_MEMORY_RECALL_SUFFIX "---\n\n"
+
+/* Gets the embedding asked for, or NULL if there isn't one */
+typedef void (*AiChatEmbeddingFunc)(AiChatAccount *cga, const gfloat *vector, guint dimensions, gpointer user_data);
+
+typedef struct {
+	gchar *model;
+	AiChatEmbeddingFunc callback;
+	gpointer user_data;
+} AiChatEmbedding;
+
+/* OpenAI's {"data": [{"embedding": [...]}]} or Ollama's {"embeddings": [[...]]} */
+static const gchar * const aichat_embedding_path_names[] = {
+	"data.0.embedding.*",
+	"embeddings.0.*",
+	NULL
+};
+
+static AiChatJsonPullPaths aichat_embedding_paths = AICHAT_JSON_PULL_PATHS_INIT(aichat_embedding_path_names);
+
+static gboolean
+aichat_embedding_value_cb(guint path, const AiChatJsonPullValue *value, gpointer user_data)
+{
+	GArray *values = user_data;
+	gfloat element = aichat_json_pull_get_double(value);
+
+	g_array_append_val(values, element);
+	return TRUE;
+}
+
+/* Hand @embedding its vector, or NULL for none, and free it */
+static void
+aichat_embedding_done(AiChatAccount *cga, AiChatEmbedding *embedding, const gfloat *vector, guint dimensions)
+{
+	if (dimensions == 0) {
+		purple_debug_warning("aichat", "Couldn't get an embedding from %s\n", embedding->model);
+	}
+
+	embedding->callback(cga, dimensions > 0 ? vector : NULL, dimensions, embedding->user_data);
+	g_free(embedding->model);
+	g_free(embedding);
+}
+
+/* The numbers are read straight into the vector, there being thousands of them */
+static void
+aichat_embedding_cb(AiChatAccount *cga, const gchar *data, gsize len, gpointer user_data)
+{
+	GArray *values = g_array_new(FALSE, FALSE, sizeof(gfloat));
+
+	if (!aichat_json_pull_foreach(data, len, &aichat_embedding_paths, aichat_embedding_value_cb, values)) {
+		g_array_set_size(values, 0);
+	}
+
+	aichat_embedding_done(cga, user_data, (const gfloat *) values->data, values->len);
+	g_array_free(values, TRUE);
+}
+
+static void
+aichat_embedding_error_cb(AiChatAccount *cga, const gchar *data, gssize data_len, gpointer user_data)
+{
+	aichat_embedding_done(cga, user_data, NULL, 0);
+}
+
+/* Get the provider embeddings come from, or NULL if there's none, and the
+ * model in @model */
+static LLMProvider *
+aichat_embedding_provider(AiChatAccount *cga, const gchar **model)
+{
+	LLMProvider *provider = llm_provider_get(cga->provider_type);
+
+	if (provider == NULL || provider->embeddings_endpoint == NULL) {
+		provider = llm_provider_get_by_name("ollama");
+	}
+	if (provider == NULL || provider->embeddings_endpoint == NULL) {
+		return NULL;
+	}
+	*model = purple_account_get_string(cga->account, "embedding_model", NULL);
+	if (*model == NULL || !**model) {
+		*model = provider->embedding_model;
+	}
+
+	return provider;
+}
+
+/* Get the embedding of @text for @callback */
+static void
+aichat_embed(AiChatAccount *cga, const gchar *text, AiChatEmbeddingFunc callback, gpointer user_data)
+{
+	const gchar *model = NULL;
+	LLMProvider *provider = aichat_embedding_provider(cga, &model);
+	AiChatJsonWriter *writer;
+	AiChatEmbedding *embedding;
+	gchar *url;
+
+	if (provider == NULL) {
+		callback(cga, NULL, 0, user_data);
+		return;
+	}
+
+	writer = aichat_json_writer_new(strlen(text) + 64);
+	aichat_json_writer_begin_object(writer);
+	aichat_json_writer_string_member(writer, "model", model);
+	aichat_json_writer_string_member(writer, "input", text);
+	aichat_json_writer_end_object(writer);
+	if (provider->get_embeddings_url) {
+		url = provider->get_embeddings_url(provider, cga);
+	} else {
+		url = g_strconcat(provider->endpoint_url, provider->embeddings_endpoint, NULL);
+	}
+
+	embedding = g_new0(AiChatEmbedding, 1);
+	embedding->model = g_strdup(model);
+	embedding->callback = callback;
+	embedding->user_data = user_data;
+	/* With the headers of the provider asked, so the account's key never
+	 * goes to a local Ollama */
+	aichat_llm_http_request(cga, provider, url, aichat_json_writer_free_to_body(writer), NULL,
+		NULL, aichat_embedding_cb, aichat_embedding_error_cb, NULL, embedding);
+
+	g_free(url);
+}
+
+/* Get @cgb's long-term memory for the embedding model in use, opening it
+ * when first used, or NULL if it doesn't keep one.  A change of model
+ * switches to that model's file and leaves the old one as it was. */
+static AiChatMemory *
+aichat_buddy_get_memory(AiChatAccount *cga, AiChatBuddy *cgb)
+{
+	const gchar *model = NULL;
+	gchar *extension, *filename;
+	GError *error = NULL;
+
+	if (!cgb->saves_history || !purple_account_get_bool(cga->account, "long_term_memory", FALSE) ||
+			aichat_embedding_provider(cga, &model) == NULL || model == NULL) {
+		return NULL;
+	}
+	if (cgb->memory != NULL && purple_strequal(cgb->memory_model, model)) {
+		return cgb->memory;
+	}
+	aichat_memory_close(cgb->memory);
+	g_free(cgb->memory_model);
+	cgb->memory_model = g_strdup(model);
+
+	extension = g_strdup_printf(".%s.memory", purple_escape_filename(model));
+	filename = aichat_buddy_filename(cga, purple_buddy_get_name(cgb->buddy), extension);
+	cgb->memory = aichat_memory_open(filename, AICHAT_MEMORY_MAX_SNIPPETS, &error);
+	if (cgb->memory == NULL) {
+		purple_debug_warning("aichat", "Long-term memory unavailable: %s\n", error->message);
+		g_error_free(error);
+	}
+	g_free(filename);
+	g_free(extension);
+
+	return cgb->memory;
+}
+
+typedef struct {
+	gchar *buddy_id;
+	gchar *text;
+} AiChatRemembered;
+
+static void
+aichat_remember_cb(AiChatAccount *cga, const gfloat *vector, guint dimensions, gpointer user_data)
+{
+	AiChatRemembered *remembered = user_data;
+	PurpleBuddy *buddy = purple_find_buddy(cga->account, remembered->buddy_id);
+	AiChatBuddy *cgb = buddy ? purple_buddy_get_protocol_data(buddy) : NULL;
+	AiChatMemory *memory = cgb ? aichat_buddy_get_memory(cga, cgb) : NULL;
+	GError *error = NULL;
+
+	if (vector != NULL && memory != NULL &&
+			!aichat_memory_add(memory, vector, dimensions, remembered->text, -1, &error)) {
+		purple_debug_warning("aichat", "Couldn't save to long-term memory: %s\n", error->message);
+		g_error_free(error);
+	}
+
+	g_free(remembered->buddy_id);
+	g_free(remembered->text);
+	g_free(remembered);
+}
+
+/* Add the exchange that @cgb's history ends with to its memory */
+static void
+aichat_remember_exchange(AiChatAccount *cga, AiChatBuddy *cgb)
+{
+	AiChatHistoryEntry *entries = aichat_history_get_entries(cgb->history);
+	guint len = aichat_history_get_length(cgb->history);
+	AiChatRemembered *remembered;
+	GString *text;
+
+	if (len < 2 || entries[len - 2].role != AICHAT_ROLE_USER || aichat_buddy_get_memory(cga, cgb) == NULL) {
+		return;
+	}
+
+	text = g_string_new("User: ");
+	g_string_append_len(text, entries[len - 2].content, entries[len - 2].content_len);
+	g_string_append(text, "\nAssistant: ");
+	g_string_append_len(text, entries[len - 1].content, entries[len - 1].content_len);
+	if (text->len > AICHAT_MEMORY_MAX_SNIPPET) {
+		/* On a character boundary */
+		g_string_truncate(text, g_utf8_find_prev_char(text->str, text->str + AICHAT_MEMORY_MAX_SNIPPET + 1) - text->str);
+	}
+
+	remembered = g_new0(AiChatRemembered, 1);
+	remembered->buddy_id = g_strdup(purple_buddy_get_name(cgb->buddy));
+	remembered->text = g_string_free(text, FALSE);
+	aichat_embed(cga, remembered->text, aichat_remember_cb, remembered);
+}
+
+static void
+aichat_reply_finish(AiChatReply *reply)
+{
+	AiChatAccount *cga = reply->cga;
+
+	aichat_request_stats_mark(&reply->stats.end);
+	if (reply->flush_timeout) {
+		g_source_remove(reply->flush_timeout);
+		reply->flush_timeout = 0;
+	}
+
+	/* Replies that arrived in one go can still be too big to show as one
+	 * message.  Each piece is a message for the conversation window to
+	 * lay out, so they're shown one per AICHAT_REPLY_INTERVAL, and the
+	 * reply is finished off once the last of them is out. */
+	if (reply->text->len - reply->delivered > AICHAT_REPLY_MAX_PIECE) {
+		aichat_reply_deliver(reply, reply->delivered + aichat_reply_split_point(reply->text->str + reply->delivered), FALSE);
+		if (!reply->finishing) {
+			reply->finishing = TRUE;
+			cga->finishing = g_slist_prepend(cga->finishing, reply);
+		}
+		reply->flush_timeout = g_timeout_add(AICHAT_REPLY_INTERVAL, aichat_reply_flush_timeout, reply);
+		return;
+	}
+	if (reply->finishing) {
+		cga->finishing = g_slist_remove(cga->finishing, reply);
+	}
+	if (reply->text->len > 0) {
+		aichat_reply_deliver(reply, reply->text->len, TRUE);
+	}
+
+	/* Shown in pieces, but logged as a whole */
+	if (reply->pieces > 0 && !reply->logged) {
+		PurpleConversation *conv = PURPLE_CONVERSATION(purple_conversations_find_im_with_account(reply->buddy_id, cga->account));
+
+		while (g_str_has_suffix(reply->html->str, "<br>")) {
+			g_string_truncate(reply->html, reply->html->len - 4);
+		}
+		if (conv != NULL) {
+			purple_conversation_write(conv, reply->buddy_id, reply->html->str,
+				PURPLE_MESSAGE_RECV | PURPLE_MESSAGE_INVISIBLE, time(NULL));
+		}
+	}
+
+	if (reply->state.input_tokens || reply->state.output_tokens) {
+		purple_debug_info("aichat", "Reply used %" G_GINT64_FORMAT " prompt (%" G_GINT64_FORMAT " cached, %" G_GINT64_FORMAT
+			" cache written) and %" G_GINT64_FORMAT " completion tokens\n",
+			reply->state.input_tokens, reply->state.cache_read_tokens, reply->state.cache_write_tokens,
+			reply->state.output_tokens);
+	}
+
+	if (reply->error != NULL) {
+		purple_debug_error("aichat", "Chat request failed: %s\n", reply->error);
+		purple_serv_got_im(cga->pc, reply->buddy_id, reply->error, PURPLE_MESSAGE_ERROR | PURPLE_MESSAGE_RECV, time(NULL));
+	} else if (reply->text->len > 0) {
+		reply->stats.input_tokens = reply->state.input_tokens;
+		reply->stats.cache_read_tokens = reply->state.cache_read_tokens;
+		if (reply->state.output_tokens > 0) {
+			reply->stats.output_tokens = reply->state.output_tokens;
+		} else {
+			reply->stats.output_tokens = MAX(aichat_context_count_tokens(cga, reply->text->str, reply->text->len), 1);
+			reply->stats.tokens_estimated = TRUE;
+		}
+		aichat_stats_add(cga->stats, reply->buddy_id, reply->provider ? reply->provider->display_name : NULL, &reply->stats);
+	}
+	
+	/* Add to buddy history, only once it's known to be the whole reply */
+	if (reply->error == NULL && reply->text->len > 0 && !reply->remote_history) {
+		PurpleBuddy *buddy = purple_find_buddy(cga->account, reply->buddy_id);
+		AiChatBuddy *cgb = buddy ? purple_buddy_get_protocol_data(buddy) : NULL;
+		if (cgb) {
+			aichat_buddy_add_turn(cgb, AICHAT_ROLE_ASSISTANT, reply->text->str, reply->text->len);
+			aichat_remember_exchange(cga, cgb);
+			aichat_summarize_history(cga, cgb);
+		}
+	}
+
+	purple_serv_got_typing_stopped(cga->pc, reply->buddy_id);
+	aichat_reply_free(reply);
+}
+
+/* Error callback for requests whose user_data is an AiChatReply */
+static void
+aichat_reply_error_cb(AiChatAccount *cga, const gchar *data, gssize data_len, gpointer user_data)
+{
+	AiChatReply *reply = user_data;
+
+	/* @data is the HTTP error when a stream was cut off */
+	if (reply->error == NULL && data != NULL && data_len != 0) {
+		reply->error = g_strdup_printf("The reply was cut off: %.*s", (gint) (data_len < 0 ? strlen(data) : data_len), data);
+	} else if (reply->error == NULL) {
+		reply->error = g_strdup("No response from server");
+	}
+	aichat_reply_finish(reply);
+}
+
+static void
+aichat_send_message_cb(AiChatAccount *cga, JsonObject *obj, gpointer user_data)
+{
+	gchar *assistant_id = user_data;
+	JsonArray *data_arr = json_object_get_array_member(obj, "data");
+	JsonObject *data_obj = json_array_get_object_element(data_arr, 0);
+	JsonArray *content = json_object_get_array_member(data_obj, "content");
+	JsonObject *content_obj = json_array_get_object_element(content, 0);
+	JsonObject *text = json_object_get_object_member(content_obj, "text");
+	const gchar *text_value = json_object_get_string_member(text, "value");
+
+	if (text_value == NULL) {
+		serv_got_typing_stopped(cga->pc, assistant_id);
+		purple_debug_error("aichat", "No content found in message\n");
+		g_free(assistant_id);
+		return;
+	}
+
+	// convert markdown to html
+	gchar *html = markdown_convert_markdown(text_value, TRUE, FALSE);
+
+	// send the message to the user
+	purple_serv_got_im(cga->pc, assistant_id, html, PURPLE_MESSAGE_RECV, time(NULL));
+
+	g_free(assistant_id);
+	g_free(html);
+}
+
+/* Assistant runs that weren't streamed are polled until they finish.  The
+ * delay between polls starts short, since most runs are quick, and doubles
+ * up to a cap so that slow runs don't eat into the rate limit. */
+#define AICHAT_RUN_POLL_MIN_INTERVAL 500     /* ms */
+#define AICHAT_RUN_POLL_MAX_INTERVAL 8000    /* ms */
+#define AICHAT_RUN_POLL_MAX_FAILURES 5       /* Consecutive failed polls before giving up */
+
+typedef struct {
+	AiChatAccount *cga;
+	gchar *buddy_id;
+	gchar *thread_id;
+	gchar *run_id;
+	guint interval;                   /* Delay before the next poll, in ms */
+	guint failures;
+	guint timeout;                    /* Pending poll timer */
+	PurpleHttpConnection *http_conn;  /* Poll in flight */
+} AiChatRunPoll;
+
+static void
+aichat_run_poll_free(gpointer data)
+{
+	AiChatRunPoll *poll = data;
+	PurpleHttpConnection *http_conn = poll->http_conn;
+
+	if (poll->timeout) {
+		g_source_remove(poll->timeout);
+	}
+	if (http_conn != NULL) {
+		/* Cancelling runs the callback, which must see that it's been detached */
+		poll->http_conn = NULL;
+		purple_http_conn_cancel(http_conn);
+	}
+
+	g_free(poll->buddy_id);
+	g_free(poll->thread_id);
+	g_free(poll->run_id);
+	g_free(poll);
+}
+
+/* Act on the status of a run.  Returns TRUE once the run has ended. */
+static gboolean
+aichat_run_check_status(AiChatAccount *cga, const gchar *buddy_id, JsonObject *run)
+{
+	const gchar *run_id = json_object_get_string_member(run, "id");
+	const gchar *thread_id = json_object_get_string_member(run, "thread_id");
+	const gchar *status = json_object_get_string_member(run, "status");
+	gchar *error = NULL;
+
+	if (purple_strequal(status, "completed")) {
+		// get the messages
+		gchar *url = g_strdup_printf("/v1/threads/%s/messages?run_id=%s", thread_id, run_id);
+		aichat_http_request(cga, url, NULL, aichat_send_message_cb, g_strdup(buddy_id));
+		g_free(url);
+		return TRUE;
+	}
+
+	if (purple_strequal(status, "queued") || purple_strequal(status, "in_progress") ||
+			purple_strequal(status, "cancelling")) {
+		return FALSE;
+	}
+
+	if (purple_strequal(status, "failed")) {
+		JsonObject *last_error = json_object_get_object_member(run, "last_error");
+		const gchar *message = json_object_get_string_member(last_error, "message");
+		error = g_strdup_printf("Run failed: %s", message ? message : "Unknown error");
+	} else if (purple_strequal(status, "requires_action")) {
+		error = g_strdup("Run requires tool outputs, which aren't supported");
+	} else if (status != NULL) {
+		/* cancelled, expired, incomplete */
+		error = g_strdup_printf("Run %s", status);
+	} else {
+		JsonObject *error_obj = json_object_get_object_member(run, "error");
+		const gchar *message = json_object_get_string_member(error_obj, "message");
+		error = g_strdup(message ? message : "Invalid run status");
+	}
+
+	purple_debug_error("aichat", "%s\n", error);
+	purple_serv_got_im(cga->pc, buddy_id, error, PURPLE_MESSAGE_ERROR | PURPLE_MESSAGE_RECV, time(NULL));
+	purple_serv_got_typing_stopped(cga->pc, buddy_id);
+	g_free(error);
+
+	return TRUE;
+}
+
+static gboolean aichat_run_poll_timeout(gpointer user_data);
+
+static void
+aichat_run_poll_schedule(AiChatRunPoll *poll, guint delay)
+{
+	poll->timeout = g_timeout_add(delay, aichat_run_poll_timeout, poll);
+}
+
+static void
+aichat_run_poll_cb(PurpleHttpConnection *http_conn, PurpleHttpResponse *response, gpointer user_data)
+{
+	AiChatRunPoll *poll = user_data;
+	AiChatAccount *cga = poll->cga;
+	const gchar *retry_after;
+	guint delay;
+	gint code;
+
+	if (poll->http_conn == NULL) {
+		/* Cancelled by aichat_run_poll_free() */
+		return;
+	}
+	poll->http_conn = NULL;
+
+	code = purple_http_response_get_code(response);
+	if (code == 0 || code == 429 || code >= 500) {
+		/* Rate limited, or a transient failure; try again later */
+		if (++poll->failures >= AICHAT_RUN_POLL_MAX_FAILURES) {
+			purple_serv_got_im(cga->pc, poll->buddy_id, "Lost track of the assistant's run",
+				PURPLE_MESSAGE_ERROR | PURPLE_MESSAGE_RECV, time(NULL));
+			purple_serv_got_typing_stopped(cga->pc, poll->buddy_id);
+			g_hash_table_remove(cga->run_polls, poll->run_id);
+			return;
+		}
+	} else {
+		const gchar *data;
+		gsize len;
+		JsonObject *obj;
+		gboolean finished;
+
+		data = purple_http_response_get_data(response, &len);
+		obj = json_parser_load_object(cga->parser, data, len);
+		if (obj == NULL) {
+			purple_serv_got_im(cga->pc, poll->buddy_id, "Invalid response",
+				PURPLE_MESSAGE_ERROR | PURPLE_MESSAGE_RECV, time(NULL));
+			purple_serv_got_typing_stopped(cga->pc, poll->buddy_id);
+			g_hash_table_remove(cga->run_polls, poll->run_id);
+			return;
+		}
+
+		finished = aichat_run_check_status(cga, poll->buddy_id, obj);
+		json_object_unref(obj);
+
+		if (finished) {
+			g_hash_table_remove(cga->run_polls, poll->run_id);
+			return;
+		}
+		poll->failures = 0;
+	}
+
+	delay = poll->interval;
+	poll->interval = MIN(poll->interval * 2, AICHAT_RUN_POLL_MAX_INTERVAL);
+
+	/* Only the delay-seconds form is used by the API */
+	retry_after = purple_http_response_get_header(response, "Retry-After");
+	if (retry_after != NULL) {
+		guint64 seconds = g_ascii_strtoull(retry_after, NULL, 10);
+		if (seconds > 0) {
+			delay = MAX(delay, MIN(seconds, 600) * 1000);
+		}
+	}
+
+	aichat_run_poll_schedule(poll, delay);
+}
+
+static gboolean
+aichat_run_poll_timeout(gpointer user_data)
+{
+	AiChatRunPoll *poll = user_data;
+	AiChatAccount *cga = poll->cga;
+	PurpleHttpRequest *request;
+	gchar *path;
+
+	poll->timeout = 0;
+
+	path = g_strdup_printf("/v1/threads/%s/runs/%s", poll->thread_id, poll->run_id);
+	request = aichat_http_request_build(cga, path, NULL);
+	poll->http_conn = purple_http_request(cga->pc, request, aichat_run_poll_cb, poll);
+	if (poll->http_conn != NULL) {
+		purple_http_connection_set_add(cga->conns, poll->http_conn);
+	}
+	purple_http_request_unref(request);
+	g_free(path);
+
+	return FALSE;
+}
+
+/* Called with the run object once a run has been created without streaming */
+static void
+aichat_send_run_cb(AiChatAccount *cga, JsonObject *obj, gpointer user_data)
+{
+	gchar *assistant_id = user_data;
+	const gchar *run_id;
+	AiChatRunPoll *poll;
+
+	if (obj == NULL || aichat_run_check_status(cga, assistant_id, obj)) {
+		g_free(assistant_id);
+		return;
+	}
+
+	run_id = json_object_get_string_member(obj, "id");
+	if (run_id == NULL) {
+		purple_debug_error("aichat", "Run has no id\n");
+		purple_serv_got_typing_stopped(cga->pc, assistant_id);
+		g_free(assistant_id);
+		return;
+	}
+
+	/* Keep to one poll per run */
+	if (g_hash_table_lookup(cga->run_polls, run_id) != NULL) {
+		g_free(assistant_id);
+		return;
+	}
+
+	purple_debug_info("aichat", "Run not completed yet\n");
+
+	poll = g_new0(AiChatRunPoll, 1);
+	poll->cga = cga;
+	poll->buddy_id = assistant_id;
+	poll->thread_id = g_strdup(json_object_get_string_member(obj, "thread_id"));
+	poll->run_id = g_strdup(run_id);
+	poll->interval = AICHAT_RUN_POLL_MIN_INTERVAL;
+	g_hash_table_insert(cga->run_polls, poll->run_id, poll);
+
+	aichat_run_poll_schedule(poll, poll->interval);
+}
+
+/* Called for every event of a streamed assistant run */
+static void
+aichat_run_stream_cb(AiChatAccount *cga, const gchar *event, const gchar *data, gsize data_len, gpointer user_data)
+{
+	AiChatReply *reply = user_data;
+	JsonObject *obj;
+
+	if (reply->state.done || reply->error != NULL) {
+		return;
+	}
+
+	if (purple_strequal(event, "done")) {
+		reply->state.done = TRUE;
+		return;
+	}
+
+	/* Only a handful of the thread.* events matter to us */
+	if (!purple_strequal(event, "thread.message.delta") && !purple_strequal(event, "error") &&
+			!g_str_has_prefix(event, "thread.run.")) {
+		return;
+	}
+
+	obj = json_parser_load_object(reply->state.parser, data, data_len);
+	if (obj == NULL) {
+		reply->error = g_strdup("Invalid stream event");
+		return;
+	}
+
+	if (purple_strequal(event, "thread.message.delta")) {
+		JsonObject *delta = json_object_get_object_member(obj, "delta");
+		JsonArray *content = json_object_get_array_member(delta, "content");
+		guint i, len = json_array_get_length(content);
+
+		for (i = 0; i < len; i++) {
+			JsonObject *content_obj = json_array_get_object_element(content, i);
+			JsonObject *text = json_object_get_object_member(content_obj, "text");
+			const gchar *text_value = json_object_get_string_member(text, "value");
+
+			if (text_value != NULL) {
+				aichat_reply_append(reply, text_value, -1);
+			}
+		}
+		aichat_reply_flush(reply);
+	} else if (purple_strequal(event, "thread.run.completed")) {
+		/* "usage" is null until the run is over, and can stay that way */
+		JsonObject *usage = json_object_has_member(obj, "usage") ? json_object_get_object_member(obj, "usage") : NULL;
+
+		if (usage != NULL && json_object_has_member(usage, "prompt_tokens")) {
+			reply->state.input_tokens = json_object_get_int_member(usage, "prompt_tokens");
+		}
+		if (usage != NULL && json_object_has_member(usage, "completion_tokens")) {
+			reply->state.output_tokens = json_object_get_int_member(usage, "completion_tokens");
+		}
+		reply->state.done = TRUE;
+	} else if (purple_strequal(event, "thread.run.failed")) {
+		JsonObject *last_error = json_object_has_member(obj, "last_error") ? json_object_get_object_member(obj, "last_error") : NULL;
+		const gchar *message = last_error != NULL && json_object_has_member(last_error, "message") ?
+			json_object_get_string_member(last_error, "message") : NULL;
+
+		reply->error = g_strdup_printf("Run failed: %s", message ? message : "Unknown error");
+	} else if (purple_strequal(event, "thread.run.cancelled") || purple_strequal(event, "thread.run.expired")) {
+		reply->error = g_strdup_printf("Run %s", json_object_get_string_member(obj, "status"));
+	} else if (purple_strequal(event, "thread.run.requires_action")) {
+		reply->error = g_strdup("Run requires tool outputs, which aren't supported");
+	} else if (purple_strequal(event, "error")) {
+		/* Either a bare error object or one wrapped in "error" */
+		JsonObject *error_obj = json_object_has_member(obj, "error") ? json_object_get_object_member(obj, "error") : obj;
+		const gchar *message = json_object_get_string_member(error_obj, "message");
+
+		reply->error = g_strdup(message ? message : "Unknown error");
+	}
 
-	g_free(assistant_id);
-	g_free(html);
+	json_object_unref(obj);
 }
 
+/* Called when a streamed run request is over.  @obj is NULL if the run was
+ * streamed, otherwise it's an error or a run object from a server that
+ * ignored the stream flag. */
 static void
-aichat_send_run_cb(AiChatAccount *cga, JsonObject *obj, gpointer user_data)
+aichat_run_stream_done_cb(AiChatAccount *cga, JsonObject *obj, gpointer user_data)
 {
-	gchar *assistant_id = user_data;
-	const gchar *run_id = json_object_get_string_member(obj, "id");
-	const gchar *thread_id = json_object_get_string_member(obj, "thread_id");
-	const gchar *status = json_object_get_string_member(obj, "status");
+	AiChatReply *reply = user_data;
 
-	if (purple_strequal(status, "completed")) {
-		// get the messages
-		gchar *url = g_strdup_printf("/v1/threads/%s/messages?run_id=%s", thread_id, run_id);
-		aichat_http_request(cga, url, NULL, aichat_send_message_cb, g_strdup(assistant_id));
-		g_free(url);
-	} else if (status != NULL) {
-		// wait for the run to complete
-		purple_debug_info("aichat", "Run not completed yet\n");
-		gchar *url = g_strdup_printf("/v1/threads/%s/runs/%s", thread_id, run_id);
-		aichat_http_request(cga, url, NULL, aichat_send_run_cb, g_strdup(assistant_id));
-		g_free(url);
+	if (obj == NULL) {
+		if (reply->error == NULL && !reply->state.done) {
+			reply->error = g_strdup(reply->text->len > 0 ? "The reply was cut off" : "Invalid response");
+		} else if (reply->error == NULL && reply->text->len == 0) {
+			reply->error = g_strdup("Empty response");
+		}
+	} else if (json_object_has_member(obj, "error")) {
+		JsonObject *error_obj = json_object_get_object_member(obj, "error");
+		const gchar *message = json_object_get_string_member(error_obj, "message");
+
+		reply->error = g_strdup(message ? message : "Unknown error");
+	} else if (json_object_has_member(obj, "status")) {
+		/* Wait for the run the old way */
+		aichat_send_run_cb(cga, obj, g_strdup(reply->buddy_id));
+		aichat_reply_free(reply);
+		return;
 	}
 
-	g_free(assistant_id);
+	aichat_reply_finish(reply);
 }
 
 static void
@@ -448,39 +1890,73 @@ aichat_send_message(AiChatAccount *cga, const gchar *id, const gchar *message)
 
 	json_object_set_string_member(obj, "assistant_id", id);
 
-	//TODO - use purple_http_request_set_response_writer to parse server-sent event stream
-	//json_object_set_bool_member(obj, "stream", TRUE);
+	if (purple_account_get_bool(cga->account, "stream_responses", TRUE)) {
+		AiChatReply *reply = aichat_reply_new(cga, id, llm_provider_get(cga->provider_type));
 
-	aichat_http_request(cga, url, obj, aichat_send_run_cb, g_strdup(id));
+		/* The reply arrives on the same connection, no polling needed */
+		reply->remote_history = TRUE;
+		json_object_set_boolean_member(obj, "stream", TRUE);
+		aichat_http_request_full(cga, url, obj, aichat_run_stream_cb,
+			aichat_run_stream_done_cb, NULL, aichat_reply_error_cb, &reply->stats, reply);
+	} else {
+		aichat_http_request(cga, url, obj, aichat_send_run_cb, g_strdup(id));
+	}
 
 	json_object_unref(obj);
 	g_free(url);
 }
 
-/* Generic chat completion callback for provider-based chat */
+/* Called for every event of a streamed chat completion */
+static void
+aichat_chat_stream_cb(AiChatAccount *cga, const gchar *event, const gchar *data, gsize data_len, gpointer user_data)
+{
+	AiChatReply *reply = user_data;
+	GError *error = NULL;
+
+	if (reply->state.done || reply->error != NULL) {
+		return;
+	}
+
+	g_string_truncate(reply->state.delta, 0);
+	if (!reply->provider->parse_stream_event(event, data, data_len, &reply->state, &error)) {
+		reply->error = g_strdup(error ? error->message : "Invalid stream event");
+		g_clear_error(&error);
+		return;
+	}
+
+	if (reply->state.delta->len > 0) {
+		aichat_reply_append(reply, reply->state.delta->str, reply->state.delta->len);
+		aichat_reply_flush(reply);
+	}
+}
+
+/* Generic chat completion callback for provider-based chat.  @obj is the
+ * whole response, or NULL once a streamed response has ended. */
 static void
 aichat_chat_completion_cb(AiChatAccount *cga, JsonObject *obj, gpointer user_data)
 {
-	gchar *buddy_id = user_data;
-	LLMProvider *provider;
+	AiChatReply *reply = user_data;
+	LLMProvider *provider = reply->provider;
 	gchar *response_text = NULL;
 	GError *error = NULL;
 	
-	provider = llm_provider_get(cga->provider_type);
-	if (provider == NULL) {
-		purple_debug_error("aichat", "No provider found for type %d\n", cga->provider_type);
-		g_free(buddy_id);
+	if (obj == NULL) {
+		/* A stream that stops before the provider says it's done was cut
+		 * off, however much of it arrived */
+		if (reply->error == NULL && !reply->state.done) {
+			reply->error = g_strdup(reply->text->len > 0 ? "The reply was cut off" : "Invalid response");
+		} else if (reply->error == NULL && reply->text->len == 0) {
+			reply->error = g_strdup("Empty response");
+		}
+		aichat_reply_finish(reply);
 		return;
 	}
 	
-	/* Validate response */
+	/* Servers without streaming support, and errors, come back as a single document */
 	if (provider->validate_response && !provider->validate_response(obj, &error)) {
-		purple_debug_error("aichat", "Invalid response: %s\n", error ? error->message : "Unknown error");
-		if (error) {
-			purple_serv_got_im(cga->pc, buddy_id, error->message, PURPLE_MESSAGE_ERROR | PURPLE_MESSAGE_RECV, time(NULL));
-			g_error_free(error);
-		}
-		g_free(buddy_id);
+		reply->error = g_strdup(error ? error->message : "Unknown error");
+		g_clear_error(&error);
+		aichat_reply_finish(reply);
 		return;
 	}
 	
@@ -488,37 +1964,83 @@ aichat_chat_completion_cb(AiChatAccount *cga, JsonObject *obj, gpointer user_dat
 	if (provider->parse_response) {
 		response_text = provider->parse_response(obj, &error);
 		if (response_text == NULL) {
-			purple_debug_error("aichat", "Failed to parse response: %s\n", error ? error->message : "Unknown error");
-			if (error) {
-				purple_serv_got_im(cga->pc, buddy_id, error->message, PURPLE_MESSAGE_ERROR | PURPLE_MESSAGE_RECV, time(NULL));
-				g_error_free(error);
-			}
-			g_free(buddy_id);
-			return;
+			reply->error = g_strdup(error ? error->message : "Failed to parse response");
+			g_clear_error(&error);
+		} else {
+			aichat_reply_append(reply, response_text, -1);
+			g_free(response_text);
 		}
 	}
 	
-	/* Convert markdown to HTML */
-	gchar *html = markdown_convert_markdown(response_text, TRUE, FALSE);
+	if (provider->parse_usage) {
+		provider->parse_usage(obj, &reply->state);
+	}
 	
-	/* Send the message to the user */
-	purple_serv_got_im(cga->pc, buddy_id, html, PURPLE_MESSAGE_RECV, time(NULL));
+	aichat_reply_finish(reply);
+}
+
+/* As aichat_chat_completion_cb() for a whole response, for providers that
+ * can read it without building a tree */
+static void
+aichat_chat_response_raw_cb(AiChatAccount *cga, const gchar *data, gsize len, gpointer user_data)
+{
+	AiChatReply *reply = user_data;
+	GError *error = NULL;
 	
-	/* Add to buddy history */
-	PurpleBuddy *buddy = purple_find_buddy(cga->account, buddy_id);
-	if (buddy) {
-		AiChatBuddy *cgb = purple_buddy_get_protocol_data(buddy);
-		if (cgb) {
-			AiChatHistory *hist = g_new0(AiChatHistory, 1);
-			hist->role = g_strdup("assistant");
-			hist->content = g_strdup(response_text);
-			cgb->history = g_list_append(cgb->history, hist);
-		}
+	g_string_truncate(reply->state.delta, 0);
+	if (!reply->provider->parse_response_raw(data, len, &reply->state, &error)) {
+		reply->error = g_strdup(error ? error->message : "Failed to parse response");
+		g_clear_error(&error);
+	} else if (reply->state.delta->len == 0) {
+		reply->error = g_strdup("Empty response");
+	} else {
+		aichat_reply_append(reply, reply->state.delta->str, reply->state.delta->len);
 	}
 	
-	g_free(response_text);
-	g_free(html);
-	g_free(buddy_id);
+	aichat_reply_finish(reply);
+}
+
+/* Set up the protocol data of a bot made by aichat_create_simple_bot(),
+ * from what was stored with its buddy */
+static void
+aichat_simple_bot_setup(AiChatAccount *cga, PurpleBuddy *buddy)
+{
+	PurpleBlistNode *node = PURPLE_BLIST_NODE(buddy);
+	AiChatBuddy *cbuddy = g_new0(AiChatBuddy, 1);
+	const gchar *model = purple_blist_node_get_string(node, "model");
+	gchar *description;
+	
+	cbuddy->buddy = buddy;
+	cbuddy->instructions = aichat_string_intern(purple_blist_node_get_string(node, "instructions"));
+	cbuddy->name = aichat_string_intern(purple_buddy_get_alias(buddy));
+	description = g_strdup_printf("AI Assistant using %s", llm_provider_get_display_name(cga->provider_type));
+	cbuddy->description = aichat_string_intern(description);
+	g_free(description);
+	cbuddy->model = aichat_string_intern(model != NULL ? model : purple_account_get_string(cga->account, "default_model", ""));
+	cbuddy->provider = llm_provider_get(cga->provider_type);
+	
+	/* Read when the conversation is first used, see aichat_buddy_load_history() */
+	cbuddy->saves_history = TRUE;
+	
+	purple_buddy_set_protocol_data(buddy, cbuddy);
+}
+
+/* Set up the bots made on earlier runs */
+static void
+aichat_restore_simple_bots(AiChatAccount *cga)
+{
+	GSList *buddies = purple_blist_find_buddies(cga->account, NULL);
+	
+	while (buddies != NULL) {
+		PurpleBuddy *buddy = buddies->data;
+		
+		if (purple_buddy_get_protocol_data(buddy) == NULL &&
+				purple_blist_node_get_string(PURPLE_BLIST_NODE(buddy), "instructions") != NULL) {
+			aichat_simple_bot_setup(cga, buddy);
+			purple_prpl_got_user_status(cga->account, purple_buddy_get_name(buddy), "available", NULL);
+		}
+		buddies = g_slist_delete_link(buddies, buddies);
+	}
 }
 
 /* Create a simple bot for non-OpenAI providers */
@@ -550,16 +2072,11 @@ aichat_create_simple_bot(AiChatAccount *cga, const gchar *instructions)
 	}
 	
 	PurpleBuddy *buddy = purple_find_buddy(cga->account, bot_id);
-	AiChatBuddy *cbuddy = g_new0(AiChatBuddy, 1);
-	purple_buddy_set_protocol_data(buddy, cbuddy);
 	
-	cbuddy->buddy = buddy;
-	cbuddy->instructions = g_strdup(instructions);
-	cbuddy->name = g_strdup(bot_name);
-	cbuddy->description = g_strdup_printf("AI Assistant using %s", llm_provider_get_display_name(cga->provider_type));
-	cbuddy->model = g_strdup(purple_account_get_string(cga->account, "default_model", ""));
-	cbuddy->history = NULL;
-	cbuddy->provider = llm_provider_get(cga->provider_type);
+	/* Kept with the buddy so the bot can be set up again next time */
+	purple_blist_node_set_string(PURPLE_BLIST_NODE(buddy), "instructions", instructions);
+	purple_blist_node_set_string(PURPLE_BLIST_NODE(buddy), "model", purple_account_get_string(cga->account, "default_model", ""));
+	aichat_simple_bot_setup(cga, buddy);
 	
 	/* Mark as online */
 	purple_prpl_got_user_status(cga->account, bot_id, "available", NULL);
@@ -575,6 +2092,116 @@ aichat_create_simple_bot(AiChatAccount *cga, const gchar *instructions)
 	g_free(bot_name);
 }
 
+/* Send the request for the message @cgb's history ends with, the context
+ * window and anything recalled having been worked out */
+static void
+aichat_send_chat_request(AiChatAccount *cga, AiChatBuddy *cgb, LLMProvider *provider, gint64 start)
+{
+	const gchar *buddy_id = purple_buddy_get_name(cgb->buddy);
+	AiChatJsonBody *body;
+	gchar *url;
+	gboolean stream;
+	AiChatReply *reply;
+	
+	stream = provider->supports_streaming && provider->parse_stream_event != NULL &&
+		purple_account_get_bool(cga->account, "stream_responses", TRUE);
+	
+	/* Format request using provider interface; the history ends with the new message */
+	if (provider->format_request) {
+		body = provider->format_request(cgb, stream);
+		if (body == NULL) {
+			purple_debug_error("aichat", "Failed to format request\n");
+			purple_serv_got_typing_stopped(cga->pc, buddy_id);
+			return;
+		}
+	} else {
+		purple_debug_error("aichat", "Provider has no format_request function\n");
+		purple_serv_got_typing_stopped(cga->pc, buddy_id);
+		return;
+	}
+	
+	/* Get chat URL */
+	if (stream && provider->get_stream_url) {
+		url = provider->get_stream_url(provider, cgb);
+	} else if (provider->get_chat_url) {
+		url = provider->get_chat_url(provider, cgb);
+	} else {
+		url = g_strdup_printf("%s%s", provider->endpoint_url, provider->chat_endpoint);
+	}
+	
+	/* Send request using provider-aware HTTP function */
+	reply = aichat_reply_new(cga, buddy_id, provider);
+	reply->stats.start = start;  /* Formatting the request counts towards building it */
+	aichat_provider_http_request(cga, url, body, stream ? aichat_chat_stream_cb : NULL,
+		aichat_chat_completion_cb, provider->parse_response_raw ? aichat_chat_response_raw_cb : NULL,
+		aichat_reply_error_cb, &reply->stats, reply);
+	
+	g_free(url);
+}
+
+typedef struct {
+	gchar *buddy_id;
+	AiChatHistory *history;  /* To tell whether the window needs working out again */
+	LLMProvider *provider;
+	guint limit;             /* Snippets older than the turns still in the window */
+	gint64 start;
+} AiChatRecall;
+
+static void
+aichat_recall_cb(AiChatAccount *cga, const gfloat *vector, guint dimensions, gpointer user_data)
+{
+	AiChatRecall *recall = user_data;
+	PurpleBuddy *buddy = purple_find_buddy(cga->account, recall->buddy_id);
+	AiChatBuddy *cgb = buddy ? purple_buddy_get_protocol_data(buddy) : NULL;
+	AiChatMemoryMatch matches[AICHAT_MEMORY_RECALL];
+	guint found = 0;
+	guint i, j;
+
+	if (cgb == NULL) {
+		g_free(recall->buddy_id);
+		g_free(recall);
+		return;
+	}
+
+	if (vector != NULL && cgb->memory != NULL) {
+		found = aichat_memory_search(cgb->memory, vector, dimensions, recall->limit, matches, AICHAT_MEMORY_RECALL);
+	}
+	if (found > 0) {
+		GString *text = g_string_new(AICHAT_MEMORY_RECALL_PREFIX);
+
+		/* In the order they were said */
+		for (i = 1; i < found; i++) {
+			AiChatMemoryMatch match = matches[i];
+
+			for (j = i; j > 0 && matches[j - 1].index > match.index; j--) {
+				matches[j] = matches[j - 1];
+			}
+			matches[j] = match;
+		}
+		for (i = 0; i < found; i++) {
+			g_string_append(text, aichat_memory_get_text(cgb->memory, matches[i].index));
+			g_string_append(text, "\n\n");
+		}
+		g_string_append(text, AICHAT_MEMORY_RECALL_SUFFIX);
+
+		aichat_history_set_recall(cgb->history, text->str);
+		purple_debug_info("aichat", "Recalled %u of %u earlier exchanges with %s\n", found, recall->limit, recall->buddy_id);
+		g_string_free(text, TRUE);
+	}
+
+	/* Make room for what was recalled, or for a history read in full by a
+	 * summary in the meantime */
+	if (found > 0 || cgb->history != recall->history) {
+		aichat_context_fit(cga, cgb, recall->provider);
+	}
+
+	aichat_send_chat_request(cga, cgb, recall->provider, recall->start);
+	aichat_history_set_recall(cgb->history, NULL);
+
+	g_free(recall->buddy_id);
+	g_free(recall);
+}
+
 /* Generic function to send chat message using provider interface */
 static void
 aichat_send_chat_message(AiChatAccount *cga, const gchar *buddy_id, const gchar *message)
@@ -582,8 +2209,9 @@ aichat_send_chat_message(AiChatAccount *cga, const gchar *buddy_id, const gchar
 	PurpleBuddy *buddy;
 	AiChatBuddy *cgb;
 	LLMProvider *provider;
-	JsonObject *request;
-	gchar *url;
+	AiChatMemory *memory;
+	guint len, pinned, start;
+	gint64 started = g_get_monotonic_time();
 	
 	buddy = purple_find_buddy(cga->account, buddy_id);
 	if (buddy == NULL) {
@@ -604,85 +2232,140 @@ aichat_send_chat_message(AiChatAccount *cga, const gchar *buddy_id, const gchar
 	}
 	
 	/* Add message to history */
-	AiChatHistory *hist = g_new0(AiChatHistory, 1);
-	hist->role = g_strdup("user");
-	hist->content = g_strdup(message);
-	cgb->history = g_list_append(cgb->history, hist);
+	aichat_buddy_load_history(cga, cgb);
+	aichat_buddy_add_turn(cgb, AICHAT_ROLE_USER, message, -1);
 	
 	/* Set provider for buddy if not set */
 	if (cgb->provider == NULL) {
 		cgb->provider = provider;
 	}
 	
-	/* Format request using provider interface */
-	if (provider->format_request) {
-		request = provider->format_request(cgb, message);
-		if (request == NULL) {
-			purple_debug_error("aichat", "Failed to format request\n");
+	aichat_context_fit(cga, cgb, provider);
+	
+	purple_serv_got_typing(cga->pc, buddy_id, 0, PURPLE_TYPING);
+	
+	/* Older turns were left out, so look for any that are about the same thing */
+	memory = aichat_buddy_get_memory(cga, cgb);
+	aichat_history_get_window(cgb->history, &pinned, &start);
+	len = aichat_history_get_length(cgb->history);
+	if (memory != NULL && start > pinned) {
+		/* A snippet for every exchange, the newest of which are still sent */
+		guint sent = (len - 1 - start) / 2;
+		
+		if (aichat_memory_get_size(memory) > sent) {
+			AiChatRecall *recall = g_new0(AiChatRecall, 1);
+			
+			recall->buddy_id = g_strdup(buddy_id);
+			recall->history = cgb->history;
+			recall->provider = provider;
+			recall->limit = aichat_memory_get_size(memory) - sent;
+			recall->start = started;
+			aichat_embed(cga, message, aichat_recall_cb, recall);
 			return;
 		}
-	} else {
-		purple_debug_error("aichat", "Provider has no format_request function\n");
-		return;
-	}
-	
-	/* Get chat URL */
-	if (provider->get_chat_url) {
-		url = provider->get_chat_url(provider, cgb);
-	} else {
-		url = g_strdup_printf("%s%s", provider->endpoint_url, provider->chat_endpoint);
 	}
 	
-	/* Send request using provider-aware HTTP function */
-	aichat_provider_http_request(cga, url, request, aichat_chat_completion_cb, g_strdup(buddy_id));
-	
-	json_object_unref(request);
-	g_free(url);
+	aichat_send_chat_request(cga, cgb, provider, started);
 }
 
-static void
-aichat_fetch_assistants_cb(AiChatAccount *cga, JsonObject *obj, gpointer user_data)
+static const gchar * const aichat_assistant_list_path_names[] = {
+	"data.*",
+	NULL
+};
+
+static AiChatJsonPullPaths aichat_assistant_list_paths = AICHAT_JSON_PULL_PATHS_INIT(aichat_assistant_list_path_names);
+
+static const gchar * const aichat_assistant_path_names[] = {
+	"id",
+	"name",
+	"thread_id",
+	"instructions",
+	"description",
+	"model",
+	NULL
+};
+
+static AiChatJsonPullPaths aichat_assistant_paths = AICHAT_JSON_PULL_PATHS_INIT(aichat_assistant_path_names);
+
+enum {
+	AICHAT_ASSISTANT_ID,
+	AICHAT_ASSISTANT_NAME,
+	AICHAT_ASSISTANT_THREAD_ID,
+	AICHAT_ASSISTANT_INSTRUCTIONS,
+	AICHAT_ASSISTANT_DESCRIPTION,
+	AICHAT_ASSISTANT_MODEL,
+	AICHAT_ASSISTANT_N_PATHS
+};
+
+/* Intern a string value, or give NULL if there isn't one */
+static const gchar *
+aichat_json_pull_intern(const AiChatJsonPullValue *value)
 {
-	JsonArray *data_arr = json_object_get_array_member(obj, "data");
-	guint i, len = json_array_get_length(data_arr);
-	
-	for (i = 0; i < len; i++) {
-		JsonObject *data_obj = json_array_get_object_element(data_arr, i);
-		const gchar *id = json_object_get_string_member(data_obj, "id");
-		const gchar *name = json_object_get_string_member(data_obj, "name");
+	gchar *str = aichat_json_pull_dup_string(value);
+	const gchar *ret = aichat_string_intern(str);
 
-		// add to the buddy list
-		if (!purple_find_buddy(cga->account, id)) {
-			purple_blist_add_buddy(purple_buddy_new(cga->account, id, name), NULL, NULL, NULL);
-		}
+	g_free(str);
+	return ret;
+}
 
-		PurpleBuddy *buddy = purple_find_buddy(cga->account, id);
-		AiChatBuddy *cbuddy = g_new0(AiChatBuddy, 1);
-		purple_buddy_set_protocol_data(buddy, cbuddy);
-
-		cbuddy->buddy = buddy;
-		cbuddy->thread_id = g_strdup(json_object_get_string_member(data_obj, "thread_id"));
-		cbuddy->instructions = g_strdup(json_object_get_string_member(data_obj, "instructions"));
-		cbuddy->name = g_strdup(json_object_get_string_member(data_obj, "name"));
-		cbuddy->description = g_strdup(json_object_get_string_member(data_obj, "description"));
-		cbuddy->model = g_strdup(json_object_get_string_member(data_obj, "model"));
-
-		const gchar *thread_id = purple_blist_node_get_string(PURPLE_BLIST_NODE(buddy), "thread_id");
-		if (thread_id == NULL || thread_id[0] == 0) {
-			JsonObject *thread_obj = json_object_new();
-			// create a thread for the assistant
-			aichat_http_request(cga, "/v1/threads", thread_obj, aichat_create_thread_cb, g_strdup(id));
-			json_object_unref(thread_obj);
-		}
+/* Called with each assistant in the list, as the span of its object */
+static gboolean
+aichat_fetch_assistant_cb(guint path, const AiChatJsonPullValue *value, gpointer user_data)
+{
+	AiChatAccount *cga = user_data;
+	AiChatJsonPullValue values[AICHAT_ASSISTANT_N_PATHS];
+	gchar *id, *name;
+
+	if (value->type != AICHAT_JSON_PULL_OBJECT ||
+			!aichat_json_pull(value->data, value->len, &aichat_assistant_paths, values)) {
+		return TRUE;
+	}
+	id = aichat_json_pull_dup_string(&values[AICHAT_ASSISTANT_ID]);
+	if (id == NULL) {
+		return TRUE;
+	}
+	name = aichat_json_pull_dup_string(&values[AICHAT_ASSISTANT_NAME]);
+
+	// add to the buddy list
+	if (!purple_find_buddy(cga->account, id)) {
+		purple_blist_add_buddy(purple_buddy_new(cga->account, id, name), NULL, NULL, NULL);
+	}
+
+	PurpleBuddy *buddy = purple_find_buddy(cga->account, id);
+	AiChatBuddy *cbuddy = g_new0(AiChatBuddy, 1);
+	purple_buddy_set_protocol_data(buddy, cbuddy);
+
+	cbuddy->buddy = buddy;
+	cbuddy->thread_id = aichat_json_pull_dup_string(&values[AICHAT_ASSISTANT_THREAD_ID]);
+	cbuddy->instructions = aichat_json_pull_intern(&values[AICHAT_ASSISTANT_INSTRUCTIONS]);
+	cbuddy->name = aichat_string_intern(name);
+	cbuddy->description = aichat_json_pull_intern(&values[AICHAT_ASSISTANT_DESCRIPTION]);
+	cbuddy->model = aichat_json_pull_intern(&values[AICHAT_ASSISTANT_MODEL]);
 
-		purple_prpl_got_user_status(cga->account, id, "available", NULL);
+	const gchar *thread_id = purple_blist_node_get_string(PURPLE_BLIST_NODE(buddy), "thread_id");
+	if (thread_id == NULL || thread_id[0] == 0) {
+		JsonObject *thread_obj = json_object_new();
+		// create a thread for the assistant
+		aichat_http_request(cga, "/v1/threads", thread_obj, aichat_create_thread_cb, g_strdup(id));
+		json_object_unref(thread_obj);
 	}
+
+	purple_prpl_got_user_status(cga->account, id, "available", NULL);
+	g_free(name);
+	g_free(id);
+	return TRUE;
+}
+
+static void
+aichat_fetch_assistants_cb(AiChatAccount *cga, const gchar *data, gsize len, gpointer user_data)
+{
+	aichat_json_pull_foreach(data, len, &aichat_assistant_list_paths, aichat_fetch_assistant_cb, cga);
 }
 
 static void
 aichat_fetch_assistants(AiChatAccount *cga)
 {
-	aichat_http_request(cga, "/v1/assistants", NULL, aichat_fetch_assistants_cb, NULL);
+	aichat_http_request_full(cga, "/v1/assistants", NULL, NULL, NULL, aichat_fetch_assistants_cb, NULL, NULL, cga);
 }
 
 
@@ -725,22 +2408,14 @@ aichat_buddy_free(PurpleBuddy *buddy)
 	AiChatBuddy *cbuddy = purple_buddy_get_protocol_data(buddy);
 	if (cbuddy) {
 		g_free(cbuddy->thread_id);
-		g_free(cbuddy->instructions);
-		g_free(cbuddy->name);
-		g_free(cbuddy->description);
-		g_free(cbuddy->model);
-		
-		/* Free history list */
-		if (cbuddy->history) {
-			GList *l;
-			for (l = cbuddy->history; l; l = l->next) {
-				AiChatHistory *hist = l->data;
-				g_free(hist->role);
-				g_free(hist->content);
-				g_free(hist);
-			}
-			g_list_free(cbuddy->history);
-		}
+		aichat_string_release(cbuddy->instructions);
+		aichat_string_release(cbuddy->name);
+		aichat_string_release(cbuddy->description);
+		aichat_string_release(cbuddy->model);
+		aichat_history_free(cbuddy->history);
+		aichat_history_log_close(cbuddy->log);
+		aichat_memory_close(cbuddy->memory);
+		g_free(cbuddy->memory_model);
 		
 		g_free(cbuddy);
 	}
@@ -822,6 +2497,7 @@ aichat_login(PurpleAccount *account)
 	AiChatAccount *cga = g_new0(AiChatAccount, 1);
 	PurpleConnectionFlags flags;
 	const gchar *provider_name;
+	const gchar *tokenizer_file;
 	
 	purple_connection_set_protocol_data(pc, cga);
 
@@ -833,6 +2509,20 @@ aichat_login(PurpleAccount *account)
 	cga->pc = pc;
 	cga->keepalive_pool = purple_http_keepalive_pool_new();
 	cga->conns = purple_http_connection_set_new();
+	cga->run_polls = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, aichat_run_poll_free);
+	cga->stats = aichat_stats_new();
+	cga->parser = json_parser_new();
+	
+	tokenizer_file = purple_account_get_string(account, "tokenizer_file", NULL);
+	if (tokenizer_file != NULL && *tokenizer_file) {
+		GError *error = NULL;
+		
+		cga->tokenizer = aichat_tokenizer_new_from_file(tokenizer_file, &error);
+		if (cga->tokenizer == NULL) {
+			purple_debug_warning("aichat", "Couldn't load tokenizer, estimating token counts instead: %s\n", error->message);
+			g_error_free(error);
+		}
+	}
 	
 	/* Initialize provider type */
 	provider_name = purple_account_get_string(account, "provider", "openai");
@@ -890,7 +2580,8 @@ aichat_login(PurpleAccount *account)
 			g_free(welcome_msg);
 			
 			/* For non-OpenAI providers, we don't fetch assistants */
-			/* Users will create bots manually */
+			/* Users create bots manually, and those are kept locally */
+			aichat_restore_simple_bots(cga);
 		}
 	}
 }
@@ -917,12 +2608,22 @@ aichat_close(PurpleConnection *pc)
 		buddies = g_slist_delete_link(buddies, buddies);
 	}
 	
+	/* Before the connections go, as cancelling a poll needs the poll */
+	g_hash_table_destroy(sa->run_polls);
+	sa->run_polls = NULL;
+	
 	purple_debug_info("teams", "destroying incomplete connections\n");
 
 	purple_http_connection_set_destroy(sa->conns);
 	sa->conns = NULL;
 	purple_http_conn_cancel_all(pc);
+	/* After the connections, whose callbacks can leave more of them */
+	g_slist_free_full(sa->finishing, (GDestroyNotify) aichat_reply_free);
+	sa->finishing = NULL;
 	purple_http_keepalive_pool_unref(sa->keepalive_pool);
+	aichat_stats_free(sa->stats);
+	g_object_unref(sa->parser);
+	aichat_tokenizer_free(sa->tokenizer);
 	
 	g_free(sa);
 }
@@ -956,6 +2657,85 @@ aichat_cmd_model(PurpleConversation *conv, const gchar *cmd, gchar **args, gchar
 	return PURPLE_CMD_RET_OK;
 }
 
+static PurpleCmdRet
+aichat_cmd_stats(PurpleConversation *conv, const gchar *cmd, gchar **args, gchar **error, void *data)
+{
+	const gchar *name = purple_conversation_get_name(conv);
+	AiChatAccount *cga = purple_connection_get_protocol_data(purple_conversation_get_connection(conv));
+	gchar *html;
+
+	// the instructor gets the numbers for every assistant
+	if (name == NULL || name[0] == 0 || purple_strequal(name, AICHAT_INSTRUCTOR_ID)) {
+		name = NULL;
+	}
+
+	html = aichat_stats_to_html(cga->stats, name);
+	purple_conversation_write_system_message(conv, html, PURPLE_MESSAGE_NO_LOG);
+	g_free(html);
+
+	return PURPLE_CMD_RET_OK;
+}
+
+static PurpleCmdRet
+aichat_cmd_tokens(PurpleConversation *conv, const gchar *cmd, gchar **args, gchar **error, void *data)
+{
+	const gchar *name = purple_conversation_get_name(conv);
+	AiChatAccount *cga = purple_connection_get_protocol_data(purple_conversation_get_connection(conv));
+	PurpleBuddy *buddy = name ? purple_find_buddy(cga->account, name) : NULL;
+	AiChatBuddy *cgb = buddy ? purple_buddy_get_protocol_data(buddy) : NULL;
+	LLMProvider *provider;
+	AiChatHistoryEntry *entries;
+	guint len, pinned, start, skipped, i;
+	guint64 total = 0, sent = 0;
+	gint limit;
+	gchar *method, *html;
+
+	if (cgb == NULL) {
+		return PURPLE_CMD_RET_FAILED;
+	}
+	aichat_buddy_load_history(cga, cgb);
+	provider = cgb->provider ? cgb->provider : llm_provider_get(cga->provider_type);
+	if (provider == NULL) {
+		return PURPLE_CMD_RET_FAILED;
+	}
+
+	/* The window as the next message would have it, not as the last one did */
+	aichat_context_fit(cga, cgb, provider);
+
+	len = aichat_history_get_length(cgb->history);
+	entries = aichat_history_get_entries(cgb->history);
+	aichat_history_get_window(cgb->history, &pinned, &start);
+	skipped = cgb->log != NULL ? aichat_history_log_get_skipped(cgb->log) : 0;
+	for (i = 0; i < len; i++) {
+		guint tokens = aichat_context_entry_tokens(cga, &entries[i]);
+
+		total += tokens;
+		if (i < pinned || i >= start) {
+			sent += tokens;
+		}
+	}
+	limit = aichat_context_get_limit(cga, cgb, provider);
+
+	if (cga->tokenizer != NULL) {
+		method = g_strdup_printf(_("counted with a %u token vocabulary"), aichat_tokenizer_get_size(cga->tokenizer));
+	} else {
+		method = g_strdup(_("estimated from the length of the text"));
+	}
+
+	html = g_strdup_printf(_("Instructions: %u tokens<br>"
+		"Conversation: %" G_GUINT64_FORMAT " tokens in %u turns, of which %" G_GUINT64_FORMAT " are sent<br>"
+		"Older turns left on disk, not counted: %u<br>"
+		"Context window: %d tokens<br>"
+		"Tokens are %s"),
+		aichat_context_count_tokens(cga, cgb->instructions, -1),
+		total, len, sent, skipped, limit, method);
+	purple_conversation_write_system_message(conv, html, PURPLE_MESSAGE_NO_LOG);
+	g_free(html);
+	g_free(method);
+
+	return PURPLE_CMD_RET_OK;
+}
+
 /******************************************************************************/
 /* Plugin functions */
 /******************************************************************************/
@@ -1010,6 +2790,16 @@ plugin_load(PurplePlugin *plugin
 						AICHAT_PLUGIN_ID, aichat_cmd_model,
 						_("model &lt;model&gt;:  Change the model of the assistant"), NULL);
 	
+	purple_cmd_register("stats", "", PURPLE_CMD_P_PLUGIN, PURPLE_CMD_FLAG_IM |
+						PURPLE_CMD_FLAG_PROTOCOL_ONLY,
+						AICHAT_PLUGIN_ID, aichat_cmd_stats,
+						_("stats:  Show how quickly the assistant has been replying"), NULL);
+	
+	purple_cmd_register("tokens", "", PURPLE_CMD_P_PLUGIN, PURPLE_CMD_FLAG_IM |
+						PURPLE_CMD_FLAG_PROTOCOL_ONLY,
+						AICHAT_PLUGIN_ID, aichat_cmd_tokens,
+						_("tokens:  Show how much of the context window the conversation takes up"), NULL);
+	
 	return TRUE;
 }
 
@@ -1032,6 +2822,18 @@ plugin_unload(PurplePlugin *plugin
 	return TRUE;
 }
 
+static void
+aichat_show_stats(PurpleProtocolAction *action)
+{
+	PurpleConnection *pc = purple_protocol_action_get_connection(action);
+	AiChatAccount *cga = purple_connection_get_protocol_data(pc);
+	gchar *html = aichat_stats_to_html(cga->stats, NULL);
+
+	purple_notify_formatted(pc, _("Latency Statistics"), _("Reply latency"),
+		_("Averages since connecting"), html, NULL, NULL);
+	g_free(html);
+}
+
 static GList *
 aichat_actions(
 #if !PURPLE_VERSION_CHECK(3, 0, 0)
@@ -1042,10 +2844,10 @@ PurpleConnection *pc
 )
 {
 	GList *m = NULL;
-	// PurpleProtocolAction *act;
+	PurpleProtocolAction *act;
 
-	// act = purple_protocol_action_new(_("Search for Teams Contacts"), aichat_search_users);
-	// m = g_list_append(m, act);
+	act = purple_protocol_action_new(_("Latency Statistics"), aichat_show_stats);
+	m = g_list_append(m, act);
 
 	return m;
 }
@@ -1129,6 +2931,43 @@ aichat_protocol_init(PurpleProtocol *prpl_info)
 	
 	opt = purple_account_option_bool_new(_("Generate avatar icons (costs $0.02 each)"), "generate_icons", TRUE);
 	PRPL_APPEND_ACCOUNT_OPTION(opt);
+	
+	opt = purple_account_option_bool_new(_("Show replies while they are being written"), "stream_responses", TRUE);
+	PRPL_APPEND_ACCOUNT_OPTION(opt);
+
+	opt = purple_account_option_int_new(_("Compress requests larger than (KB, 0 for never)"), "compress_requests_kb", 0);
+	PRPL_APPEND_ACCOUNT_OPTION(opt);
+
+	opt = purple_account_option_int_new(_("Context window (tokens, 0 for the model's own)"), "context_tokens", 0);
+	PRPL_APPEND_ACCOUNT_OPTION(opt);
+
+	opt = purple_account_option_int_new(_("Summarize conversations longer than (turns, 0 for never)"), "summarize_after", 0);
+	PRPL_APPEND_ACCOUNT_OPTION(opt);
+
+	opt = purple_account_option_string_new(_("Tokenizer vocabulary file (tiktoken format)"), "tokenizer_file", NULL);
+	PRPL_APPEND_ACCOUNT_OPTION(opt);
+
+	opt = purple_account_option_bool_new(_("Recall older turns left out of the context window"), "long_term_memory", FALSE);
+	PRPL_APPEND_ACCOUNT_OPTION(opt);
+
+	opt = purple_account_option_string_new(_("Embedding model (blank for the provider's own)"), "embedding_model", NULL);
+	PRPL_APPEND_ACCOUNT_OPTION(opt);
+
+	GList *paces = NULL;
+	PurpleKeyValuePair *pace;
+
+#define ADD_PACE(name, value) \
+	pace = g_new(PurpleKeyValuePair, 1); \
+	pace->key = g_strdup(name); \
+	pace->value = g_strdup(value); \
+	paces = g_list_append(paces, pace);
+
+	ADD_PACE(_("A paragraph at a time"), "paragraph");
+	ADD_PACE(_("A sentence at a time"), "sentence");
+
+	opt = purple_account_option_list_new(_("Show replies being written"), "stream_pace", paces);
+	PRPL_APPEND_ACCOUNT_OPTION(opt);
+#undef ADD_PACE
 
 	// list out the models to choose from by default
 	GList *models = NULL;
@@ -106,6 +106,12 @@
 
 /* Include providers header */
 #include "providers.h"
+#include "history.h"
+#include "historylog.h"
+#include "memory.h"
+#include "sse.h"
+#include "stats.h"
+#include "tokenizer.h"
 
 	
 #if GLIB_MAJOR_VERSION >= 2 && GLIB_MINOR_VERSION >= 12
@@ -119,12 +125,6 @@
 #define AICHAT_INSTRUCTOR_ID "OpenAI Agent"
 #define AICHAT_API_KEY_URL "https://platform.openai.com/settings/organization/general"
 
-typedef struct _AiChatHistory AiChatHistory;
-struct _AiChatHistory {
-	gchar *role;
-	gchar *content;
-};
-
 typedef struct _AiChatAccount AiChatAccount;
 struct _AiChatAccount {
 	PurpleAccount *account;
@@ -132,33 +132,65 @@ struct _AiChatAccount {
 	PurpleHttpKeepalivePool *keepalive_pool;
 	PurpleHttpConnectionSet *conns;
 	LLMProviderType provider_type;
+	GHashTable *run_polls;  /* Run id -> AiChatRunPoll, for assistant runs being polled */
+	AiChatStats *stats;     /* Reply latency averages, for /stats */
+	JsonParser *parser;     /* Reused for every response this account parses */
+	AiChatTokenizer *tokenizer;  /* From the "tokenizer_file" vocabulary, if set */
+	GSList *finishing;      /* Replies still being shown a piece at a time, see aichat_reply_finish() */
 };
 
 typedef struct _AiChatBuddy AiChatBuddy;
 struct _AiChatBuddy {
 	PurpleBuddy *buddy;
 	gchar *thread_id;
-	gchar *instructions;
-	gchar *name;
-	gchar *description;
-	gchar *model;
-	GList *history;  /* List of AiChatHistory */
+	const gchar *instructions;  /* These four are interned */
+	const gchar *name;
+	const gchar *description;
+	const gchar *model;
+	AiChatHistory *history;     /* NULL until the first message */
+	gboolean saves_history;     /* History is kept on disk, for bots whose server doesn't */
+	AiChatHistoryLog *log;      /* NULL until the conversation is first used */
+	AiChatMemory *memory;       /* NULL until first used, see aichat_buddy_get_memory() */
+	gchar *memory_model;        /* Embedding model the memory open is for */
 	LLMProvider *provider;
+	gboolean summarizing;       /* Older turns are being summarized, see aichat_summarize_history() */
 };
 
 
 typedef void (*AiChatCallbackFunc)(AiChatAccount *cga, JsonObject *obj, gpointer user_data);
+/* Gets an empty body, or the HTTP error (with a @data_len of -1) when a
+ * stream was cut off */
 typedef void (*AiChatCallbackErrorFunc)(AiChatAccount *cga, const gchar *data, gssize data_len, gpointer user_data);
+/* Gets the whole body of a response, for callers that read it without
+ * building a tree */
+typedef void (*AiChatRawCallbackFunc)(AiChatAccount *cga, const gchar *data, gsize len, gpointer user_data);
+typedef void (*AiChatStreamEventFunc)(AiChatAccount *cga, const gchar *event, const gchar *data, gsize data_len, gpointer user_data);
 
 typedef struct _AiChatApiConnection AiChatApiConnection;
 struct _AiChatApiConnection {
 	AiChatAccount *cga;
 	gchar *url;
 	AiChatCallbackFunc callback;
+	AiChatRawCallbackFunc raw_callback;     /* Used in place of callback when set */
 	gpointer user_data;
 	PurpleHttpConnection *http_conn;
 	AiChatCallbackErrorFunc error_callback;
+	AiChatSseParser *sse;                  /* Set for streamed requests */
+	AiChatStreamEventFunc stream_callback;
+	AiChatRequestStats *stats;             /* Timings to fill in, if any */
+	AiChatJsonBody *body;                  /* Request body, fed to the socket as it drains */
+	guint idle_timeout;                    /* Gives up on a stream that has gone quiet */
+	gboolean idle_after_first_event;       /* Only once the stream has started, see aichat_api_connection_set_stream() */
+	gboolean timed_out;
 };
 
+/* JSON helpers (libaichat.c) */
+gchar *json_object_to_string(const JsonObject *jsonobj, gsize *length);
+JsonNode *json_decode(const gchar *data, gssize len);
+JsonObject *json_string_to_object(const gchar *data, gssize len);
+/* Parse @data with @parser (or a parser of its own if that's NULL) and hand
+ * over a reference to the root object, or NULL if it isn't one */
+JsonObject *json_parser_load_object(JsonParser *parser, const gchar *data, gssize len);
+
 
 #endif /* LIBAICHAT_H */
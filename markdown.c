@@ -34,33 +34,119 @@
  *
  */
 
+#ifdef MARKDOWN_PIDGIN
+#	define MARKDOWN_PRE_OPEN      "<span style='font-family: monospace; white-space: pre'>"
+#	define MARKDOWN_PRE_CLOSE     "</span>"
+#	define MARKDOWN_CODE_OPEN     "<span style='font-family: monospace; white-space: pre'>"
+#	define MARKDOWN_CODE_CLOSE    "</span>"
+#	define MARKDOWN_SPOILER_OPEN  "<span style='foreground: black; background: black'>"
+#	define MARKDOWN_SPOILER_CLOSE "</span>"
+#else
+#	define MARKDOWN_PRE_OPEN      "<pre>"
+#	define MARKDOWN_PRE_CLOSE     "</pre>"
+#	define MARKDOWN_CODE_OPEN     "<code>"
+#	define MARKDOWN_CODE_CLOSE    "</code>"
+#	define MARKDOWN_SPOILER_OPEN  "<details><summary>Spoiler</summary>"
+#	define MARKDOWN_SPOILER_CLOSE "</details>"
+#endif
+
 #define HTML_TOGGLE_OUT(f, a, b) \
 	out = g_string_append(out, f ? b : a); \
 	f = !f;
 
-/* workaround errata in Discord's (users') markdown implementation */
+struct _MarkdownStream {
+	gboolean escape_html;
+	gboolean discord_hacks;
+
+	GString *in;          /* Input that hasn't been converted yet */
+	GString *out;         /* Output that hasn't been returned yet */
+	char prev;            /* Last character converted, for lookbehind */
+	gboolean finished;    /* No more input will follow */
+
+	gboolean s_bold;
+	gboolean s_italics;
+	gboolean s_underline;
+	gboolean s_strikethrough;
+	gboolean s_codeblock;
+	gboolean s_codebit;
+	gboolean s_spoiler;
+	GString *link_text;   /* Set inside [...] */
+	GString *link_url;    /* Set inside the (...) that follows */
+};
+
+/* Answers to lookahead questions, which can't always be given yet */
+typedef enum {
+	MARKDOWN_NO,
+	MARKDOWN_YES,
+	MARKDOWN_WAIT
+} MarkdownAnswer;
+
+/* Fetch the pending input character at @i.  Past the end of a finished
+ * stream that's NUL, like the terminator of a complete document; past the
+ * end of an unfinished one we don't know yet, and return FALSE. */
 
 static gboolean
-markdown_underscore_match(const gchar *html, int i)
+markdown_stream_peek(MarkdownStream *stream, gsize i, char *c)
 {
-	while (html[i] != ' ' && html[i]) {
-		if (html[i++] == '_') {
-			return !html[i] || html[i] == ' ';
+	if (i < stream->in->len) {
+		*c = stream->in->str[i];
+		return TRUE;
+	}
+
+	*c = '\0';
+	return stream->finished;
+}
+
+/* workaround errata in Discord's (users') markdown implementation */
+
+static MarkdownAnswer
+markdown_underscore_match(MarkdownStream *stream, gsize i)
+{
+	char c;
+
+	while (markdown_stream_peek(stream, i, &c)) {
+		if (c == ' ' || c == '\n' || !c) {
+			return MARKDOWN_NO;
 		}
+		if (c == '_') {
+			if (!markdown_stream_peek(stream, i + 1, &c)) {
+				return MARKDOWN_WAIT;
+			}
+			return (!c || c == ' ' || c == '\n') ? MARKDOWN_YES : MARKDOWN_NO;
+		}
+		i++;
 	}
 
-	return FALSE;
+	return MARKDOWN_WAIT;
 }
 
-static gboolean
-markdown_char_later_unspaced(const gchar *html, unsigned i, guint len, char c)
+/* Is there a @ch later in the paragraph that isn't preceded by a space?
+ * Looking further than the paragraph would hold up a streamed reply on
+ * every stray asterisk. */
+
+static MarkdownAnswer
+markdown_char_later_unspaced(MarkdownStream *stream, gsize i, char ch)
 {
-	for (i = i + 1; i < len; ++i)
-		if (html[i] == c)
-			if (html[i - 1] != ' ')
-				return TRUE;
+	const gchar *html = stream->in->str;
+	char c;
+
+	for (i = i + 1; markdown_stream_peek(stream, i, &c); ++i) {
+		if (!c) {
+			return MARKDOWN_NO;
+		}
+		if (c == '\n') {
+			if (!markdown_stream_peek(stream, i + 1, &c)) {
+				return MARKDOWN_WAIT;
+			}
+			if (c == '\n') {
+				return MARKDOWN_NO;
+			}
+		} else if (c == ch && html[i - 1] != ' ') {
+			return MARKDOWN_YES;
+		}
+	}
 
-	return FALSE;
+	return MARKDOWN_WAIT;
 }
 
 /* Is a character escapable, that is, does it have a special meaning in
@@ -97,238 +183,452 @@ markdown_is_escapable(char c)
 
 /* Should we interpret a _ as italics?  */
 
-static gboolean
-markdown_should_underscore_italics(const gchar *html, unsigned i, gboolean s_italics)
+static MarkdownAnswer
+markdown_should_underscore_italics(MarkdownStream *stream, gsize i)
 {
-	return s_italics || markdown_underscore_match(html, i + 1);
+	return stream->s_italics ? MARKDOWN_YES : markdown_underscore_match(stream, i + 1);
 }
 
 /* Should we interpret _  as special at all? */
 
-static gboolean
-markdown_should_underscore(const gchar *html, unsigned i, gboolean s_italics)
+static MarkdownAnswer
+markdown_should_underscore(MarkdownStream *stream, gsize i)
 {
-	return html[i + 1] == '_' || markdown_should_underscore_italics(html, i, s_italics);
+	char c;
+
+	if (!markdown_stream_peek(stream, i + 1, &c)) {
+		return MARKDOWN_WAIT;
+	}
+
+	return c == '_' ? MARKDOWN_YES : markdown_should_underscore_italics(stream, i);
 }
 
-static gchar *
-markdown_helper_replace(gchar *html, const gchar *tag, const gchar *replacement)
+static void
+markdown_stream_append_escaped(MarkdownStream *stream, const gchar *text, gsize len)
 {
-	gchar *replace_regex;
-	gchar *replace_with;
-
-	if (tag[0] == '<' && tag[1] == '/') {
-		//closing tag
-		replace_regex = g_strconcat("(\\s*)", tag, NULL);
-		replace_with = g_strconcat(replacement, "\\1", NULL);
-	} else {
-		replace_regex = g_strconcat(tag, "(\\s*)", NULL);
-		replace_with = g_strconcat("\\1", replacement, NULL);
+	GString *out = stream->out;
+	gsize i;
+
+	for (i = 0; i < len; i++) {
+		char c = text[i];
+
+		if (stream->escape_html && c == '<')
+			out = g_string_append(out, "&lt;");
+		else if (stream->escape_html && c == '>')
+			out = g_string_append(out, "&gt;");
+		else if (stream->escape_html && c == '&')
+			out = g_string_append(out, "&amp;");
+		else
+			out = g_string_append_c(out, c);
 	}
+}
 
-	GRegex *markdown_replace = g_regex_new(replace_regex, 0, 0, NULL);
-	gchar *temp = g_regex_replace(markdown_replace, html, -1, 0, replace_with, 0, NULL);
+/* Write out a link.  If it wasn't terminated properly, it isn't one after
+ * all and is written out as it was typed. */
 
-	g_free(replace_regex);
-	g_free(replace_with);
-	g_regex_unref(markdown_replace);
+static void
+markdown_stream_end_link(MarkdownStream *stream, gboolean complete)
+{
+	GString *out = stream->out;
 
-	if (temp != NULL) {
-		g_free(html);
-		html = temp;
+	if (complete) {
+		gchar *href = g_markup_escape_text(stream->link_url->str, stream->link_url->len);
+
+		out = g_string_append(out, "<a href=\"");
+		out = g_string_append(out, href);
+		out = g_string_append(out, "\">");
+		markdown_stream_append_escaped(stream, stream->link_text->str, stream->link_text->len);
+		out = g_string_append(out, "</a>");
+		g_free(href);
+	} else {
+		out = g_string_append_c(out, '[');
+		markdown_stream_append_escaped(stream, stream->link_text->str, stream->link_text->len);
+		if (stream->link_url != NULL) {
+			out = g_string_append(out, "](");
+			markdown_stream_append_escaped(stream, stream->link_url->str, stream->link_url->len);
+		}
 	}
 
-	return html;
+	g_string_free(stream->link_text, TRUE);
+	stream->link_text = NULL;
+	if (stream->link_url != NULL) {
+		g_string_free(stream->link_url, TRUE);
+		stream->link_url = NULL;
+	}
 }
 
-gchar *
-markdown_convert_markdown(const gchar *html, gboolean escape_html, gboolean discord_hacks)
-{
-	g_return_val_if_fail(html != NULL, NULL);
-
-	guint html_len = strlen(html);
-	GString *out = g_string_sized_new(html_len * 2);
+/* Convert as much of the pending input as can be settled.  A character is
+ * only converted once everything it depends on has arrived, so the output
+ * never has to be taken back; whatever is still ambiguous stays pending. */
 
-	gboolean s_bold = FALSE;
-	gboolean s_italics = FALSE;
-	gboolean s_underline = FALSE;
-	gboolean s_strikethrough = FALSE;
-	gboolean s_codeblock = FALSE;
-	gboolean s_codebit = FALSE;
-	gboolean s_spoiler = FALSE;
-	gboolean s_link_url = FALSE;
-	gboolean s_link_text = FALSE;
-	GString *link_text = NULL;
+static void
+markdown_stream_convert(MarkdownStream *stream)
+{
+	const gchar *html = stream->in->str;
+	gsize html_len = stream->in->len;
+	GString *out = stream->out;
+	gsize i = 0;
 
-	guint i;
-	for (i = 0; i < html_len; ++i) {
+	while (i < html_len) {
 		char c = html[i];
+		char prev = i > 0 ? html[i - 1] : stream->prev;
+		char c1, c2;
+		MarkdownAnswer answer;
+		/* Where to carry on once this character is dealt with */
+		gsize next = i + 1;
 
-		if ((s_codeblock || s_codebit) && c != '`') {
+		if ((stream->s_codeblock || stream->s_codebit) && c != '`') {
 			out = g_string_append_c(out, c);
-			continue;
-		}
-		if (s_link_url) {
+		} else if (stream->link_url != NULL) {
 			if (c == ')') {
-				out = g_string_append(out, "\">");
-				out = g_string_append(out, link_text->str);
-				out = g_string_append(out, "</a>");
-				g_string_free(link_text, TRUE);
-				link_text = NULL;
-				s_link_url = FALSE;
+				markdown_stream_end_link(stream, TRUE);
+			} else if (c == '\n') {
+				// Links don't span lines, so this one was never finished
+				markdown_stream_end_link(stream, FALSE);
+				next = i;
 			} else {
-				out = g_string_append_c(out, c);
+				stream->link_url = g_string_append_c(stream->link_url, c);
 			}
-			continue;
-		}
-		if (s_link_text) {
+		} else if (stream->link_text != NULL) {
 			if (c == ']') {
-				if (html[i + 1] == '(') {
-					out = g_string_append(out, "<a href=\"");
-					s_link_url = TRUE;
-					i++;
+				if (!markdown_stream_peek(stream, i + 1, &c1))
+					break;
+
+				if (c1 == '(') {
+					stream->link_url = g_string_new("");
+					next = i + 2;
 				} else {
 					// Unexpected character, probably not a url, just print it
-					out = g_string_append_c(out, '[');
-					out = g_string_append(out, link_text->str);
+					markdown_stream_end_link(stream, FALSE);
 					out = g_string_append_c(out, ']');
-					out = g_string_append_c(out, c);
-					g_string_free(link_text, TRUE);
-					link_text = NULL;
 				}
-				s_link_text = FALSE;
+			} else if (c == '\n') {
+				markdown_stream_end_link(stream, FALSE);
+				next = i;
 			} else {
-				link_text = g_string_append_c(link_text, c);
+				stream->link_text = g_string_append_c(stream->link_text, c);
 			}
-			continue;
-		}
-
-		if (c == '\\') {
-			char next_char = html[++i];
-
-			/* If this is an escape-able character, don't print the
-			 * backslash. Otherwise, do because the \ wasn't an
-			 * escape anyway */
-
-			gboolean escapable = markdown_is_escapable(next_char);
+		} else if (c == '\\') {
+			if (!markdown_stream_peek(stream, i + 1, &c1))
+				break;
 
-			/* Also, if this is an escapable character that would
-			 * not actually -matter-, print it too. Fixes shruggie
-			 * */
+			if (!c1) {
+				/* Trailing backslash */
+				out = g_string_append_c(out, '\\');
+			} else {
+				/* If this is an escape-able character, don't print the
+				 * backslash. Otherwise, do because the \ wasn't an
+				 * escape anyway */
+
+				gboolean escapable = markdown_is_escapable(c1);
+
+				/* Also, if this is an escapable character that would
+				 * not actually -matter-, print it too. Fixes shruggie
+				 * */
+
+				if (c1 == '_' && (stream->escape_html || stream->discord_hacks)) {
+					answer = markdown_should_underscore(stream, i + 1);
+					if (answer == MARKDOWN_WAIT)
+						break;
+					if (answer == MARKDOWN_NO)
+						escapable = FALSE;
+				}
 
-			if (next_char == '_' && !markdown_should_underscore(html, i + 1, s_italics) && (escape_html || discord_hacks))
-				escapable = FALSE;
+				if (!escapable) {
+					out = g_string_append_c(out, '\\');
+				}
 
-			if (!escapable) {
-				out = g_string_append_c(out, '\\');
+				/* Append the next char regardless */
+				markdown_stream_append_escaped(stream, &c1, 1);
+				next = i + 2;
 			}
-
-			/* Append the next char regardless */
-			out = g_string_append_c(out, next_char);
-		} else if ((c == '<' || c == '>' || c == '&') && escape_html) {
+		} else if ((c == '<' || c == '>' || c == '&') && stream->escape_html) {
 			/* These characters lack any particular meaning in
 			 * Markdown, but need to be escaped to prevent getting
 			 * mixed up with HTML. Failing to do so may result in
 			 * valid parts of the message being stripped by
 			 * overzealous sanitizers */
 
-			if (c == '<')
-				out = g_string_append(out, "&lt;");
-			else if (c == '>')
-				out = g_string_append(out, "&gt;");
-			else /*if (c == '&')*/
-				out = g_string_append(out, "&amp;");
+			markdown_stream_append_escaped(stream, &c, 1);
 		} else if (c == '*') {
-			if (html[i + 1] == '*') {
-				HTML_TOGGLE_OUT(s_bold, "<b>", "</b>");
-				i += 1;
+			if (!markdown_stream_peek(stream, i + 1, &c1))
+				break;
+
+			if (c1 == '*') {
+				HTML_TOGGLE_OUT(stream->s_bold, "<b>", "</b>");
+				next = i + 2;
 			} else {
 				/* Workaround some corner cases regarding italics placement. */
 
 				/* Don't match a*b */
-				gboolean unspaced_end = s_italics && html[i - 1] != ' ';
+				gboolean unspaced_end = stream->s_italics && prev != ' ';
 
 				/* Don't match a* b */
-				gboolean unspaced_begin = !s_italics && html[i + 1] != ' ';
+				gboolean unspaced_begin = !stream->s_italics && c1 != ' ';
 
 				/* Don't match "*correction" or even "*correction *" */
-				gboolean balanced = s_italics || markdown_char_later_unspaced(html, i, html_len, '*');
+				answer = MARKDOWN_NO;
+				if (unspaced_begin || unspaced_end) {
+					answer = stream->s_italics ? MARKDOWN_YES : markdown_char_later_unspaced(stream, i, '*');
+					if (answer == MARKDOWN_WAIT)
+						break;
+				}
 
-				if ((unspaced_begin || unspaced_end) && balanced) {
-					HTML_TOGGLE_OUT(s_italics, "<i>", "</i>");
+				if (answer == MARKDOWN_YES) {
+					HTML_TOGGLE_OUT(stream->s_italics, "<i>", "</i>");
 				} else {
-					out = g_string_append_c(out, html[i]);
+					out = g_string_append_c(out, c);
 				}
 			}
-		} else if (c == '~' && html[i + 1] == '~') {
-			HTML_TOGGLE_OUT(s_strikethrough, "<s>", "</s>");
-			++i;
+		} else if (c == '~') {
+			if (!markdown_stream_peek(stream, i + 1, &c1))
+				break;
+
+			if (c1 == '~') {
+				HTML_TOGGLE_OUT(stream->s_strikethrough, "<s>", "</s>");
+				next = i + 2;
+			} else {
+				out = g_string_append_c(out, c);
+			}
 		} else if (c == '_') {
-			if (html[i + 1] == '_') {
-				HTML_TOGGLE_OUT(s_underline, "<u>", "</u>");
-				++i;
+			if (!markdown_stream_peek(stream, i + 1, &c1))
+				break;
+
+			if (c1 == '_') {
+				HTML_TOGGLE_OUT(stream->s_underline, "<u>", "</u>");
+				next = i + 2;
 			} else {
-				if (markdown_should_underscore_italics(html, i, s_italics)) {
-					HTML_TOGGLE_OUT(s_italics, "<i>", "</i>");
+				answer = markdown_should_underscore_italics(stream, i);
+				if (answer == MARKDOWN_WAIT)
+					break;
+
+				if (answer == MARKDOWN_YES) {
+					HTML_TOGGLE_OUT(stream->s_italics, "<i>", "</i>");
 				} else {
-					out = g_string_append_c(out, html[i]);
+					out = g_string_append_c(out, c);
 				}
 			}
 		} else if (c == '`') {
-			if (html[i + 1] == '`' && html[i + 2] == '`') {
-				if (!s_codeblock) {
-#ifdef MARKDOWN_PIDGIN
-					out = g_string_append(out, "<br/><span style='font-family: monospace; white-space: pre'>");
-#else
-					out = g_string_append(out, "<br/><pre>");
-#endif
+			if (!markdown_stream_peek(stream, i + 1, &c1))
+				break;
+			c2 = '\0';
+			if (c1 == '`' && !markdown_stream_peek(stream, i + 2, &c2))
+				break;
+
+			if (c1 == '`' && c2 == '`') {
+				if (!stream->s_codeblock) {
+					out = g_string_append(out, "<br/>" MARKDOWN_PRE_OPEN);
 				} else {
-#ifdef MARKDOWN_PIDGIN
-					out = g_string_append(out, "</span>");
-#else
-					out = g_string_append(out, "</pre>");
-#endif
-					i += 2;
+					out = g_string_append(out, MARKDOWN_PRE_CLOSE);
 				}
 
-				s_codeblock = !s_codeblock;
+				stream->s_codeblock = !stream->s_codeblock;
+				next = i + 3;
 			} else {
-#ifdef MARKDOWN_PIDGIN
-				HTML_TOGGLE_OUT(s_codebit, "<span style='font-family: monospace; white-space: pre'>", "</span>");
-#else
-				HTML_TOGGLE_OUT(s_codebit, "<code>", "</code>");
-#endif
+				HTML_TOGGLE_OUT(stream->s_codebit, MARKDOWN_CODE_OPEN, MARKDOWN_CODE_CLOSE);
 			}
 		} else if (c == '|') {
-			if (html[i + 1] == '|') {
-#ifdef MARKDOWN_PIDGIN
-				HTML_TOGGLE_OUT(s_spoiler, "<span style='foreground: black; background: black'>", "</span>");
-#else
-				HTML_TOGGLE_OUT(s_spoiler, "<details><summary>Spoiler</summary>", "</details>");
-#endif
-				i++;
+			if (!markdown_stream_peek(stream, i + 1, &c1))
+				break;
+
+			if (c1 == '|') {
+				HTML_TOGGLE_OUT(stream->s_spoiler, MARKDOWN_SPOILER_OPEN, MARKDOWN_SPOILER_CLOSE);
+				next = i + 2;
+			} else {
+				out = g_string_append_c(out, c);
 			}
 		} else if (c == '[') { //TODO handle ![...](...) as an image url
-			s_link_text = TRUE;
-			link_text = g_string_new("");
+			stream->link_text = g_string_new("");
 		} else if (c == '\n') {
 			out = g_string_append(out, "<br>");
 		} else {
 			out = g_string_append_c(out, c);
 		}
+
+		i = next;
 	}
 
-	if (G_UNLIKELY(link_text != NULL)) {
-		g_warn_if_reached();
+	if (i > 0) {
+		stream->prev = html[i - 1];
+		g_string_erase(stream->in, 0, i);
+	}
+}
 
-		out = g_string_append_c(out, '[');
-		out = g_string_append(out, link_text->str);
-		g_string_free(link_text, TRUE);
+MarkdownStream *
+markdown_stream_new(gboolean escape_html, gboolean discord_hacks)
+{
+	MarkdownStream *stream = g_new0(MarkdownStream, 1);
+
+	stream->escape_html = escape_html;
+	stream->discord_hacks = discord_hacks;
+	stream->in = g_string_new("");
+	stream->out = g_string_new("");
+
+	return stream;
+}
+
+void
+markdown_stream_free(MarkdownStream *stream)
+{
+	if (stream == NULL) {
+		return;
+	}
+
+	g_string_free(stream->in, TRUE);
+	g_string_free(stream->out, TRUE);
+	if (stream->link_text != NULL) {
+		g_string_free(stream->link_text, TRUE);
+	}
+	if (stream->link_url != NULL) {
+		g_string_free(stream->link_url, TRUE);
+	}
+	g_free(stream);
+}
+
+static gchar *
+markdown_stream_take_output(MarkdownStream *stream)
+{
+	gchar *html = g_string_free(stream->out, FALSE);
+
+	stream->out = g_string_new("");
+
+	return html;
+}
+
+gchar *
+markdown_stream_append(MarkdownStream *stream, const gchar *markdown, gssize len)
+{
+	g_return_val_if_fail(stream != NULL, NULL);
+	g_return_val_if_fail(!stream->finished, NULL);
+
+	if (markdown != NULL) {
+		stream->in = g_string_append_len(stream->in, markdown, len < 0 ? (gssize) strlen(markdown) : len);
+	}
+	markdown_stream_convert(stream);
+
+	return markdown_stream_take_output(stream);
+}
+
+static void
+markdown_stream_finish_input(MarkdownStream *stream)
+{
+	stream->finished = TRUE;
+	markdown_stream_convert(stream);
+
+	if (stream->link_text != NULL) {
+		markdown_stream_end_link(stream, FALSE);
+	}
+}
+
+gchar *
+markdown_stream_finish(MarkdownStream *stream)
+{
+	g_return_val_if_fail(stream != NULL, NULL);
+
+	if (!stream->finished) {
+		markdown_stream_finish_input(stream);
 	}
 
+	return markdown_stream_take_output(stream);
+}
+
+gchar *
+markdown_stream_close_tags(MarkdownStream *stream)
+{
+	GString *out = g_string_new("");
+
+	/* Innermost last in markdown_stream_reopen_tags(), so first here */
+	if (stream->s_spoiler)
+		out = g_string_append(out, MARKDOWN_SPOILER_CLOSE);
+	if (stream->s_codebit)
+		out = g_string_append(out, MARKDOWN_CODE_CLOSE);
+	if (stream->s_codeblock)
+		out = g_string_append(out, MARKDOWN_PRE_CLOSE);
+	if (stream->s_strikethrough)
+		out = g_string_append(out, "</s>");
+	if (stream->s_underline)
+		out = g_string_append(out, "</u>");
+	if (stream->s_italics)
+		out = g_string_append(out, "</i>");
+	if (stream->s_bold)
+		out = g_string_append(out, "</b>");
+
+	return g_string_free(out, FALSE);
+}
+
+gchar *
+markdown_stream_reopen_tags(MarkdownStream *stream)
+{
+	GString *out = g_string_new("");
+
+	if (stream->s_bold)
+		out = g_string_append(out, "<b>");
+	if (stream->s_italics)
+		out = g_string_append(out, "<i>");
+	if (stream->s_underline)
+		out = g_string_append(out, "<u>");
+	if (stream->s_strikethrough)
+		out = g_string_append(out, "<s>");
+	if (stream->s_codeblock)
+		out = g_string_append(out, MARKDOWN_PRE_OPEN);
+	if (stream->s_codebit)
+		out = g_string_append(out, MARKDOWN_CODE_OPEN);
+	if (stream->s_spoiler)
+		out = g_string_append(out, MARKDOWN_SPOILER_OPEN);
+
 	return g_string_free(out, FALSE);
 }
 
+static gchar *
+markdown_helper_replace(gchar *html, const gchar *tag, const gchar *replacement)
+{
+	gchar *replace_regex;
+	gchar *replace_with;
+
+	if (tag[0] == '<' && tag[1] == '/') {
+		//closing tag
+		replace_regex = g_strconcat("(\\s*)", tag, NULL);
+		replace_with = g_strconcat(replacement, "\\1", NULL);
+	} else {
+		replace_regex = g_strconcat(tag, "(\\s*)", NULL);
+		replace_with = g_strconcat("\\1", replacement, NULL);
+	}
+
+	GRegex *markdown_replace = g_regex_new(replace_regex, 0, 0, NULL);
+	gchar *temp = g_regex_replace(markdown_replace, html, -1, 0, replace_with, 0, NULL);
+
+	g_free(replace_regex);
+	g_free(replace_with);
+	g_regex_unref(markdown_replace);
+
+	if (temp != NULL) {
+		g_free(html);
+		html = temp;
+	}
+
+	return html;
+}
+
+gchar *
+markdown_convert_markdown(const gchar *html, gboolean escape_html, gboolean discord_hacks)
+{
+	g_return_val_if_fail(html != NULL, NULL);
+
+	MarkdownStream *stream = markdown_stream_new(escape_html, discord_hacks);
+	gchar *out;
+
+	/* A whole document is just a stream that ends straight away */
+	g_string_free(stream->out, TRUE);
+	stream->out = g_string_sized_new(strlen(html) * 2);
+	stream->in = g_string_append(stream->in, html);
+	markdown_stream_finish_input(stream);
+
+	out = markdown_stream_take_output(stream);
+	markdown_stream_free(stream);
+
+	return out;
+}
+
 #define REPLACE_TAG(name, repl) \
 	html = markdown_helper_replace(html, "<" name ">", repl); \
 	html = markdown_helper_replace(html, "</" name ">", repl);
@@ -26,4 +26,21 @@ gchar *markdown_convert_markdown(const gchar *html, gboolean escape_html, gboole
 gchar *markdown_escape_md(const gchar *markdown, gboolean markdown_hacks);
 gchar *markdown_html_to_markdown(gchar *html);
 
+/* Resumable conversion, for markdown that arrives in pieces.  Each call
+ * returns the HTML for the input that can no longer change; anything still
+ * ambiguous (e.g. a lone '*' or an unclosed link) is held back until the
+ * text that settles it arrives, or until markdown_stream_finish().
+ * Concatenated, the pieces equal markdown_convert_markdown() of the whole. */
+typedef struct _MarkdownStream MarkdownStream;
+
+MarkdownStream *markdown_stream_new(gboolean escape_html, gboolean markdown_hacks);
+void markdown_stream_free(MarkdownStream *stream);
+gchar *markdown_stream_append(MarkdownStream *stream, const gchar *markdown, gssize len);
+gchar *markdown_stream_finish(MarkdownStream *stream);
+
+/* Tags that close the formatting open at this point, and that open it again,
+ * so that the output can be split into separately shown messages */
+gchar *markdown_stream_close_tags(MarkdownStream *stream);
+gchar *markdown_stream_reopen_tags(MarkdownStream *stream);
+
 #endif
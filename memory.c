@@ -0,0 +1,518 @@
+/*
+ * pidgin-aichat
+ *
+ * Copyright (C) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <glib/gstdio.h>
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+#include "memory.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define AICHAT_MEMORY_MAGIC "AIMEMO\r\x01"
+#define AICHAT_MEMORY_MAGIC_LEN 8
+#define AICHAT_MEMORY_HEADER_LEN (AICHAT_MEMORY_MAGIC_LEN + 4)
+
+/* Vectors are padded with zeros to a multiple of this many floats, so the
+ * scan needn't handle a remainder */
+#define AICHAT_MEMORY_LANES 8
+
+struct _AiChatMemory {
+	gchar *filename;
+	int fd;
+	guint dimensions;    /* 0 until the first snippet */
+	guint stride;        /* dimensions, padded to AICHAT_MEMORY_LANES */
+	guint size;
+	guint max_size;      /* Most snippets kept, or 0 for no limit */
+	guint allocated;     /* Rows the vectors have room for */
+	gfloat *vectors;     /* size rows of stride floats, each of length 1 */
+	GString *texts;      /* Snippet texts, each followed by a NUL */
+	GArray *offsets;     /* Start of each snippet in texts */
+	GByteArray *record;  /* Reused to write each record in one go */
+};
+
+#if defined(__GNUC__)
+/* Four floats at a time, at any float's alignment.  GCC and Clang turn
+ * this into SSE or NEON where there is some, and plain code elsewhere. */
+typedef gfloat AiChatMemoryVec __attribute__((vector_size(16), aligned(4), may_alias));
+
+static gfloat
+aichat_memory_dot(const gfloat *a, const gfloat *b, guint n)
+{
+	AiChatMemoryVec sum0 = { 0, 0, 0, 0 };
+	AiChatMemoryVec sum1 = { 0, 0, 0, 0 };
+	guint i;
+
+	for (i = 0; i < n; i += AICHAT_MEMORY_LANES) {
+		sum0 += *(const AiChatMemoryVec *) (a + i) * *(const AiChatMemoryVec *) (b + i);
+		sum1 += *(const AiChatMemoryVec *) (a + i + 4) * *(const AiChatMemoryVec *) (b + i + 4);
+	}
+	sum0 += sum1;
+
+	return sum0[0] + sum0[1] + sum0[2] + sum0[3];
+}
+#else
+static gfloat
+aichat_memory_dot(const gfloat *a, const gfloat *b, guint n)
+{
+	gfloat sum[AICHAT_MEMORY_LANES] = { 0 };
+	guint i, j;
+
+	/* Independent sums, which compilers can keep in one vector register */
+	for (i = 0; i < n; i += AICHAT_MEMORY_LANES) {
+		for (j = 0; j < AICHAT_MEMORY_LANES; j++) {
+			sum[j] += a[i + j] * b[i + j];
+		}
+	}
+
+	return (sum[0] + sum[4]) + (sum[1] + sum[5]) + (sum[2] + sum[6]) + (sum[3] + sum[7]);
+}
+#endif
+
+static guint32
+aichat_memory_read_uint32(const guint8 *data)
+{
+	return data[0] | (data[1] << 8) | (data[2] << 16) | ((guint32) data[3] << 24);
+}
+
+static void
+aichat_memory_add_uint32(GByteArray *buffer, guint32 value)
+{
+	guint8 bytes[4];
+
+	bytes[0] = value & 0xff;
+	bytes[1] = (value >> 8) & 0xff;
+	bytes[2] = (value >> 16) & 0xff;
+	bytes[3] = (value >> 24) & 0xff;
+
+	g_byte_array_append(buffer, bytes, sizeof(bytes));
+}
+
+/* Append the record of a snippet to @buffer */
+static void
+aichat_memory_add_record(GByteArray *buffer, const gfloat *vector, guint dimensions, const gchar *text, gsize len)
+{
+	guint32 bits;
+	guint i;
+
+	aichat_memory_add_uint32(buffer, len);
+	for (i = 0; i < dimensions; i++) {
+		memcpy(&bits, &vector[i], 4);
+		aichat_memory_add_uint32(buffer, bits);
+	}
+	g_byte_array_append(buffer, (const guint8 *) text, len);
+}
+
+/* Copy @vector into the next row, scaled to length 1 */
+static void
+aichat_memory_push_vector(AiChatMemory *memory, const gfloat *vector)
+{
+	gfloat *row;
+	gdouble norm = 0;
+	guint i;
+
+	if (memory->size == memory->allocated) {
+		memory->allocated = MAX(memory->allocated * 2, 64);
+		memory->vectors = g_renew(gfloat, memory->vectors, (gsize) memory->allocated * memory->stride);
+	}
+	row = memory->vectors + (gsize) memory->size * memory->stride;
+
+	for (i = 0; i < memory->dimensions; i++) {
+		norm += (gdouble) vector[i] * vector[i];
+	}
+	norm = norm > 0 ? 1 / sqrt(norm) : 0;
+	for (i = 0; i < memory->dimensions; i++) {
+		row[i] = vector[i] * norm;
+	}
+	for (; i < memory->stride; i++) {
+		row[i] = 0;
+	}
+}
+
+static void
+aichat_memory_push_text(AiChatMemory *memory, const gchar *text, gsize len)
+{
+	gsize offset = memory->texts->len;
+
+	g_array_append_val(memory->offsets, offset);
+	g_string_append_len(memory->texts, text, len);
+	g_string_append_c(memory->texts, '\0');
+	memory->size++;
+}
+
+static void
+aichat_memory_reset(AiChatMemory *memory, guint dimensions)
+{
+	memory->dimensions = dimensions;
+	memory->stride = (dimensions + AICHAT_MEMORY_LANES - 1) / AICHAT_MEMORY_LANES * AICHAT_MEMORY_LANES;
+	memory->size = 0;
+	memory->allocated = 0;
+	g_free(memory->vectors);
+	memory->vectors = NULL;
+	g_string_truncate(memory->texts, 0);
+	g_array_set_size(memory->offsets, 0);
+}
+
+/* Read the snippets in @data, returning the length of the part made of
+ * whole records */
+static gsize
+aichat_memory_restore(AiChatMemory *memory, const guint8 *data, gsize len)
+{
+	gfloat *vector;
+	gsize pos = AICHAT_MEMORY_HEADER_LEN;
+	gsize vector_len;
+	guint i;
+
+	aichat_memory_reset(memory, aichat_memory_read_uint32(data + AICHAT_MEMORY_MAGIC_LEN));
+	vector_len = (gsize) memory->dimensions * 4;
+	vector = g_new(gfloat, MAX(memory->dimensions, 1));
+
+	while (len - pos >= 4 + vector_len) {
+		guint32 text_len = aichat_memory_read_uint32(data + pos);
+		const guint8 *floats = data + pos + 4;
+
+		if (text_len > len - pos - 4 - vector_len) {
+			break;
+		}
+		for (i = 0; i < memory->dimensions; i++) {
+			guint32 bits = aichat_memory_read_uint32(floats + i * 4);
+
+			memcpy(&vector[i], &bits, 4);
+		}
+		aichat_memory_push_vector(memory, vector);
+		aichat_memory_push_text(memory, (const gchar *) floats + vector_len, text_len);
+		pos += 4 + vector_len + text_len;
+	}
+	g_free(vector);
+
+	return pos;
+}
+
+static gboolean
+aichat_memory_write(AiChatMemory *memory, const guint8 *data, gsize len, GError **error)
+{
+	while (len > 0) {
+		gssize written = write(memory->fd, data, len);
+
+		if (written < 0) {
+			int saved_errno = errno;
+
+			if (saved_errno == EINTR) {
+				continue;
+			}
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+				"Couldn't write to %s: %s", memory->filename, g_strerror(saved_errno));
+			return FALSE;
+		}
+		data += written;
+		len -= written;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+aichat_memory_open_fd(AiChatMemory *memory, GError **error)
+{
+	memory->fd = g_open(memory->filename, O_WRONLY | O_APPEND | O_CREAT | O_BINARY, 0600);
+	if (memory->fd < 0) {
+		int saved_errno = errno;
+
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(saved_errno),
+			"Couldn't open %s: %s", memory->filename, g_strerror(saved_errno));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Replace the file with @len bytes of @data, and reopen it for appending */
+static gboolean
+aichat_memory_replace(AiChatMemory *memory, const guint8 *data, gsize len, GError **error)
+{
+	/* Closed first, as Windows won't replace a file that's open */
+	if (memory->fd >= 0) {
+		close(memory->fd);
+		memory->fd = -1;
+	}
+
+	return g_file_set_contents(memory->filename, (const gchar *) data, len, error) &&
+		aichat_memory_open_fd(memory, error);
+}
+
+/* Drop all but the newest @keep snippets, from the file as well.  The
+ * vectors written are the normalised ones, which search the same. */
+static gboolean
+aichat_memory_compact(AiChatMemory *memory, guint keep, GError **error)
+{
+	guint drop = memory->size - keep;
+	gsize text_start = g_array_index(memory->offsets, gsize, drop);
+	GByteArray *file;
+	gboolean written;
+	guint i;
+
+	file = g_byte_array_sized_new(AICHAT_MEMORY_HEADER_LEN + (gsize) keep * (4 + memory->dimensions * 4) +
+		memory->texts->len - text_start);
+	g_byte_array_append(file, (const guint8 *) AICHAT_MEMORY_MAGIC, AICHAT_MEMORY_MAGIC_LEN);
+	aichat_memory_add_uint32(file, memory->dimensions);
+	for (i = drop; i < memory->size; i++) {
+		gsize offset = g_array_index(memory->offsets, gsize, i);
+		gsize end = i + 1 < memory->size ? g_array_index(memory->offsets, gsize, i + 1) : memory->texts->len;
+
+		aichat_memory_add_record(file, memory->vectors + (gsize) i * memory->stride, memory->dimensions,
+			memory->texts->str + offset, end - offset - 1);
+	}
+	written = aichat_memory_replace(memory, file->data, file->len, error);
+	g_byte_array_free(file, TRUE);
+	if (!written) {
+		return FALSE;
+	}
+
+	memmove(memory->vectors, memory->vectors + (gsize) drop * memory->stride, (gsize) keep * memory->stride * sizeof(gfloat));
+	g_string_erase(memory->texts, 0, text_start);
+	g_array_remove_range(memory->offsets, 0, drop);
+	for (i = 0; i < keep; i++) {
+		g_array_index(memory->offsets, gsize, i) -= text_start;
+	}
+	memory->size = keep;
+
+	return TRUE;
+}
+
+/* Start the file over, for vectors of @dimensions */
+static gboolean
+aichat_memory_clear(AiChatMemory *memory, guint dimensions, GError **error)
+{
+	GByteArray *header = g_byte_array_sized_new(AICHAT_MEMORY_HEADER_LEN);
+	gboolean written;
+
+	g_byte_array_append(header, (const guint8 *) AICHAT_MEMORY_MAGIC, AICHAT_MEMORY_MAGIC_LEN);
+	aichat_memory_add_uint32(header, dimensions);
+	written = aichat_memory_replace(memory, header->data, header->len, error);
+	g_byte_array_free(header, TRUE);
+
+	aichat_memory_reset(memory, dimensions);
+
+	return written;
+}
+
+AiChatMemory *
+aichat_memory_open(const gchar *filename, guint max_size, GError **error)
+{
+	AiChatMemory *memory;
+	GMappedFile *mapped;
+	GError *local_error = NULL;
+	gboolean opened;
+	gchar *dirname;
+
+	dirname = g_path_get_dirname(filename);
+	g_mkdir_with_parents(dirname, 0700);
+	g_free(dirname);
+
+	memory = g_new0(AiChatMemory, 1);
+	memory->filename = g_strdup(filename);
+	memory->fd = -1;
+	memory->max_size = max_size;
+	memory->texts = g_string_new(NULL);
+	memory->offsets = g_array_new(FALSE, FALSE, sizeof(gsize));
+	memory->record = g_byte_array_new();
+
+	mapped = g_mapped_file_new(filename, FALSE, &local_error);
+	if (mapped == NULL && !g_error_matches(local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+		g_propagate_error(error, local_error);
+		aichat_memory_close(memory);
+		return NULL;
+	}
+	g_clear_error(&local_error);
+
+	if (mapped == NULL || g_mapped_file_get_length(mapped) == 0) {
+		/* New file; the dimensions are set by the first snippet */
+		opened = aichat_memory_clear(memory, 0, error);
+	} else {
+		const guint8 *data = (const guint8 *) g_mapped_file_get_contents(mapped);
+		gsize len = g_mapped_file_get_length(mapped);
+		gsize valid;
+
+		if (len < AICHAT_MEMORY_HEADER_LEN || memcmp(data, AICHAT_MEMORY_MAGIC, AICHAT_MEMORY_MAGIC_LEN) != 0) {
+			g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s isn't a memory file", filename);
+			g_mapped_file_unref(mapped);
+			aichat_memory_close(memory);
+			return NULL;
+		}
+
+		valid = aichat_memory_restore(memory, data, len);
+		if (valid < len) {
+			/* Cut off the half-written snippet at the end, so new ones line up */
+			opened = aichat_memory_replace(memory, data, valid, error);
+		} else {
+			opened = aichat_memory_open_fd(memory, error);
+		}
+	}
+	if (mapped != NULL) {
+		g_mapped_file_unref(mapped);
+	}
+	if (opened && max_size > 0 && memory->size > max_size) {
+		opened = aichat_memory_compact(memory, max_size - max_size / 4, error);
+	}
+
+	if (!opened) {
+		aichat_memory_close(memory);
+		return NULL;
+	}
+
+	return memory;
+}
+
+void
+aichat_memory_close(AiChatMemory *memory)
+{
+	if (memory == NULL) {
+		return;
+	}
+
+	/* Not synced: losing the newest snippet or two in a crash only means
+	 * they can't be recalled */
+	if (memory->fd >= 0) {
+		close(memory->fd);
+	}
+	g_free(memory->vectors);
+	g_string_free(memory->texts, TRUE);
+	g_array_free(memory->offsets, TRUE);
+	g_byte_array_free(memory->record, TRUE);
+	g_free(memory->filename);
+	g_free(memory);
+}
+
+guint
+aichat_memory_get_size(const AiChatMemory *memory)
+{
+	g_return_val_if_fail(memory != NULL, 0);
+
+	return memory->size;
+}
+
+gboolean
+aichat_memory_add(AiChatMemory *memory, const gfloat *vector, guint dimensions,
+	const gchar *text, gssize len, GError **error)
+{
+	g_return_val_if_fail(memory != NULL, FALSE);
+	g_return_val_if_fail(dimensions > 0, FALSE);
+
+	if (memory->dimensions == 0) {
+		if (!aichat_memory_clear(memory, dimensions, error)) {
+			return FALSE;
+		}
+	} else if (dimensions != memory->dimensions) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL, "%s holds vectors of %u dimensions, not %u",
+			memory->filename, memory->dimensions, dimensions);
+		return FALSE;
+	}
+
+	/* A quarter at a time, so the file isn't rewritten for every snippet */
+	if (memory->max_size > 0 && memory->size >= memory->max_size) {
+		if (!aichat_memory_compact(memory, memory->max_size - memory->max_size / 4, error)) {
+			return FALSE;
+		}
+	} else if (memory->fd < 0 && !aichat_memory_open_fd(memory, error)) {
+		return FALSE;
+	}
+	if (len < 0) {
+		len = strlen(text);
+	}
+
+	g_byte_array_set_size(memory->record, 0);
+	aichat_memory_add_record(memory->record, vector, dimensions, text, len);
+	if (!aichat_memory_write(memory, memory->record->data, memory->record->len, error)) {
+		return FALSE;
+	}
+
+	aichat_memory_push_vector(memory, vector);
+	aichat_memory_push_text(memory, text, len);
+
+	return TRUE;
+}
+
+guint
+aichat_memory_search(const AiChatMemory *memory, const gfloat *query, guint dimensions, guint limit,
+	AiChatMemoryMatch *matches, guint k)
+{
+	gfloat *padded;
+	gdouble norm = 0;
+	guint found = 0;
+	guint i, j;
+
+	g_return_val_if_fail(memory != NULL, 0);
+
+	if (dimensions != memory->dimensions || k == 0) {
+		return 0;
+	}
+	limit = MIN(limit, memory->size);
+
+	/* The rows have length 1, so scaling the query makes their dot
+	 * products cosines */
+	for (i = 0; i < dimensions; i++) {
+		norm += (gdouble) query[i] * query[i];
+	}
+	if (norm <= 0) {
+		return 0;
+	}
+	norm = 1 / sqrt(norm);
+	padded = g_new0(gfloat, memory->stride);
+	for (i = 0; i < dimensions; i++) {
+		padded[i] = query[i] * norm;
+	}
+
+	for (i = 0; i < limit; i++) {
+		gfloat score = aichat_memory_dot(padded, memory->vectors + (gsize) i * memory->stride, memory->stride);
+
+		if (found == k && score <= matches[k - 1].score) {
+			continue;
+		}
+
+		/* Kept sorted, best first; k is small */
+		j = found < k ? found++ : k - 1;
+		while (j > 0 && matches[j - 1].score < score) {
+			matches[j] = matches[j - 1];
+			j--;
+		}
+		matches[j].index = i;
+		matches[j].score = score;
+	}
+	g_free(padded);
+
+	return found;
+}
+
+const gchar *
+aichat_memory_get_text(const AiChatMemory *memory, guint index)
+{
+	g_return_val_if_fail(memory != NULL, NULL);
+	g_return_val_if_fail(index < memory->size, NULL);
+
+	return memory->texts->str + g_array_index(memory->offsets, gsize, index);
+}
@@ -0,0 +1,74 @@
+/*
+ * pidgin-aichat
+ *
+ * Copyright (C) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#ifndef _MEMORY_H_
+#define _MEMORY_H_
+
+#include <glib.h>
+
+/* Long-term memory for a bot: snippets of its conversation, each with the
+ * embedding vector it was found by, kept on disk.
+ *
+ * The file is a short magic number and the number of dimensions as 4
+ * little-endian bytes, then one record per snippet: the length of its text
+ * as 4 little-endian bytes, the vector as that many little-endian floats,
+ * then the text.  Records are appended, and the file is only rewritten to
+ * drop the oldest snippets once it holds as many as it's allowed; a
+ * snippet that was only partly written when the program stopped is
+ * dropped the next time the file is opened.
+ *
+ * In memory the vectors are normalised and laid out back to back in one
+ * block, so finding the snippets nearest to a query is one pass of dot
+ * products over it.  Vectors from different models can't be compared, so
+ * each file holds those of one model. */
+
+typedef struct _AiChatMemory AiChatMemory;
+
+typedef struct {
+	guint index;   /* Snippet number, in the order they were added */
+	gfloat score;  /* Cosine similarity to the query */
+} AiChatMemoryMatch;
+
+/* Open the memory in @filename, creating it (and its directory) if needed,
+ * keeping at most @max_size snippets (0 for no limit).  Returns NULL and
+ * sets @error if the file can't be read, written, or isn't a memory file. */
+AiChatMemory *aichat_memory_open(const gchar *filename, guint max_size, GError **error);
+
+/* Close the memory */
+void aichat_memory_close(AiChatMemory *memory);
+
+/* Get the number of snippets */
+guint aichat_memory_get_size(const AiChatMemory *memory);
+
+/* Add a snippet found by @vector, dropping the oldest quarter first if the
+ * memory is full.  Fails if @vector has a different number of dimensions
+ * than those already there. */
+gboolean aichat_memory_add(AiChatMemory *memory, const gfloat *vector, guint dimensions,
+	const gchar *text, gssize len, GError **error);
+
+/* Find the (up to) @k snippets among the first @limit that are nearest to
+ * @query, best first, returning how many were found */
+guint aichat_memory_search(const AiChatMemory *memory, const gfloat *query, guint dimensions, guint limit,
+	AiChatMemoryMatch *matches, guint k);
+
+/* Get the text of snippet @index, NUL-terminated */
+const gchar *aichat_memory_get_text(const AiChatMemory *memory, guint index);
+
+#endif /* _MEMORY_H_ */
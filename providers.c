@@ -22,6 +22,7 @@
 #include <string.h>
 #include "providers.h"
 #include "provider_registry.h"
+#include "libaichat.h"
 
 /* Provider type to name mapping */
 const char *provider_type_names[] = {
@@ -98,6 +99,67 @@ llm_providers_uninit(void)
     llm_provider_registry_uninit();
 }
 
+void
+llm_write_history(AiChatJsonWriter *writer, AiChatHistory *history, guint end, LLMTurnWriter write_turn)
+{
+    llm_write_history_range(writer, history, 0, end, write_turn);
+}
+
+gboolean
+llm_history_turn_is_sent(AiChatHistory *history, guint i)
+{
+    guint pinned, start;
+    
+    aichat_history_get_window(history, &pinned, &start);
+    
+    return i < aichat_history_get_length(history) && (i < pinned || i >= start);
+}
+
+void
+llm_write_history_range(AiChatJsonWriter *writer, AiChatHistory *history, guint begin, guint end,
+                        LLMTurnWriter write_turn)
+{
+    AiChatHistoryEntry *entries = aichat_history_get_entries(history);
+    guint len = aichat_history_get_length(history);
+    const gchar *recall = aichat_history_get_recall(history);
+    guint pinned, start;
+    guint i;
+    
+    aichat_history_get_window(history, &pinned, &start);
+    
+    for (i = begin; i < end; i++) {
+        AiChatHistoryEntry *entry = &entries[i];
+        
+        /* Left out to fit the context window */
+        if (i >= pinned && i < start) {
+            i = start - 1;
+            continue;
+        }
+        
+        /* Only this request has it, so it isn't kept in the turn's JSON */
+        if (i == len - 1 && recall != NULL) {
+            gchar *content = g_strconcat(recall, entry->content, NULL);
+            
+            write_turn(writer, entry->role, content);
+            g_free(content);
+            continue;
+        }
+        
+        /* Switching providers mid-conversation means writing it out again */
+        if (entry->wire == NULL || entry->wire_writer != write_turn) {
+            AiChatJsonWriter *turn = aichat_json_writer_new(entry->content_len + 32);
+            
+            write_turn(turn, entry->role, entry->content);
+            aichat_json_chunk_unref(entry->wire);
+            entry->wire = aichat_json_writer_free_to_chunk(turn);
+            entry->wire_writer = write_turn;
+        }
+        
+        /* Shared with the request rather than copied into it */
+        aichat_json_writer_chunk(writer, entry->wire);
+    }
+}
+
 /* Get a provider by type */
 LLMProvider*
 llm_provider_get(LLMProviderType type)
@@ -23,6 +23,9 @@
 
 #include <glib.h>
 #include <json-glib/json-glib.h>
+#include "history.h"
+#include "jsonpull.h"
+#include "jsonwriter.h"
 
 /* Forward declarations */
 typedef struct _AiChatAccount AiChatAccount;
@@ -57,6 +60,23 @@ typedef enum {
     API_FORMAT_CUSTOM       /* Custom format requiring full adapter */
 } LLMApiFormat;
 
+/* Framing of streamed responses */
+typedef enum {
+    LLM_STREAM_SSE,         /* text/event-stream (the default) */
+    LLM_STREAM_NDJSON       /* One JSON object per line */
+} LLMStreamFormat;
+
+/* Per-reply state of a streamed response, updated by parse_stream_event */
+typedef struct _LLMStreamState {
+    GString *delta;             /* Reply text carried by the current event */
+    gboolean done;              /* Set once the provider signals the end of the reply */
+    gint64 input_tokens;        /* Prompt tokens, if the provider reports usage (else 0) */
+    gint64 cache_read_tokens;   /* Of those, read from the provider's prompt cache */
+    gint64 cache_write_tokens;  /* Of those, written to the provider's prompt cache */
+    gint64 output_tokens;       /* Completion tokens, if the provider reports usage (else 0) */
+    JsonParser *parser;         /* Reused for every event of the reply (may be NULL) */
+} LLMStreamState;
+
 /* Provider configuration structure */
 typedef struct _LLMProvider {
     /* Basic provider information */
@@ -67,24 +87,45 @@ typedef struct _LLMProvider {
     
     /* Provider characteristics */
     const char **models;        /* NULL-terminated array of supported models */
+    const char *small_model;    /* Cheaper model for background work (NULL = the bot's own) */
+    const char *embedding_model;      /* Model for embeddings_endpoint (NULL = none) */
+    const char *embeddings_endpoint;  /* Embeddings endpoint path, taking {"model", "input"} */
     gboolean needs_api_key;     /* Whether API key is required */
     gboolean is_local;          /* Whether this is a local provider (e.g., Ollama) */
     LLMApiFormat api_format;    /* API format type for easier handling */
     
     /* Provider capabilities */
     gboolean supports_streaming;    /* Whether provider supports streaming responses */
+    LLMStreamFormat stream_format;  /* How streamed responses are framed */
     gboolean supports_vision;       /* Whether provider supports image inputs */
     gboolean supports_functions;    /* Whether provider supports function calling */
     gint max_context_length;        /* Maximum context window size (0 = unknown) */
     
     /* Function pointers for provider-specific implementations */
     
-    /* Format a chat request for this provider */
-    JsonObject* (*format_request)(AiChatBuddy *buddy, const char *message);
+    /* Write the request body for the conversation in buddy->history, whose
+     * last entry is the message being sent, asking for a streamed reply if
+     * @stream is set */
+    AiChatJsonBody* (*format_request)(AiChatBuddy *buddy, gboolean stream);
     
     /* Parse a response from this provider */
     char* (*parse_response)(JsonObject *response, GError **error);
     
+    /* Parse a complete response straight from its body, without building a
+     * tree: append the reply text to state->delta and read the token counts
+     * into @state.  Used in place of validate_response, parse_response and
+     * parse_usage when set. */
+    gboolean (*parse_response_raw)(const char *data, gsize len, LLMStreamState *state, GError **error);
+    
+    /* Parse one event of a streamed response, appending any new text to state->delta
+     * (NULL if streaming isn't implemented for this provider) */
+    gboolean (*parse_stream_event)(const char *event, const char *data, gsize data_len,
+                                   LLMStreamState *state, GError **error);
+    
+    /* Read the token counts of a complete response into @state
+     * (NULL if the provider doesn't report usage) */
+    void (*parse_usage)(JsonObject *response, LLMStreamState *state);
+    
     /* Get the authentication header for this provider */
     const char* (*get_auth_header)(AiChatAccount *account);
     
@@ -94,6 +135,12 @@ typedef struct _LLMProvider {
     /* Get the full URL for a chat request */
     char* (*get_chat_url)(struct _LLMProvider *provider, AiChatBuddy *buddy);
     
+    /* Get the full URL for a streamed chat request (NULL if it's the same as get_chat_url) */
+    char* (*get_stream_url)(struct _LLMProvider *provider, AiChatBuddy *buddy);
+    
+    /* Get the full URL for an embeddings request (NULL for endpoint_url + embeddings_endpoint) */
+    char* (*get_embeddings_url)(struct _LLMProvider *provider, AiChatAccount *account);
+    
     /* Get additional headers if needed */
     GHashTable* (*get_additional_headers)(AiChatAccount *account, AiChatBuddy *buddy);
     
@@ -139,6 +186,27 @@ void llm_providers_init(void);
 /* Cleanup the provider system */
 void llm_providers_uninit(void);
 
+/* Write the first @end turns of @history that are in its window as array
+ * elements.  Each turn keeps the JSON @write_turn produced for it, so a
+ * request only serializes the turns that are new since the previous one. */
+void llm_write_history(AiChatJsonWriter *writer, AiChatHistory *history, guint end, LLMTurnWriter write_turn);
+
+/* The same for the turns from @begin up to @end, so a provider can write
+ * some turns in between differently */
+void llm_write_history_range(AiChatJsonWriter *writer, AiChatHistory *history, guint begin, guint end,
+                             LLMTurnWriter write_turn);
+
+/* Whether turn @i of @history is in its window, and so part of requests */
+gboolean llm_history_turn_is_sent(AiChatHistory *history, guint i);
+
+/* Shared OpenAI-compatible implementation (providers/openai_compat.c) */
+gboolean openai_compat_validate_response(JsonObject *response, GError **error);
+gboolean openai_compat_parse_stream_event(const char *event, const char *data, gsize data_len,
+                                          LLMStreamState *state, GError **error);
+void openai_compat_parse_usage(JsonObject *response, LLMStreamState *state);
+gboolean openai_compat_parse_response_raw(const char *data, gsize len, LLMStreamState *state, GError **error);
+void openai_compat_write_turn(AiChatJsonWriter *writer, AiChatRole role, const char *content);
+
 /* Provider type names array */
 extern const char *provider_type_names[];
 
@@ -18,6 +18,7 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
  */
 
+#include <string.h>
 #include <glib.h>
 #include <json-glib/json-glib.h>
 #include "../providers.h"
@@ -34,44 +35,99 @@ static const char *anthropic_models[] = {
     NULL
 };
 
-/* Format a chat request for Anthropic Messages API */
-static JsonObject*
-anthropic_format_request(AiChatBuddy *buddy, const char *message)
+/* Write one turn of the conversation as a message.  The Messages API only
+ * takes system text at the top, so system turns in the history (such as
+ * summaries of older turns) go in as user turns, which the API merges
+ * with any user turn next to them */
+static void
+anthropic_write_turn(AiChatJsonWriter *writer, AiChatRole role, const char *content)
 {
-    JsonObject *request;
-    JsonArray *messages;
-    JsonObject *msg;
-    GList *history;
+    openai_compat_write_turn(writer, role == AICHAT_ROLE_SYSTEM ? AICHAT_ROLE_USER : role, content);
+}
+
+/* Write a text content block that ends a cached prefix */
+static void
+anthropic_write_cached_text(AiChatJsonWriter *writer, const char *text)
+{
+    aichat_json_writer_begin_object(writer);
+    aichat_json_writer_string_member(writer, "type", "text");
+    aichat_json_writer_string_member(writer, "text", text);
+    aichat_json_writer_member(writer, "cache_control");
+    aichat_json_writer_begin_object(writer);
+    aichat_json_writer_string_member(writer, "type", "ephemeral");
+    aichat_json_writer_end_object(writer);
+    aichat_json_writer_end_object(writer);
+}
+
+/* Write one turn as a message that ends a cached prefix.  These aren't
+ * kept with the history, as the breakpoints move on with every request */
+static void
+anthropic_write_cached_turn(AiChatJsonWriter *writer, AiChatRole role, const char *content)
+{
+    aichat_json_writer_begin_object(writer);
+    aichat_json_writer_string_member(writer, "role", aichat_role_to_string(role == AICHAT_ROLE_SYSTEM ? AICHAT_ROLE_USER : role));
+    aichat_json_writer_member(writer, "content");
+    aichat_json_writer_begin_array(writer);
+    anthropic_write_cached_text(writer, content);
+    aichat_json_writer_end_array(writer);
+    aichat_json_writer_end_object(writer);
+}
+
+/* Format a chat request for Anthropic Messages API.
+ *
+ * The prompt is cached up to three breakpoints, of the four allowed: the
+ * system prompt; the last turn before the message being sent, which the
+ * next request reads back; and the turn where the previous request put
+ * its breakpoint, which this request reads back. */
+static AiChatJsonBody*
+anthropic_format_request(AiChatBuddy *buddy, gboolean stream)
+{
+    AiChatJsonWriter *writer = aichat_json_writer_new(4096);
+    AiChatHistoryEntry *entries = aichat_history_get_entries(buddy->history);
+    guint len = aichat_history_get_length(buddy->history);
+    guint breakpoints[2];
+    guint n_breakpoints = 0;
+    guint i, next;
     
-    request = json_object_new();
-    messages = json_array_new();
+    /* Build request according to Anthropic Messages API format */
+    aichat_json_writer_begin_object(writer);
+    aichat_json_writer_string_member(writer, "model", buddy->model ? buddy->model : "claude-3-5-sonnet-20241022");
+    aichat_json_writer_int_member(writer, "max_tokens", 4096);
     
-    /* Add conversation history */
-    for (history = buddy->history; history != NULL; history = history->next) {
-        AiChatHistory *hist = (AiChatHistory *)history->data;
-        msg = json_object_new();
-        json_object_set_string_member(msg, "role", hist->role);
-        json_object_set_string_member(msg, "content", hist->content);
-        json_array_add_object_element(messages, msg);
+    /* Add system message if configured */
+    if (buddy->instructions && *buddy->instructions) {
+        aichat_json_writer_member(writer, "system");
+        aichat_json_writer_begin_array(writer);
+        anthropic_write_cached_text(writer, buddy->instructions);
+        aichat_json_writer_end_array(writer);
     }
     
-    /* Add current message */
-    msg = json_object_new();
-    json_object_set_string_member(msg, "role", "user");
-    json_object_set_string_member(msg, "content", message);
-    json_array_add_object_element(messages, msg);
+    /* A turn left out of the window changes the prefix anyway */
+    if (len >= 4 && llm_history_turn_is_sent(buddy->history, len - 4)) {
+        breakpoints[n_breakpoints++] = len - 4;
+    }
+    if (len >= 2 && llm_history_turn_is_sent(buddy->history, len - 2)) {
+        breakpoints[n_breakpoints++] = len - 2;
+    }
     
-    /* Build request according to Anthropic Messages API format */
-    json_object_set_string_member(request, "model", buddy->model ? buddy->model : "claude-3-5-sonnet-20241022");
-    json_object_set_int_member(request, "max_tokens", 4096);
-    json_object_set_array_member(request, "messages", messages);
+    /* Add conversation history, which ends with the message being sent */
+    aichat_json_writer_member(writer, "messages");
+    aichat_json_writer_begin_array(writer);
+    next = 0;
+    for (i = 0; i < n_breakpoints; i++) {
+        llm_write_history_range(writer, buddy->history, next, breakpoints[i], anthropic_write_turn);
+        anthropic_write_cached_turn(writer, entries[breakpoints[i]].role, entries[breakpoints[i]].content);
+        next = breakpoints[i] + 1;
+    }
+    llm_write_history_range(writer, buddy->history, next, len, anthropic_write_turn);
+    aichat_json_writer_end_array(writer);
     
-    /* Add system message if configured */
-    if (buddy->instructions && *buddy->instructions) {
-        json_object_set_string_member(request, "system", buddy->instructions);
+    if (stream) {
+        aichat_json_writer_boolean_member(writer, "stream", TRUE);
     }
+    aichat_json_writer_end_object(writer);
     
-    return request;
+    return aichat_json_writer_free_to_body(writer);
 }
 
 /* Parse a response from Anthropic */
@@ -154,6 +210,238 @@ anthropic_validate_response(JsonObject *response, GError **error)
     return TRUE;
 }
 
+/* Read token counts from a usage block */
+static void
+anthropic_parse_usage_block(JsonObject *usage, LLMStreamState *state)
+{
+    if (usage == NULL) {
+        return;
+    }
+    /* input_tokens only counts what's after the last cache breakpoint */
+    if (json_object_has_member(usage, "input_tokens")) {
+        state->cache_read_tokens = json_object_get_int_member(usage, "cache_read_input_tokens");
+        state->cache_write_tokens = json_object_get_int_member(usage, "cache_creation_input_tokens");
+        state->input_tokens = json_object_get_int_member(usage, "input_tokens") +
+            state->cache_read_tokens + state->cache_write_tokens;
+    }
+    if (json_object_has_member(usage, "output_tokens")) {
+        state->output_tokens = json_object_get_int_member(usage, "output_tokens");
+    }
+}
+
+/* Read token counts from a complete Messages response */
+static void
+anthropic_parse_usage(JsonObject *response, LLMStreamState *state)
+{
+    anthropic_parse_usage_block(json_object_get_object_member(response, "usage"), state);
+}
+
+/* The parts of a streamed event that are read */
+static const gchar * const anthropic_stream_path_names[] = {
+    "delta.type",
+    "delta.text",
+    "message.usage.input_tokens",
+    "message.usage.output_tokens",
+    "message.usage.cache_read_input_tokens",
+    "message.usage.cache_creation_input_tokens",
+    "usage.input_tokens",
+    "usage.output_tokens",
+    "usage.cache_read_input_tokens",
+    "usage.cache_creation_input_tokens",
+    "error",
+    "error.message",
+    "error.type",
+    NULL
+};
+
+static AiChatJsonPullPaths anthropic_stream_paths = AICHAT_JSON_PULL_PATHS_INIT(anthropic_stream_path_names);
+
+enum {
+    ANTHROPIC_STREAM_DELTA_TYPE,
+    ANTHROPIC_STREAM_DELTA_TEXT,
+    ANTHROPIC_STREAM_START_INPUT_TOKENS,
+    ANTHROPIC_STREAM_START_OUTPUT_TOKENS,
+    ANTHROPIC_STREAM_START_CACHE_READ_TOKENS,
+    ANTHROPIC_STREAM_START_CACHE_WRITE_TOKENS,
+    ANTHROPIC_STREAM_INPUT_TOKENS,
+    ANTHROPIC_STREAM_OUTPUT_TOKENS,
+    ANTHROPIC_STREAM_CACHE_READ_TOKENS,
+    ANTHROPIC_STREAM_CACHE_WRITE_TOKENS,
+    ANTHROPIC_STREAM_ERROR,
+    ANTHROPIC_STREAM_ERROR_MESSAGE,
+    ANTHROPIC_STREAM_ERROR_TYPE,
+    ANTHROPIC_STREAM_N_PATHS
+};
+
+/* Read the token counts present in @values, starting at @input, in the
+ * order input, output, cache read, cache write */
+static void
+anthropic_pull_usage(const AiChatJsonPullValue *values, guint input, LLMStreamState *state)
+{
+    /* input_tokens only counts what's after the last cache breakpoint */
+    if (values[input].type == AICHAT_JSON_PULL_NUMBER) {
+        state->cache_read_tokens = aichat_json_pull_get_int(&values[input + 2]);
+        state->cache_write_tokens = aichat_json_pull_get_int(&values[input + 3]);
+        state->input_tokens = aichat_json_pull_get_int(&values[input]) +
+            state->cache_read_tokens + state->cache_write_tokens;
+    }
+    if (values[input + 1].type == AICHAT_JSON_PULL_NUMBER) {
+        state->output_tokens = aichat_json_pull_get_int(&values[input + 1]);
+    }
+}
+
+/* Parse one event of a streamed Anthropic Messages response */
+static gboolean
+anthropic_parse_stream_event(const char *event, const char *data, gsize data_len,
+                             LLMStreamState *state, GError **error)
+{
+    AiChatJsonPullValue values[ANTHROPIC_STREAM_N_PATHS];
+    
+    /* Keep-alives carry nothing worth parsing */
+    if (strcmp(event, "ping") == 0) {
+        return TRUE;
+    }
+    
+    if (!aichat_json_pull(data, data_len, &anthropic_stream_paths, values)) {
+        if (error) {
+            *error = g_error_new(G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                "Invalid stream event");
+        }
+        return FALSE;
+    }
+    
+    /* Overloaded and similar errors can arrive after the 200 status, and
+     * end the reply however much of it was sent */
+    if (values[ANTHROPIC_STREAM_ERROR].type == AICHAT_JSON_PULL_OBJECT || strcmp(event, "error") == 0) {
+        char *error_msg = aichat_json_pull_dup_string(&values[ANTHROPIC_STREAM_ERROR_MESSAGE]);
+        char *error_type = aichat_json_pull_dup_string(&values[ANTHROPIC_STREAM_ERROR_TYPE]);
+        
+        if (error) {
+            *error = g_error_new(G_IO_ERROR, G_IO_ERROR_FAILED,
+                                "Anthropic API Error (%s): %s", 
+                                error_type ? error_type : "unknown",
+                                error_msg ? error_msg : "Unknown error");
+        }
+        g_free(error_msg);
+        g_free(error_type);
+        return FALSE;
+    }
+    
+    if (strcmp(event, "content_block_delta") == 0) {
+        const AiChatJsonPullValue *type = &values[ANTHROPIC_STREAM_DELTA_TYPE];
+        
+        /* Tool use arguments come as input_json_delta, which we don't show */
+        if (type->type == AICHAT_JSON_PULL_STRING && type->len == 10 &&
+                memcmp(type->data, "text_delta", 10) == 0) {
+            aichat_json_pull_append_string(state->delta, &values[ANTHROPIC_STREAM_DELTA_TEXT]);
+        }
+    } else if (strcmp(event, "message_start") == 0) {
+        anthropic_pull_usage(values, ANTHROPIC_STREAM_START_INPUT_TOKENS, state);
+    } else if (strcmp(event, "message_delta") == 0) {
+        /* Carries the cumulative output token count */
+        anthropic_pull_usage(values, ANTHROPIC_STREAM_INPUT_TOKENS, state);
+    } else if (strcmp(event, "message_stop") == 0) {
+        /* The only sign the reply is complete; a stream that ends without
+         * it was cut off */
+        state->done = TRUE;
+    }
+    
+    return TRUE;
+}
+
+/* The parts of a complete Messages response that are read */
+static const gchar * const anthropic_response_path_names[] = {
+    "content.*.text",
+    "usage.input_tokens",
+    "usage.output_tokens",
+    "usage.cache_read_input_tokens",
+    "usage.cache_creation_input_tokens",
+    "error",
+    "error.message",
+    "error.type",
+    NULL
+};
+
+static AiChatJsonPullPaths anthropic_response_paths = AICHAT_JSON_PULL_PATHS_INIT(anthropic_response_path_names);
+
+enum {
+    ANTHROPIC_RESPONSE_TEXT,
+    ANTHROPIC_RESPONSE_INPUT_TOKENS,
+    ANTHROPIC_RESPONSE_OUTPUT_TOKENS,
+    ANTHROPIC_RESPONSE_CACHE_READ_TOKENS,
+    ANTHROPIC_RESPONSE_CACHE_WRITE_TOKENS,
+    ANTHROPIC_RESPONSE_ERROR,
+    ANTHROPIC_RESPONSE_ERROR_MESSAGE,
+    ANTHROPIC_RESPONSE_ERROR_TYPE,
+    ANTHROPIC_RESPONSE_N_PATHS
+};
+
+typedef struct {
+    GString *text;
+    gboolean have_text;
+    AiChatJsonPullValue values[ANTHROPIC_RESPONSE_N_PATHS];
+} AnthropicResponsePull;
+
+/* Joins the text blocks, and keeps the first of everything else */
+static gboolean
+anthropic_response_pull_cb(guint path, const AiChatJsonPullValue *value, gpointer user_data)
+{
+    AnthropicResponsePull *pull = user_data;
+    
+    if (path == ANTHROPIC_RESPONSE_TEXT) {
+        pull->have_text |= aichat_json_pull_append_string(pull->text, value);
+    } else if (pull->values[path].type == AICHAT_JSON_PULL_NONE) {
+        pull->values[path] = *value;
+    }
+    
+    return TRUE;
+}
+
+/* Parse a complete Messages response without building a tree */
+static gboolean
+anthropic_parse_response_raw(const char *data, gsize len, LLMStreamState *state, GError **error)
+{
+    AnthropicResponsePull pull;
+    
+    memset(&pull, 0, sizeof(pull));
+    pull.text = state->delta;
+    
+    if (!aichat_json_pull_foreach(data, len, &anthropic_response_paths, anthropic_response_pull_cb, &pull)) {
+        if (error) {
+            *error = g_error_new(G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                "Invalid response");
+        }
+        return FALSE;
+    }
+    
+    if (pull.values[ANTHROPIC_RESPONSE_ERROR].type == AICHAT_JSON_PULL_OBJECT) {
+        char *error_msg = aichat_json_pull_dup_string(&pull.values[ANTHROPIC_RESPONSE_ERROR_MESSAGE]);
+        char *error_type = aichat_json_pull_dup_string(&pull.values[ANTHROPIC_RESPONSE_ERROR_TYPE]);
+        
+        if (error) {
+            *error = g_error_new(G_IO_ERROR, G_IO_ERROR_FAILED,
+                                "Anthropic API Error (%s): %s", 
+                                error_type ? error_type : "unknown",
+                                error_msg ? error_msg : "Unknown error");
+        }
+        g_free(error_msg);
+        g_free(error_type);
+        return FALSE;
+    }
+    
+    if (!pull.have_text) {
+        if (error) {
+            *error = g_error_new(G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                "No text in response");
+        }
+        return FALSE;
+    }
+    
+    anthropic_pull_usage(pull.values, ANTHROPIC_RESPONSE_INPUT_TOKENS, state);
+    
+    return TRUE;
+}
+
 /* Get the full URL for a chat request */
 static char*
 anthropic_get_chat_url(LLMProvider *provider, AiChatBuddy *buddy)
@@ -223,6 +511,7 @@ static LLMProvider anthropic_provider = {
     .endpoint_url = "https://api.anthropic.com",
     .chat_endpoint = "/v1/messages",
     .models = anthropic_models,
+    .small_model = "claude-3-5-haiku-20241022",
     .needs_api_key = TRUE,
     .is_local = FALSE,
     .api_format = API_FORMAT_ANTHROPIC,
@@ -232,6 +521,9 @@ static LLMProvider anthropic_provider = {
     .max_context_length = 200000,  /* Claude 3 has 200k context window */
     .format_request = anthropic_format_request,
     .parse_response = anthropic_parse_response,
+    .parse_response_raw = anthropic_parse_response_raw,
+    .parse_stream_event = anthropic_parse_stream_event,
+    .parse_usage = anthropic_parse_usage,
     .get_auth_header = anthropic_get_auth_header,
     .validate_response = anthropic_validate_response,
     .get_chat_url = anthropic_get_chat_url,
@@ -35,45 +35,51 @@ static const char *cohere_models[] = {
     NULL
 };
 
+/* Write one turn of the conversation as a chat_history entry */
+static void
+cohere_write_turn(AiChatJsonWriter *writer, AiChatRole role, const char *content)
+{
+    aichat_json_writer_begin_object(writer);
+    
+    /* Map roles: user -> USER, assistant -> CHATBOT */
+    aichat_json_writer_string_member(writer, "role", role == AICHAT_ROLE_ASSISTANT ? "CHATBOT" : "USER");
+    aichat_json_writer_string_member(writer, "message", content);
+    
+    aichat_json_writer_end_object(writer);
+}
+
 /* Format a chat request for Cohere Chat API */
-static JsonObject*
-cohere_format_request(AiChatBuddy *buddy, const char *message)
+static AiChatJsonBody*
+cohere_format_request(AiChatBuddy *buddy, gboolean stream)
 {
-    JsonObject *request;
-    JsonArray *chat_history;
-    JsonObject *chat_msg;
-    GList *history;
-    
-    request = json_object_new();
-    chat_history = json_array_new();
-    
-    /* Add conversation history in Cohere format */
-    for (history = buddy->history; history != NULL; history = history->next) {
-        AiChatHistory *hist = (AiChatHistory *)history->data;
-        chat_msg = json_object_new();
-        
-        /* Map roles: user -> USER, assistant -> CHATBOT */
-        const char *role = g_strcmp0(hist->role, "assistant") == 0 ? "CHATBOT" : "USER";
-        json_object_set_string_member(chat_msg, "role", role);
-        json_object_set_string_member(chat_msg, "message", hist->content);
-        json_array_add_object_element(chat_history, chat_msg);
-    }
+    AiChatJsonWriter *writer = aichat_json_writer_new(4096);
+    AiChatHistoryEntry *last = aichat_history_get_last(buddy->history);
+    const gchar *recall = aichat_history_get_recall(buddy->history);
+    gchar *message = last ? g_strconcat(recall ? recall : "", last->content, NULL) : NULL;
     
     /* Build request according to Cohere Chat API format */
-    json_object_set_string_member(request, "model", buddy->model ? buddy->model : "command-r");
-    json_object_set_string_member(request, "message", message);
-    json_object_set_array_member(request, "chat_history", chat_history);
+    aichat_json_writer_begin_object(writer);
+    aichat_json_writer_string_member(writer, "model", buddy->model ? buddy->model : "command-r");
+    
+    /* The message being sent goes on its own, the rest of the conversation before it */
+    aichat_json_writer_string_member(writer, "message", message ? message : "");
+    g_free(message);
+    aichat_json_writer_member(writer, "chat_history");
+    aichat_json_writer_begin_array(writer);
+    llm_write_history(writer, buddy->history, last ? aichat_history_get_length(buddy->history) - 1 : 0, cohere_write_turn);
+    aichat_json_writer_end_array(writer);
     
     /* Add system message if configured (called "preamble" in Cohere) */
     if (buddy->instructions && *buddy->instructions) {
-        json_object_set_string_member(request, "preamble", buddy->instructions);
+        aichat_json_writer_string_member(writer, "preamble", buddy->instructions);
     }
     
     /* Add generation parameters */
-    json_object_set_double_member(request, "temperature", 0.7);
-    json_object_set_int_member(request, "max_tokens", 4096);
+    aichat_json_writer_double_member(writer, "temperature", 0.7);
+    aichat_json_writer_int_member(writer, "max_tokens", 4096);
+    aichat_json_writer_end_object(writer);
     
-    return request;
+    return aichat_json_writer_free_to_body(writer);
 }
 
 /* Parse a response from Cohere */
@@ -102,6 +108,19 @@ cohere_parse_response(JsonObject *response, GError **error)
     return g_strdup(text);
 }
 
+/* Read token counts from a Cohere response */
+static void
+cohere_parse_usage(JsonObject *response, LLMStreamState *state)
+{
+    JsonObject *meta = json_object_get_object_member(response, "meta");
+    JsonObject *tokens = json_object_get_object_member(meta, "billed_units");
+    
+    if (tokens != NULL) {
+        state->input_tokens = json_object_get_int_member(tokens, "input_tokens");
+        state->output_tokens = json_object_get_int_member(tokens, "output_tokens");
+    }
+}
+
 /* Get the authentication header for Cohere */
 static const char*
 cohere_get_auth_header(AiChatAccount *account)
@@ -133,6 +152,70 @@ cohere_validate_response(JsonObject *response, GError **error)
     return TRUE;
 }
 
+/* The parts of a complete response that are read */
+static const gchar * const cohere_response_path_names[] = {
+    "text",
+    "meta.billed_units",
+    "meta.billed_units.input_tokens",
+    "meta.billed_units.output_tokens",
+    "message",
+    NULL
+};
+
+static AiChatJsonPullPaths cohere_response_paths = AICHAT_JSON_PULL_PATHS_INIT(cohere_response_path_names);
+
+enum {
+    COHERE_RESPONSE_TEXT,
+    COHERE_RESPONSE_BILLED_UNITS,
+    COHERE_RESPONSE_INPUT_TOKENS,
+    COHERE_RESPONSE_OUTPUT_TOKENS,
+    COHERE_RESPONSE_MESSAGE,
+    COHERE_RESPONSE_N_PATHS
+};
+
+/* Parse a complete response without building a tree */
+static gboolean
+cohere_parse_response_raw(const char *data, gsize len, LLMStreamState *state, GError **error)
+{
+    AiChatJsonPullValue values[COHERE_RESPONSE_N_PATHS];
+    
+    if (!aichat_json_pull(data, len, &cohere_response_paths, values)) {
+        if (error) {
+            *error = g_error_new(G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                "Invalid response");
+        }
+        return FALSE;
+    }
+    
+    /* Errors are a bare {"message": ...} */
+    if (values[COHERE_RESPONSE_MESSAGE].type > AICHAT_JSON_PULL_NULL) {
+        char *error_msg = aichat_json_pull_dup_string(&values[COHERE_RESPONSE_MESSAGE]);
+        
+        if (error) {
+            *error = g_error_new(G_IO_ERROR, G_IO_ERROR_FAILED,
+                                "Cohere API Error: %s", 
+                                error_msg ? error_msg : "Unknown error");
+        }
+        g_free(error_msg);
+        return FALSE;
+    }
+    
+    if (!aichat_json_pull_append_string(state->delta, &values[COHERE_RESPONSE_TEXT])) {
+        if (error) {
+            *error = g_error_new(G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                "No text in response");
+        }
+        return FALSE;
+    }
+    
+    if (values[COHERE_RESPONSE_BILLED_UNITS].type == AICHAT_JSON_PULL_OBJECT) {
+        state->input_tokens = aichat_json_pull_get_int(&values[COHERE_RESPONSE_INPUT_TOKENS]);
+        state->output_tokens = aichat_json_pull_get_int(&values[COHERE_RESPONSE_OUTPUT_TOKENS]);
+    }
+    
+    return TRUE;
+}
+
 /* Get the full URL for a chat request */
 static char*
 cohere_get_chat_url(LLMProvider *provider, AiChatBuddy *buddy)
@@ -197,6 +280,7 @@ static LLMProvider cohere_provider = {
     .endpoint_url = "https://api.cohere.ai",
     .chat_endpoint = "/v1/chat",
     .models = cohere_models,
+    .small_model = "command-r",
     .needs_api_key = TRUE,
     .is_local = FALSE,
     .api_format = API_FORMAT_COHERE,
@@ -206,6 +290,8 @@ static LLMProvider cohere_provider = {
     .max_context_length = 128000,  /* Command-R models have 128k context */
     .format_request = cohere_format_request,
     .parse_response = cohere_parse_response,
+    .parse_response_raw = cohere_parse_response_raw,
+    .parse_usage = cohere_parse_usage,
     .get_auth_header = cohere_get_auth_header,
     .validate_response = cohere_validate_response,
     .get_chat_url = cohere_get_chat_url,
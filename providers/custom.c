@@ -38,46 +38,33 @@ static const char *custom_models[] = {
 };
 
 /* Format a chat request for Custom provider (assumes OpenAI format by default) */
-static JsonObject*
-custom_format_request(AiChatBuddy *buddy, const char *message)
+static AiChatJsonBody*
+custom_format_request(AiChatBuddy *buddy, gboolean stream)
 {
-    JsonObject *request;
-    JsonArray *messages;
-    JsonObject *msg;
-    GList *history;
+    AiChatJsonWriter *writer = aichat_json_writer_new(4096);
     
-    request = json_object_new();
-    messages = json_array_new();
+    aichat_json_writer_begin_object(writer);
+    aichat_json_writer_string_member(writer, "model", buddy->model ? buddy->model : "gpt-3.5-turbo");
+    
+    aichat_json_writer_member(writer, "messages");
+    aichat_json_writer_begin_array(writer);
     
     /* Add system message if configured */
     if (buddy->instructions && *buddy->instructions) {
-        msg = json_object_new();
-        json_object_set_string_member(msg, "role", "system");
-        json_object_set_string_member(msg, "content", buddy->instructions);
-        json_array_add_object_element(messages, msg);
-    }
-    
-    /* Add conversation history */
-    for (history = buddy->history; history != NULL; history = history->next) {
-        AiChatHistory *hist = (AiChatHistory *)history->data;
-        msg = json_object_new();
-        json_object_set_string_member(msg, "role", hist->role);
-        json_object_set_string_member(msg, "content", hist->content);
-        json_array_add_object_element(messages, msg);
+        openai_compat_write_turn(writer, AICHAT_ROLE_SYSTEM, buddy->instructions);
     }
     
-    /* Add current message */
-    msg = json_object_new();
-    json_object_set_string_member(msg, "role", "user");
-    json_object_set_string_member(msg, "content", message);
-    json_array_add_object_element(messages, msg);
+    /* Add conversation history, which ends with the message being sent */
+    llm_write_history(writer, buddy->history, aichat_history_get_length(buddy->history), openai_compat_write_turn);
+    aichat_json_writer_end_array(writer);
     
-    /* Build request (OpenAI format by default) */
-    json_object_set_string_member(request, "model", buddy->model ? buddy->model : "gpt-3.5-turbo");
-    json_object_set_array_member(request, "messages", messages);
-    json_object_set_double_member(request, "temperature", 0.7);
+    aichat_json_writer_double_member(writer, "temperature", 0.7);
+    if (stream) {
+        aichat_json_writer_boolean_member(writer, "stream", TRUE);
+    }
+    aichat_json_writer_end_object(writer);
     
-    return request;
+    return aichat_json_writer_free_to_body(writer);
 }
 
 /* Parse a response from Custom provider (assumes OpenAI format by default) */
@@ -190,6 +177,86 @@ custom_validate_response(JsonObject *response, GError **error)
     return TRUE;
 }
 
+/* The parts of a complete response that are read, in the order the
+ * formats are tried */
+static const gchar * const custom_response_path_names[] = {
+    "choices.0.message.content",
+    "text",
+    "response",
+    "message.content",
+    "usage",
+    "usage.prompt_tokens",
+    "usage.completion_tokens",
+    "error",
+    "error.message",
+    "detail",
+    NULL
+};
+
+static AiChatJsonPullPaths custom_response_paths = AICHAT_JSON_PULL_PATHS_INIT(custom_response_path_names);
+
+enum {
+    CUSTOM_RESPONSE_CHOICE_CONTENT,
+    CUSTOM_RESPONSE_TEXT,
+    CUSTOM_RESPONSE_RESPONSE,
+    CUSTOM_RESPONSE_MESSAGE_CONTENT,
+    CUSTOM_RESPONSE_USAGE,
+    CUSTOM_RESPONSE_PROMPT_TOKENS,
+    CUSTOM_RESPONSE_COMPLETION_TOKENS,
+    CUSTOM_RESPONSE_ERROR,
+    CUSTOM_RESPONSE_ERROR_MESSAGE,
+    CUSTOM_RESPONSE_DETAIL,
+    CUSTOM_RESPONSE_N_PATHS
+};
+
+/* Parse a complete response without building a tree */
+static gboolean
+custom_parse_response_raw(const char *data, gsize len, LLMStreamState *state, GError **error)
+{
+    AiChatJsonPullValue values[CUSTOM_RESPONSE_N_PATHS];
+    guint i;
+    
+    if (!aichat_json_pull(data, len, &custom_response_paths, values)) {
+        if (error) {
+            *error = g_error_new(G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                "Invalid response");
+        }
+        return FALSE;
+    }
+    
+    if (values[CUSTOM_RESPONSE_ERROR].type > AICHAT_JSON_PULL_NULL ||
+            values[CUSTOM_RESPONSE_DETAIL].type > AICHAT_JSON_PULL_NULL) {
+        char *error_msg = values[CUSTOM_RESPONSE_DETAIL].type > AICHAT_JSON_PULL_NULL ?
+            aichat_json_pull_dup_string(&values[CUSTOM_RESPONSE_DETAIL]) :
+            aichat_json_pull_dup_string(&values[CUSTOM_RESPONSE_ERROR_MESSAGE]);
+        
+        if (error) {
+            *error = g_error_new(G_IO_ERROR, G_IO_ERROR_FAILED,
+                                "Custom API Error: %s", 
+                                error_msg ? error_msg : "Unknown error");
+        }
+        g_free(error_msg);
+        return FALSE;
+    }
+    
+    if (values[CUSTOM_RESPONSE_USAGE].type == AICHAT_JSON_PULL_OBJECT) {
+        state->input_tokens = aichat_json_pull_get_int(&values[CUSTOM_RESPONSE_PROMPT_TOKENS]);
+        state->output_tokens = aichat_json_pull_get_int(&values[CUSTOM_RESPONSE_COMPLETION_TOKENS]);
+    }
+    
+    for (i = CUSTOM_RESPONSE_CHOICE_CONTENT; i <= CUSTOM_RESPONSE_MESSAGE_CONTENT; i++) {
+        if (aichat_json_pull_append_string(state->delta, &values[i])) {
+            return TRUE;
+        }
+    }
+    
+    if (error) {
+        *error = g_error_new(G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                            "No recognizable content in response");
+    }
+    return FALSE;
+}
+
 /* Get the full URL for a chat request */
 static char*
 custom_get_chat_url(LLMProvider *provider, AiChatBuddy *buddy)
@@ -304,6 +371,9 @@ static LLMProvider custom_provider = {
     .max_context_length = 32768,  /* Conservative default */
     .format_request = custom_format_request,
     .parse_response = custom_parse_response,
+    .parse_response_raw = custom_parse_response_raw,
+    .parse_stream_event = openai_compat_parse_stream_event,
+    .parse_usage = openai_compat_parse_usage,
     .get_auth_header = custom_get_auth_header,
     .validate_response = custom_validate_response,
     .get_chat_url = custom_get_chat_url,
@@ -18,6 +18,7 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
  */
 
+#include <string.h>
 #include <glib.h>
 #include <json-glib/json-glib.h>
 #include "../providers.h"
@@ -33,70 +34,84 @@ static const char *google_models[] = {
     NULL
 };
 
+/* Write one turn of the conversation as a Content object */
+static void
+google_write_turn(AiChatJsonWriter *writer, AiChatRole role, const char *content)
+{
+    aichat_json_writer_begin_object(writer);
+    
+    /* Map roles: user -> user, assistant -> model */
+    aichat_json_writer_string_member(writer, "role", role == AICHAT_ROLE_ASSISTANT ? "model" : "user");
+    aichat_json_writer_member(writer, "parts");
+    aichat_json_writer_begin_array(writer);
+    aichat_json_writer_begin_object(writer);
+    aichat_json_writer_string_member(writer, "text", content);
+    aichat_json_writer_end_object(writer);
+    aichat_json_writer_end_array(writer);
+    
+    aichat_json_writer_end_object(writer);
+}
+
 /* Format a chat request for Google GenerateContent API */
-static JsonObject*
-google_format_request(AiChatBuddy *buddy, const char *message)
+static AiChatJsonBody*
+google_format_request(AiChatBuddy *buddy, gboolean stream)
 {
-    JsonObject *request;
-    JsonArray *contents;
-    JsonObject *content;
-    JsonArray *parts;
-    JsonObject *part;
-    GList *history;
+    AiChatJsonWriter *writer = aichat_json_writer_new(4096);
     
-    request = json_object_new();
-    contents = json_array_new();
+    aichat_json_writer_begin_object(writer);
     
     /* Add system instruction if configured */
     if (buddy->instructions && *buddy->instructions) {
-        JsonObject *system_instruction = json_object_new();
-        JsonArray *system_parts = json_array_new();
-        JsonObject *system_part = json_object_new();
-        
-        json_object_set_string_member(system_part, "text", buddy->instructions);
-        json_array_add_object_element(system_parts, system_part);
-        json_object_set_array_member(system_instruction, "parts", system_parts);
-        json_object_set_object_member(request, "systemInstruction", system_instruction);
+        aichat_json_writer_member(writer, "systemInstruction");
+        aichat_json_writer_begin_object(writer);
+        aichat_json_writer_member(writer, "parts");
+        aichat_json_writer_begin_array(writer);
+        aichat_json_writer_begin_object(writer);
+        aichat_json_writer_string_member(writer, "text", buddy->instructions);
+        aichat_json_writer_end_object(writer);
+        aichat_json_writer_end_array(writer);
+        aichat_json_writer_end_object(writer);
     }
     
-    /* Add conversation history */
-    for (history = buddy->history; history != NULL; history = history->next) {
-        AiChatHistory *hist = (AiChatHistory *)history->data;
-        
-        content = json_object_new();
-        parts = json_array_new();
-        part = json_object_new();
-        
-        /* Map roles: user -> user, assistant -> model */
-        const char *role = g_strcmp0(hist->role, "assistant") == 0 ? "model" : "user";
-        json_object_set_string_member(content, "role", role);
-        json_object_set_string_member(part, "text", hist->content);
-        json_array_add_object_element(parts, part);
-        json_object_set_array_member(content, "parts", parts);
-        json_array_add_object_element(contents, content);
-    }
+    /* Add conversation history, which ends with the message being sent */
+    aichat_json_writer_member(writer, "contents");
+    aichat_json_writer_begin_array(writer);
+    llm_write_history(writer, buddy->history, aichat_history_get_length(buddy->history), google_write_turn);
+    aichat_json_writer_end_array(writer);
     
-    /* Add current message */
-    content = json_object_new();
-    parts = json_array_new();
-    part = json_object_new();
+    /* Add generation config */
+    aichat_json_writer_member(writer, "generationConfig");
+    aichat_json_writer_begin_object(writer);
+    aichat_json_writer_double_member(writer, "temperature", 0.7);
+    aichat_json_writer_int_member(writer, "maxOutputTokens", 4096);
+    aichat_json_writer_end_object(writer);
     
-    json_object_set_string_member(content, "role", "user");
-    json_object_set_string_member(part, "text", message);
-    json_array_add_object_element(parts, part);
-    json_object_set_array_member(content, "parts", parts);
-    json_array_add_object_element(contents, content);
+    aichat_json_writer_end_object(writer);
     
-    /* Build request */
-    json_object_set_array_member(request, "contents", contents);
+    return aichat_json_writer_free_to_body(writer);
+}
+
+/* Concatenate the text of all parts, or NULL if none of them has any */
+static char*
+google_join_parts(JsonArray *parts)
+{
+    GString *text = NULL;
+    guint i, len = json_array_get_length(parts);
     
-    /* Add generation config */
-    JsonObject *generation_config = json_object_new();
-    json_object_set_double_member(generation_config, "temperature", 0.7);
-    json_object_set_int_member(generation_config, "maxOutputTokens", 4096);
-    json_object_set_object_member(request, "generationConfig", generation_config);
+    for (i = 0; i < len; i++) {
+        JsonObject *part = json_array_get_object_element(parts, i);
+        const char *part_text = json_object_get_string_member(part, "text");
+        
+        if (part_text != NULL) {
+            if (text == NULL) {
+                text = g_string_new(part_text);
+            } else {
+                g_string_append(text, part_text);
+            }
+        }
+    }
     
-    return request;
+    return text ? g_string_free(text, FALSE) : NULL;
 }
 
 /* Parse a response from Google Gemini */
@@ -107,8 +122,7 @@ google_parse_response(JsonObject *response, GError **error)
     JsonObject *candidate;
     JsonObject *content;
     JsonArray *parts;
-    JsonObject *part;
-    const char *text;
+    char *text;
     
     if (!json_object_has_member(response, "candidates")) {
         if (error) {
@@ -154,25 +168,17 @@ google_parse_response(JsonObject *response, GError **error)
         return NULL;
     }
     
-    part = json_array_get_object_element(parts, 0);
-    if (!json_object_has_member(part, "text")) {
-        if (error) {
-            *error = g_error_new(G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
-                                "No text in part");
-        }
-        return NULL;
-    }
-    
-    text = json_object_get_string_member(part, "text");
+    /* Long answers can come back split over several parts */
+    text = google_join_parts(parts);
     if (text == NULL) {
         if (error) {
             *error = g_error_new(G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
-                                "Null text in response");
+                                "No text in parts");
         }
         return NULL;
     }
     
-    return g_strdup(text);
+    return text;
 }
 
 /* Get the authentication header for Google (not used, API key goes in URL) */
@@ -204,6 +210,130 @@ google_validate_response(JsonObject *response, GError **error)
     return TRUE;
 }
 
+/* Read token counts from a GenerateContentResponse */
+static void
+google_parse_usage(JsonObject *response, LLMStreamState *state)
+{
+    JsonObject *usage = json_object_get_object_member(response, "usageMetadata");
+    
+    if (usage != NULL) {
+        state->input_tokens = json_object_get_int_member(usage, "promptTokenCount");
+        state->output_tokens = json_object_get_int_member(usage, "candidatesTokenCount");
+    }
+}
+
+/* The parts of a streamed GenerateContentResponse that are read */
+static const gchar * const google_stream_path_names[] = {
+    "candidates.0.content.parts.*.text",
+    "candidates.0.finishReason",
+    "promptFeedback.blockReason",
+    "usageMetadata",
+    "usageMetadata.promptTokenCount",
+    "usageMetadata.candidatesTokenCount",
+    "error",
+    "error.message",
+    "error.code",
+    NULL
+};
+
+static AiChatJsonPullPaths google_stream_paths = AICHAT_JSON_PULL_PATHS_INIT(google_stream_path_names);
+
+enum {
+    GOOGLE_STREAM_PART_TEXT,
+    GOOGLE_STREAM_FINISH_REASON,
+    GOOGLE_STREAM_BLOCK_REASON,
+    GOOGLE_STREAM_USAGE,
+    GOOGLE_STREAM_PROMPT_TOKENS,
+    GOOGLE_STREAM_CANDIDATES_TOKENS,
+    GOOGLE_STREAM_ERROR,
+    GOOGLE_STREAM_ERROR_MESSAGE,
+    GOOGLE_STREAM_ERROR_CODE,
+    GOOGLE_STREAM_N_PATHS
+};
+
+typedef struct {
+    GString *text;
+    AiChatJsonPullValue values[GOOGLE_STREAM_N_PATHS];
+} GoogleStreamPull;
+
+/* Joins the text of all parts, and keeps the first of everything else */
+static gboolean
+google_stream_pull_cb(guint path, const AiChatJsonPullValue *value, gpointer user_data)
+{
+    GoogleStreamPull *pull = user_data;
+    
+    if (path == GOOGLE_STREAM_PART_TEXT) {
+        aichat_json_pull_append_string(pull->text, value);
+    } else if (pull->values[path].type == AICHAT_JSON_PULL_NONE) {
+        pull->values[path] = *value;
+    }
+    
+    return TRUE;
+}
+
+/* Parse one event of a streamed response; each is a GenerateContentResponse of its own */
+static gboolean
+google_parse_stream_event(const char *event, const char *data, gsize data_len,
+                          LLMStreamState *state, GError **error)
+{
+    GoogleStreamPull pull;
+    
+    memset(&pull, 0, sizeof(pull));
+    pull.text = state->delta;
+    
+    if (!aichat_json_pull_foreach(data, data_len, &google_stream_paths, google_stream_pull_cb, &pull)) {
+        if (error) {
+            *error = g_error_new(G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                "Invalid stream chunk");
+        }
+        return FALSE;
+    }
+    
+    if (pull.values[GOOGLE_STREAM_ERROR].type == AICHAT_JSON_PULL_OBJECT) {
+        char *error_msg = aichat_json_pull_dup_string(&pull.values[GOOGLE_STREAM_ERROR_MESSAGE]);
+        
+        if (error) {
+            *error = g_error_new(G_IO_ERROR, G_IO_ERROR_FAILED,
+                                "Google API Error (%" G_GINT64_FORMAT "): %s", 
+                                aichat_json_pull_get_int(&pull.values[GOOGLE_STREAM_ERROR_CODE]),
+                                error_msg ? error_msg : "Unknown error");
+        }
+        g_free(error_msg);
+        return FALSE;
+    }
+    
+    /* A blocked prompt gets no candidates at all */
+    if (pull.values[GOOGLE_STREAM_BLOCK_REASON].type == AICHAT_JSON_PULL_STRING) {
+        char *reason = aichat_json_pull_dup_string(&pull.values[GOOGLE_STREAM_BLOCK_REASON]);
+        
+        if (error) {
+            *error = g_error_new(G_IO_ERROR, G_IO_ERROR_FAILED,
+                                "Prompt blocked: %s", reason ? reason : "unknown");
+        }
+        g_free(reason);
+        return FALSE;
+    }
+    
+    if (pull.values[GOOGLE_STREAM_FINISH_REASON].type == AICHAT_JSON_PULL_STRING) {
+        state->done = TRUE;
+    }
+    
+    if (pull.values[GOOGLE_STREAM_USAGE].type == AICHAT_JSON_PULL_OBJECT) {
+        state->input_tokens = aichat_json_pull_get_int(&pull.values[GOOGLE_STREAM_PROMPT_TOKENS]);
+        state->output_tokens = aichat_json_pull_get_int(&pull.values[GOOGLE_STREAM_CANDIDATES_TOKENS]);
+    }
+    
+    return TRUE;
+}
+
+/* A complete response is a GenerateContentResponse like each streamed one,
+ * only with all of the text */
+static gboolean
+google_parse_response_raw(const char *data, gsize len, LLMStreamState *state, GError **error)
+{
+    return google_parse_stream_event("message", data, len, state, error);
+}
+
 /* Get the full URL for a chat request (includes API key) */
 static char*
 google_get_chat_url(LLMProvider *provider, AiChatBuddy *buddy)
@@ -216,6 +346,19 @@ google_get_chat_url(LLMProvider *provider, AiChatBuddy *buddy)
                           provider->endpoint_url, model, api_key);
 }
 
+/* Get the full URL for a streamed chat request; alt=sse asks for SSE framing
+ * instead of one long JSON array */
+static char*
+google_get_stream_url(LLMProvider *provider, AiChatBuddy *buddy)
+{
+    AiChatAccount *account = purple_connection_get_protocol_data(purple_account_get_connection(buddy->buddy->account));
+    const char *api_key = purple_account_get_string(account->account, "api_key", "");
+    const char *model = buddy->model ? buddy->model : "gemini-1.5-pro";
+    
+    return g_strdup_printf("%s/v1beta/models/%s:streamGenerateContent?alt=sse&key=%s", 
+                          provider->endpoint_url, model, api_key);
+}
+
 /* Get additional headers for Google */
 static GHashTable*
 google_get_additional_headers(AiChatAccount *account, AiChatBuddy *buddy)
@@ -274,6 +417,7 @@ static LLMProvider google_provider = {
     .endpoint_url = "https://generativelanguage.googleapis.com",
     .chat_endpoint = "/v1beta/models/{model}:generateContent",  /* Template, actual URL built in get_chat_url */
     .models = google_models,
+    .small_model = "gemini-1.5-flash",
     .needs_api_key = TRUE,
     .is_local = FALSE,
     .api_format = API_FORMAT_GOOGLE,
@@ -283,9 +427,13 @@ static LLMProvider google_provider = {
     .max_context_length = 1000000,  /* Gemini 1.5 has 1M context window */
     .format_request = google_format_request,
     .parse_response = google_parse_response,
+    .parse_response_raw = google_parse_response_raw,
+    .parse_stream_event = google_parse_stream_event,
+    .parse_usage = google_parse_usage,
     .get_auth_header = google_get_auth_header,
     .validate_response = google_validate_response,
     .get_chat_url = google_get_chat_url,
+    .get_stream_url = google_get_stream_url,
     .get_additional_headers = google_get_additional_headers,
     .parse_error = google_parse_error,
     .model_supports_feature = google_model_supports_feature
@@ -42,47 +42,34 @@ static const char *huggingface_models[] = {
 };
 
 /* Format a chat request for Hugging Face (uses OpenAI format) */
-static JsonObject*
-huggingface_format_request(AiChatBuddy *buddy, const char *message)
+static AiChatJsonBody*
+huggingface_format_request(AiChatBuddy *buddy, gboolean stream)
 {
-    JsonObject *request;
-    JsonArray *messages;
-    JsonObject *msg;
-    GList *history;
+    AiChatJsonWriter *writer = aichat_json_writer_new(4096);
     
-    request = json_object_new();
-    messages = json_array_new();
+    aichat_json_writer_begin_object(writer);
+    aichat_json_writer_string_member(writer, "model", buddy->model ? buddy->model : "meta-llama/Meta-Llama-3.1-8B-Instruct");
+    
+    aichat_json_writer_member(writer, "messages");
+    aichat_json_writer_begin_array(writer);
     
     /* Add system message if configured */
     if (buddy->instructions && *buddy->instructions) {
-        msg = json_object_new();
-        json_object_set_string_member(msg, "role", "system");
-        json_object_set_string_member(msg, "content", buddy->instructions);
-        json_array_add_object_element(messages, msg);
-    }
-    
-    /* Add conversation history */
-    for (history = buddy->history; history != NULL; history = history->next) {
-        AiChatHistory *hist = (AiChatHistory *)history->data;
-        msg = json_object_new();
-        json_object_set_string_member(msg, "role", hist->role);
-        json_object_set_string_member(msg, "content", hist->content);
-        json_array_add_object_element(messages, msg);
+        openai_compat_write_turn(writer, AICHAT_ROLE_SYSTEM, buddy->instructions);
     }
     
-    /* Add current message */
-    msg = json_object_new();
-    json_object_set_string_member(msg, "role", "user");
-    json_object_set_string_member(msg, "content", message);
-    json_array_add_object_element(messages, msg);
+    /* Add conversation history, which ends with the message being sent */
+    llm_write_history(writer, buddy->history, aichat_history_get_length(buddy->history), openai_compat_write_turn);
+    aichat_json_writer_end_array(writer);
     
-    /* Build request */
-    json_object_set_string_member(request, "model", buddy->model ? buddy->model : "meta-llama/Meta-Llama-3.1-8B-Instruct");
-    json_object_set_array_member(request, "messages", messages);
-    json_object_set_double_member(request, "temperature", 0.7);
-    json_object_set_int_member(request, "max_tokens", 2048);
+    aichat_json_writer_double_member(writer, "temperature", 0.7);
+    aichat_json_writer_int_member(writer, "max_tokens", 2048);
+    if (stream) {
+        aichat_json_writer_boolean_member(writer, "stream", TRUE);
+    }
+    aichat_json_writer_end_object(writer);
     
-    return request;
+    return aichat_json_writer_free_to_body(writer);
 }
 
 /* Parse a response from Hugging Face */
@@ -241,6 +228,9 @@ static LLMProvider huggingface_provider = {
     .max_context_length = 32768,  /* Varies by model */
     .format_request = huggingface_format_request,
     .parse_response = huggingface_parse_response,
+    .parse_response_raw = openai_compat_parse_response_raw,
+    .parse_stream_event = openai_compat_parse_stream_event,
+    .parse_usage = openai_compat_parse_usage,
     .get_auth_header = huggingface_get_auth_header,
     .validate_response = huggingface_validate_response,
     .get_chat_url = huggingface_get_chat_url,
@@ -55,52 +55,37 @@ static const char *ollama_models[] = {
 };
 
 /* Format a chat request for Ollama Chat API */
-static JsonObject*
-ollama_format_request(AiChatBuddy *buddy, const char *message)
+static AiChatJsonBody*
+ollama_format_request(AiChatBuddy *buddy, gboolean stream)
 {
-    JsonObject *request;
-    JsonArray *messages;
-    JsonObject *msg;
-    GList *history;
+    AiChatJsonWriter *writer = aichat_json_writer_new(4096);
     
-    request = json_object_new();
-    messages = json_array_new();
+    aichat_json_writer_begin_object(writer);
+    aichat_json_writer_string_member(writer, "model", buddy->model ? buddy->model : "llama3.1:latest");
+    
+    aichat_json_writer_member(writer, "messages");
+    aichat_json_writer_begin_array(writer);
     
     /* Add system message if configured */
     if (buddy->instructions && *buddy->instructions) {
-        msg = json_object_new();
-        json_object_set_string_member(msg, "role", "system");
-        json_object_set_string_member(msg, "content", buddy->instructions);
-        json_array_add_object_element(messages, msg);
-    }
-    
-    /* Add conversation history */
-    for (history = buddy->history; history != NULL; history = history->next) {
-        AiChatHistory *hist = (AiChatHistory *)history->data;
-        msg = json_object_new();
-        json_object_set_string_member(msg, "role", hist->role);
-        json_object_set_string_member(msg, "content", hist->content);
-        json_array_add_object_element(messages, msg);
+        openai_compat_write_turn(writer, AICHAT_ROLE_SYSTEM, buddy->instructions);
     }
     
-    /* Add current message */
-    msg = json_object_new();
-    json_object_set_string_member(msg, "role", "user");
-    json_object_set_string_member(msg, "content", message);
-    json_array_add_object_element(messages, msg);
+    /* Add conversation history, which ends with the message being sent */
+    llm_write_history(writer, buddy->history, aichat_history_get_length(buddy->history), openai_compat_write_turn);
+    aichat_json_writer_end_array(writer);
     
-    /* Build request according to Ollama Chat API format */
-    json_object_set_string_member(request, "model", buddy->model ? buddy->model : "llama3.1:latest");
-    json_object_set_array_member(request, "messages", messages);
-    json_object_set_boolean_member(request, "stream", FALSE);  /* Disable streaming for now */
+    aichat_json_writer_boolean_member(writer, "stream", stream);
     
     /* Add generation options */
-    JsonObject *options = json_object_new();
-    json_object_set_double_member(options, "temperature", 0.7);
-    json_object_set_int_member(options, "num_predict", 4096);
-    json_object_set_object_member(request, "options", options);
+    aichat_json_writer_member(writer, "options");
+    aichat_json_writer_begin_object(writer);
+    aichat_json_writer_double_member(writer, "temperature", 0.7);
+    aichat_json_writer_int_member(writer, "num_predict", 4096);
+    aichat_json_writer_end_object(writer);
+    aichat_json_writer_end_object(writer);
     
-    return request;
+    return aichat_json_writer_free_to_body(writer);
 }
 
 /* Parse a response from Ollama */
@@ -164,6 +149,110 @@ ollama_validate_response(JsonObject *response, GError **error)
     return TRUE;
 }
 
+/* Record the generation statistics of a response */
+static void
+ollama_set_usage(LLMStreamState *state, gint64 prompt_eval_count, gint64 eval_count, gint64 eval_duration)
+{
+    state->input_tokens = prompt_eval_count;
+    state->output_tokens = eval_count;
+    
+    if (eval_duration > 0) {
+        purple_debug_info("aichat", "Ollama generated %" G_GINT64_FORMAT " tokens at %.1f tokens/s\n",
+                          eval_count, eval_count * 1e9 / eval_duration);
+    }
+}
+
+/* Read the generation statistics of a complete response */
+static void
+ollama_parse_usage(JsonObject *response, LLMStreamState *state)
+{
+    gint64 prompt_eval_count = 0, eval_count = 0, eval_duration = 0;
+    
+    /* prompt_eval_count is left out when the whole prompt came from Ollama's cache */
+    if (json_object_has_member(response, "prompt_eval_count")) {
+        prompt_eval_count = json_object_get_int_member(response, "prompt_eval_count");
+    }
+    if (json_object_has_member(response, "eval_count")) {
+        eval_count = json_object_get_int_member(response, "eval_count");
+    }
+    if (json_object_has_member(response, "eval_duration")) {
+        eval_duration = json_object_get_int_member(response, "eval_duration");
+    }
+    
+    ollama_set_usage(state, prompt_eval_count, eval_count, eval_duration);
+}
+
+/* The parts of a streamed line that are read */
+static const gchar * const ollama_stream_path_names[] = {
+    "message.content",
+    "done",
+    "prompt_eval_count",
+    "eval_count",
+    "eval_duration",
+    "error",
+    NULL
+};
+
+static AiChatJsonPullPaths ollama_stream_paths = AICHAT_JSON_PULL_PATHS_INIT(ollama_stream_path_names);
+
+enum {
+    OLLAMA_STREAM_CONTENT,
+    OLLAMA_STREAM_DONE,
+    OLLAMA_STREAM_PROMPT_EVAL_COUNT,
+    OLLAMA_STREAM_EVAL_COUNT,
+    OLLAMA_STREAM_EVAL_DURATION,
+    OLLAMA_STREAM_ERROR,
+    OLLAMA_STREAM_N_PATHS
+};
+
+/* Parse one line of a streamed Ollama chat response */
+static gboolean
+ollama_parse_stream_event(const char *event, const char *data, gsize data_len,
+                          LLMStreamState *state, GError **error)
+{
+    AiChatJsonPullValue values[OLLAMA_STREAM_N_PATHS];
+    
+    if (!aichat_json_pull(data, data_len, &ollama_stream_paths, values)) {
+        if (error) {
+            *error = g_error_new(G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                "Invalid stream line");
+        }
+        return FALSE;
+    }
+    
+    /* A model failing to load mid-stream comes back as an error line */
+    if (values[OLLAMA_STREAM_ERROR].type > AICHAT_JSON_PULL_NULL) {
+        char *error_msg = aichat_json_pull_dup_string(&values[OLLAMA_STREAM_ERROR]);
+        
+        if (error) {
+            *error = g_error_new(G_IO_ERROR, G_IO_ERROR_FAILED,
+                                "Ollama Error: %s", 
+                                error_msg ? error_msg : "Unknown error");
+        }
+        g_free(error_msg);
+        return FALSE;
+    }
+    
+    aichat_json_pull_append_string(state->delta, &values[OLLAMA_STREAM_CONTENT]);
+    
+    /* The final record carries the generation statistics */
+    if (aichat_json_pull_get_boolean(&values[OLLAMA_STREAM_DONE])) {
+        state->done = TRUE;
+        ollama_set_usage(state, aichat_json_pull_get_int(&values[OLLAMA_STREAM_PROMPT_EVAL_COUNT]),
+                         aichat_json_pull_get_int(&values[OLLAMA_STREAM_EVAL_COUNT]),
+                         aichat_json_pull_get_int(&values[OLLAMA_STREAM_EVAL_DURATION]));
+    }
+    
+    return TRUE;
+}
+
+/* A complete response is the last line of a stream, with the whole message */
+static gboolean
+ollama_parse_response_raw(const char *data, gsize len, LLMStreamState *state, GError **error)
+{
+    return ollama_parse_stream_event("message", data, len, state, error);
+}
+
 /* Get the full URL for a chat request */
 static char*
 ollama_get_chat_url(LLMProvider *provider, AiChatBuddy *buddy)
@@ -179,6 +268,19 @@ ollama_get_chat_url(LLMProvider *provider, AiChatBuddy *buddy)
     }
 }
 
+/* Get the embeddings URL, which honours the custom endpoint the same way */
+static char*
+ollama_get_embeddings_url(LLMProvider *provider, AiChatAccount *account)
+{
+    const char *custom_endpoint = purple_account_get_string(account->account, "ollama_endpoint", "");
+    
+    if (custom_endpoint && *custom_endpoint) {
+        return g_strdup_printf("%s%s", custom_endpoint, provider->embeddings_endpoint);
+    } else {
+        return g_strdup_printf("%s%s", provider->endpoint_url, provider->embeddings_endpoint);
+    }
+}
+
 /* Get additional headers for Ollama */
 static GHashTable*
 ollama_get_additional_headers(AiChatAccount *account, AiChatBuddy *buddy)
@@ -236,18 +338,25 @@ static LLMProvider ollama_provider = {
     .endpoint_url = "http://localhost:11434",
     .chat_endpoint = "/api/chat",
     .models = ollama_models,
+    .embedding_model = "nomic-embed-text",
+    .embeddings_endpoint = "/api/embed",
     .needs_api_key = FALSE,
     .is_local = TRUE,
     .api_format = API_FORMAT_OLLAMA,
     .supports_streaming = TRUE,
+    .stream_format = LLM_STREAM_NDJSON,
     .supports_vision = TRUE,  /* Some models do */
     .supports_functions = TRUE,
     .max_context_length = 32768,  /* Varies by model and configuration */
     .format_request = ollama_format_request,
     .parse_response = ollama_parse_response,
+    .parse_response_raw = ollama_parse_response_raw,
+    .parse_stream_event = ollama_parse_stream_event,
+    .parse_usage = ollama_parse_usage,
     .get_auth_header = ollama_get_auth_header,
     .validate_response = ollama_validate_response,
     .get_chat_url = ollama_get_chat_url,
+    .get_embeddings_url = ollama_get_embeddings_url,
     .get_additional_headers = ollama_get_additional_headers,
     .parse_error = ollama_parse_error,
     .model_supports_feature = ollama_model_supports_feature
@@ -36,46 +36,39 @@ static const char *openai_models[] = {
 };
 
 /* Format a chat request for OpenAI */
-static JsonObject*
-openai_format_request(AiChatBuddy *buddy, const char *message)
+static AiChatJsonBody*
+openai_format_request(AiChatBuddy *buddy, gboolean stream)
 {
-    JsonObject *request;
-    JsonArray *messages;
-    JsonObject *msg;
-    GList *history;
+    AiChatJsonWriter *writer = aichat_json_writer_new(4096);
     
-    request = json_object_new();
-    messages = json_array_new();
+    aichat_json_writer_begin_object(writer);
+    aichat_json_writer_string_member(writer, "model", buddy->model ? buddy->model : "gpt-3.5-turbo");
+    
+    aichat_json_writer_member(writer, "messages");
+    aichat_json_writer_begin_array(writer);
     
     /* Add system message if configured */
     if (buddy->instructions && *buddy->instructions) {
-        msg = json_object_new();
-        json_object_set_string_member(msg, "role", "system");
-        json_object_set_string_member(msg, "content", buddy->instructions);
-        json_array_add_object_element(messages, msg);
-    }
-    
-    /* Add conversation history */
-    for (history = buddy->history; history != NULL; history = history->next) {
-        AiChatHistory *hist = (AiChatHistory *)history->data;
-        msg = json_object_new();
-        json_object_set_string_member(msg, "role", hist->role);
-        json_object_set_string_member(msg, "content", hist->content);
-        json_array_add_object_element(messages, msg);
+        openai_compat_write_turn(writer, AICHAT_ROLE_SYSTEM, buddy->instructions);
     }
     
-    /* Add current message */
-    msg = json_object_new();
-    json_object_set_string_member(msg, "role", "user");
-    json_object_set_string_member(msg, "content", message);
-    json_array_add_object_element(messages, msg);
+    /* Add conversation history, which ends with the message being sent */
+    llm_write_history(writer, buddy->history, aichat_history_get_length(buddy->history), openai_compat_write_turn);
+    aichat_json_writer_end_array(writer);
     
-    /* Build request */
-    json_object_set_string_member(request, "model", buddy->model ? buddy->model : "gpt-3.5-turbo");
-    json_object_set_array_member(request, "messages", messages);
-    json_object_set_double_member(request, "temperature", 0.7);
+    aichat_json_writer_double_member(writer, "temperature", 0.7);
+    if (stream) {
+        aichat_json_writer_boolean_member(writer, "stream", TRUE);
+        
+        /* Otherwise streamed replies come without token counts */
+        aichat_json_writer_member(writer, "stream_options");
+        aichat_json_writer_begin_object(writer);
+        aichat_json_writer_boolean_member(writer, "include_usage", TRUE);
+        aichat_json_writer_end_object(writer);
+    }
+    aichat_json_writer_end_object(writer);
     
-    return request;
+    return aichat_json_writer_free_to_body(writer);
 }
 
 /* Parse a response from OpenAI */
@@ -209,6 +202,9 @@ static LLMProvider openai_provider = {
     .endpoint_url = "https://api.openai.com",
     .chat_endpoint = "/v1/chat/completions",
     .models = openai_models,
+    .small_model = "gpt-3.5-turbo",
+    .embedding_model = "text-embedding-3-small",
+    .embeddings_endpoint = "/v1/embeddings",
     .needs_api_key = TRUE,
     .is_local = FALSE,
     .api_format = API_FORMAT_OPENAI,
@@ -218,6 +214,9 @@ static LLMProvider openai_provider = {
     .max_context_length = 0,  /* Varies by model */
     .format_request = openai_format_request,
     .parse_response = openai_parse_response,
+    .parse_response_raw = openai_compat_parse_response_raw,
+    .parse_stream_event = openai_compat_parse_stream_event,
+    .parse_usage = openai_compat_parse_usage,
     .get_auth_header = openai_get_auth_header,
     .validate_response = openai_validate_response,
     .get_chat_url = openai_get_chat_url,
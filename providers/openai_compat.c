@@ -18,53 +18,61 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
  */
 
+#include <string.h>
 #include <glib.h>
 #include <json-glib/json-glib.h>
 #include "../providers.h"
 #include "../provider_registry.h"
 #include "../libaichat.h"
 
-/* Shared OpenAI-compatible request formatting */
-JsonObject*
-openai_compat_format_request(AiChatBuddy *buddy, const char *message)
+/* Shared OpenAI-style message, also used by Anthropic and Ollama */
+void
+openai_compat_write_turn(AiChatJsonWriter *writer, AiChatRole role, const char *content)
+{
+    aichat_json_writer_begin_object(writer);
+    aichat_json_writer_string_member(writer, "role", aichat_role_to_string(role));
+    aichat_json_writer_string_member(writer, "content", content);
+    aichat_json_writer_end_object(writer);
+}
+
+/* Shared OpenAI-compatible request formatting.
+ *
+ * Providers cache prompts by their leading bytes, so everything up to the
+ * newest message must come out the same on every request: members are
+ * always written in this order, and the parameters go after "messages". */
+AiChatJsonBody*
+openai_compat_format_request(AiChatBuddy *buddy, gboolean stream)
 {
-    JsonObject *request;
-    JsonArray *messages;
-    JsonObject *msg;
-    GList *history;
+    AiChatJsonWriter *writer = aichat_json_writer_new(4096);
+    
+    aichat_json_writer_begin_object(writer);
+    aichat_json_writer_string_member(writer, "model", buddy->model ? buddy->model : "gpt-3.5-turbo");
     
-    request = json_object_new();
-    messages = json_array_new();
+    aichat_json_writer_member(writer, "messages");
+    aichat_json_writer_begin_array(writer);
     
     /* Add system message if configured */
     if (buddy->instructions && *buddy->instructions) {
-        msg = json_object_new();
-        json_object_set_string_member(msg, "role", "system");
-        json_object_set_string_member(msg, "content", buddy->instructions);
-        json_array_add_object_element(messages, msg);
+        openai_compat_write_turn(writer, AICHAT_ROLE_SYSTEM, buddy->instructions);
     }
     
-    /* Add conversation history */
-    for (history = buddy->history; history != NULL; history = history->next) {
-        AiChatHistory *hist = (AiChatHistory *)history->data;
-        msg = json_object_new();
-        json_object_set_string_member(msg, "role", hist->role);
-        json_object_set_string_member(msg, "content", hist->content);
-        json_array_add_object_element(messages, msg);
-    }
-    
-    /* Add current message */
-    msg = json_object_new();
-    json_object_set_string_member(msg, "role", "user");
-    json_object_set_string_member(msg, "content", message);
-    json_array_add_object_element(messages, msg);
+    /* Add conversation history, which ends with the message being sent */
+    llm_write_history(writer, buddy->history, aichat_history_get_length(buddy->history), openai_compat_write_turn);
+    aichat_json_writer_end_array(writer);
     
-    /* Build request */
-    json_object_set_string_member(request, "model", buddy->model ? buddy->model : "gpt-3.5-turbo");
-    json_object_set_array_member(request, "messages", messages);
-    json_object_set_double_member(request, "temperature", 0.7);
+    aichat_json_writer_double_member(writer, "temperature", 0.7);
+    if (stream) {
+        aichat_json_writer_boolean_member(writer, "stream", TRUE);
+        
+        /* Otherwise streamed replies come without token counts */
+        aichat_json_writer_member(writer, "stream_options");
+        aichat_json_writer_begin_object(writer);
+        aichat_json_writer_boolean_member(writer, "include_usage", TRUE);
+        aichat_json_writer_end_object(writer);
+    }
+    aichat_json_writer_end_object(writer);
     
-    return request;
+    return aichat_json_writer_free_to_body(writer);
 }
 
 /* Shared OpenAI-compatible response parsing */
@@ -108,6 +116,174 @@ openai_compat_parse_response(JsonObject *response, GError **error)
     return g_strdup(content);
 }
 
+/* Shared OpenAI-compatible usage parsing */
+void
+openai_compat_parse_usage(JsonObject *response, LLMStreamState *state)
+{
+    JsonObject *usage = json_object_get_object_member(response, "usage");
+    
+    if (usage != NULL) {
+        JsonObject *details = NULL;
+        
+        state->input_tokens = json_object_get_int_member(usage, "prompt_tokens");
+        state->output_tokens = json_object_get_int_member(usage, "completion_tokens");
+        
+        /* DeepSeek counts cache hits its own way, and most others don't at all */
+        if (json_object_has_member(usage, "prompt_tokens_details")) {
+            details = json_object_get_object_member(usage, "prompt_tokens_details");
+        }
+        if (json_object_has_member(usage, "prompt_cache_hit_tokens")) {
+            state->cache_read_tokens = json_object_get_int_member(usage, "prompt_cache_hit_tokens");
+        } else if (details != NULL && json_object_has_member(details, "cached_tokens")) {
+            state->cache_read_tokens = json_object_get_int_member(details, "cached_tokens");
+        }
+    }
+}
+
+/* The parts of a chat.completion.chunk that are read */
+static const gchar * const openai_compat_stream_path_names[] = {
+    "choices.0.index",
+    "choices.0.delta.content",
+    "usage",
+    "usage.prompt_tokens",
+    "usage.completion_tokens",
+    "usage.prompt_tokens_details.cached_tokens",
+    "usage.prompt_cache_hit_tokens",
+    "error",
+    "error.message",
+    "error.type",
+    NULL
+};
+
+static AiChatJsonPullPaths openai_compat_stream_paths = AICHAT_JSON_PULL_PATHS_INIT(openai_compat_stream_path_names);
+
+/* The same parts of a complete chat.completion, which has the whole
+ * message where a chunk has the delta */
+static const gchar * const openai_compat_response_path_names[] = {
+    "choices.0.index",
+    "choices.0.message.content",
+    "usage",
+    "usage.prompt_tokens",
+    "usage.completion_tokens",
+    "usage.prompt_tokens_details.cached_tokens",
+    "usage.prompt_cache_hit_tokens",
+    "error",
+    "error.message",
+    "error.type",
+    NULL
+};
+
+static AiChatJsonPullPaths openai_compat_response_paths = AICHAT_JSON_PULL_PATHS_INIT(openai_compat_response_path_names);
+
+enum {
+    OPENAI_COMPAT_STREAM_INDEX,
+    OPENAI_COMPAT_STREAM_CONTENT,
+    OPENAI_COMPAT_STREAM_USAGE,
+    OPENAI_COMPAT_STREAM_PROMPT_TOKENS,
+    OPENAI_COMPAT_STREAM_COMPLETION_TOKENS,
+    OPENAI_COMPAT_STREAM_CACHED_TOKENS,
+    OPENAI_COMPAT_STREAM_CACHE_HIT_TOKENS,
+    OPENAI_COMPAT_STREAM_ERROR,
+    OPENAI_COMPAT_STREAM_ERROR_MESSAGE,
+    OPENAI_COMPAT_STREAM_ERROR_TYPE,
+    OPENAI_COMPAT_STREAM_N_PATHS
+};
+
+/* Act on the values pulled from a chunk or a complete response */
+static gboolean
+openai_compat_read_values(const AiChatJsonPullValue *values, LLMStreamState *state, GError **error)
+{
+    /* Errors can arrive mid-stream, after the 200 status was sent */
+    if (values[OPENAI_COMPAT_STREAM_ERROR].type > AICHAT_JSON_PULL_NULL) {
+        /* Some servers give just the message */
+        char *error_msg = values[OPENAI_COMPAT_STREAM_ERROR].type == AICHAT_JSON_PULL_STRING ?
+            aichat_json_pull_dup_string(&values[OPENAI_COMPAT_STREAM_ERROR]) :
+            aichat_json_pull_dup_string(&values[OPENAI_COMPAT_STREAM_ERROR_MESSAGE]);
+        char *error_type = aichat_json_pull_dup_string(&values[OPENAI_COMPAT_STREAM_ERROR_TYPE]);
+        
+        if (error) {
+            *error = g_error_new(G_IO_ERROR, G_IO_ERROR_FAILED,
+                                "API Error (%s): %s", 
+                                error_type ? error_type : "unknown",
+                                error_msg ? error_msg : "Unknown error");
+        }
+        g_free(error_msg);
+        g_free(error_type);
+        return FALSE;
+    }
+
+    /* Only the first choice is shown */
+    if (aichat_json_pull_get_int(&values[OPENAI_COMPAT_STREAM_INDEX]) == 0) {
+        aichat_json_pull_append_string(state->delta, &values[OPENAI_COMPAT_STREAM_CONTENT]);
+    }
+
+    /* Servers that report usage when streaming do it in the last chunk */
+    if (values[OPENAI_COMPAT_STREAM_USAGE].type == AICHAT_JSON_PULL_OBJECT) {
+        state->input_tokens = aichat_json_pull_get_int(&values[OPENAI_COMPAT_STREAM_PROMPT_TOKENS]);
+        state->output_tokens = aichat_json_pull_get_int(&values[OPENAI_COMPAT_STREAM_COMPLETION_TOKENS]);
+        
+        /* DeepSeek counts cache hits its own way */
+        state->cache_read_tokens = values[OPENAI_COMPAT_STREAM_CACHE_HIT_TOKENS].type == AICHAT_JSON_PULL_NUMBER ?
+            aichat_json_pull_get_int(&values[OPENAI_COMPAT_STREAM_CACHE_HIT_TOKENS]) :
+            aichat_json_pull_get_int(&values[OPENAI_COMPAT_STREAM_CACHED_TOKENS]);
+    }
+
+    return TRUE;
+}
+
+/* Shared OpenAI-compatible stream parsing (one chat.completion.chunk per event).
+ * Chunks are pulled apart in place, as most of what they carry is never read. */
+gboolean
+openai_compat_parse_stream_event(const char *event, const char *data, gsize data_len,
+                                 LLMStreamState *state, GError **error)
+{
+    AiChatJsonPullValue values[OPENAI_COMPAT_STREAM_N_PATHS];
+
+    if (data_len == 6 && strncmp(data, "[DONE]", 6) == 0) {
+        state->done = TRUE;
+        return TRUE;
+    }
+
+    if (!aichat_json_pull(data, data_len, &openai_compat_stream_paths, values)) {
+        if (error) {
+            *error = g_error_new(G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                "Invalid stream chunk");
+        }
+        return FALSE;
+    }
+
+    return openai_compat_read_values(values, state, error);
+}
+
+/* Shared OpenAI-compatible parsing of a complete response, the same way */
+gboolean
+openai_compat_parse_response_raw(const char *data, gsize len, LLMStreamState *state, GError **error)
+{
+    AiChatJsonPullValue values[OPENAI_COMPAT_STREAM_N_PATHS];
+
+    if (!aichat_json_pull(data, len, &openai_compat_response_paths, values)) {
+        if (error) {
+            *error = g_error_new(G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                "Invalid response");
+        }
+        return FALSE;
+    }
+
+    if (!openai_compat_read_values(values, state, error)) {
+        return FALSE;
+    }
+
+    if (values[OPENAI_COMPAT_STREAM_CONTENT].type != AICHAT_JSON_PULL_STRING) {
+        if (error) {
+            *error = g_error_new(G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                                "No content in response");
+        }
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
 /* Shared OpenAI-compatible response validation */
 gboolean
 openai_compat_validate_response(JsonObject *response, GError **error)
@@ -268,6 +444,9 @@ static LLMProvider mistral_provider = {
     .endpoint_url = "https://api.mistral.ai",
     .chat_endpoint = "/v1/chat/completions",
     .models = mistral_models,
+    .small_model = "mistral-small-latest",
+    .embedding_model = "mistral-embed",
+    .embeddings_endpoint = "/v1/embeddings",
     .needs_api_key = TRUE,
     .is_local = FALSE,
     .api_format = API_FORMAT_OPENAI,
@@ -277,6 +456,9 @@ static LLMProvider mistral_provider = {
     .max_context_length = 32768,
     .format_request = openai_compat_format_request,
     .parse_response = openai_compat_parse_response,
+    .parse_response_raw = openai_compat_parse_response_raw,
+    .parse_stream_event = openai_compat_parse_stream_event,
+    .parse_usage = openai_compat_parse_usage,
     .get_auth_header = openai_compat_get_auth_header,
     .validate_response = openai_compat_validate_response,
     .get_chat_url = openai_compat_get_chat_url,
@@ -291,6 +473,7 @@ static LLMProvider fireworks_provider = {
     .endpoint_url = "https://api.fireworks.ai",
     .chat_endpoint = "/inference/v1/chat/completions",
     .models = fireworks_models,
+    .small_model = "accounts/fireworks/models/llama-v3p1-8b-instruct",
     .needs_api_key = TRUE,
     .is_local = FALSE,
     .api_format = API_FORMAT_OPENAI,
@@ -300,6 +483,9 @@ static LLMProvider fireworks_provider = {
     .max_context_length = 32768,
     .format_request = openai_compat_format_request,
     .parse_response = openai_compat_parse_response,
+    .parse_response_raw = openai_compat_parse_response_raw,
+    .parse_stream_event = openai_compat_parse_stream_event,
+    .parse_usage = openai_compat_parse_usage,
     .get_auth_header = openai_compat_get_auth_header,
     .validate_response = openai_compat_validate_response,
     .get_chat_url = openai_compat_get_chat_url,
@@ -314,6 +500,7 @@ static LLMProvider together_provider = {
     .endpoint_url = "https://api.together.xyz",
     .chat_endpoint = "/v1/chat/completions",
     .models = together_models,
+    .small_model = "meta-llama/Meta-Llama-3.1-8B-Instruct-Turbo",
     .needs_api_key = TRUE,
     .is_local = FALSE,
     .api_format = API_FORMAT_OPENAI,
@@ -323,6 +510,9 @@ static LLMProvider together_provider = {
     .max_context_length = 32768,
     .format_request = openai_compat_format_request,
     .parse_response = openai_compat_parse_response,
+    .parse_response_raw = openai_compat_parse_response_raw,
+    .parse_stream_event = openai_compat_parse_stream_event,
+    .parse_usage = openai_compat_parse_usage,
     .get_auth_header = openai_compat_get_auth_header,
     .validate_response = openai_compat_validate_response,
     .get_chat_url = openai_compat_get_chat_url,
@@ -346,6 +536,9 @@ static LLMProvider xai_provider = {
     .max_context_length = 131072,
     .format_request = openai_compat_format_request,
     .parse_response = openai_compat_parse_response,
+    .parse_response_raw = openai_compat_parse_response_raw,
+    .parse_stream_event = openai_compat_parse_stream_event,
+    .parse_usage = openai_compat_parse_usage,
     .get_auth_header = openai_compat_get_auth_header,
     .validate_response = openai_compat_validate_response,
     .get_chat_url = openai_compat_get_chat_url,
@@ -360,6 +553,7 @@ static LLMProvider groq_provider = {
     .endpoint_url = "https://api.groq.com",
     .chat_endpoint = "/openai/v1/chat/completions",
     .models = groq_models,
+    .small_model = "llama-3.1-8b-instant",
     .needs_api_key = TRUE,
     .is_local = FALSE,
     .api_format = API_FORMAT_OPENAI,
@@ -369,6 +563,9 @@ static LLMProvider groq_provider = {
     .max_context_length = 32768,
     .format_request = openai_compat_format_request,
     .parse_response = openai_compat_parse_response,
+    .parse_response_raw = openai_compat_parse_response_raw,
+    .parse_stream_event = openai_compat_parse_stream_event,
+    .parse_usage = openai_compat_parse_usage,
     .get_auth_header = openai_compat_get_auth_header,
     .validate_response = openai_compat_validate_response,
     .get_chat_url = openai_compat_get_chat_url,
@@ -392,6 +589,9 @@ static LLMProvider deepseek_provider = {
     .max_context_length = 32768,
     .format_request = openai_compat_format_request,
     .parse_response = openai_compat_parse_response,
+    .parse_response_raw = openai_compat_parse_response_raw,
+    .parse_stream_event = openai_compat_parse_stream_event,
+    .parse_usage = openai_compat_parse_usage,
     .get_auth_header = openai_compat_get_auth_header,
     .validate_response = openai_compat_validate_response,
     .get_chat_url = openai_compat_get_chat_url,
@@ -46,46 +46,33 @@ static const char *openrouter_models[] = {
 };
 
 /* Format a chat request for OpenRouter (uses OpenAI format) */
-static JsonObject*
-openrouter_format_request(AiChatBuddy *buddy, const char *message)
+static AiChatJsonBody*
+openrouter_format_request(AiChatBuddy *buddy, gboolean stream)
 {
-    JsonObject *request;
-    JsonArray *messages;
-    JsonObject *msg;
-    GList *history;
+    AiChatJsonWriter *writer = aichat_json_writer_new(4096);
     
-    request = json_object_new();
-    messages = json_array_new();
+    aichat_json_writer_begin_object(writer);
+    aichat_json_writer_string_member(writer, "model", buddy->model ? buddy->model : "openai/gpt-3.5-turbo");
+    
+    aichat_json_writer_member(writer, "messages");
+    aichat_json_writer_begin_array(writer);
     
     /* Add system message if configured */
     if (buddy->instructions && *buddy->instructions) {
-        msg = json_object_new();
-        json_object_set_string_member(msg, "role", "system");
-        json_object_set_string_member(msg, "content", buddy->instructions);
-        json_array_add_object_element(messages, msg);
-    }
-    
-    /* Add conversation history */
-    for (history = buddy->history; history != NULL; history = history->next) {
-        AiChatHistory *hist = (AiChatHistory *)history->data;
-        msg = json_object_new();
-        json_object_set_string_member(msg, "role", hist->role);
-        json_object_set_string_member(msg, "content", hist->content);
-        json_array_add_object_element(messages, msg);
+        openai_compat_write_turn(writer, AICHAT_ROLE_SYSTEM, buddy->instructions);
     }
     
-    /* Add current message */
-    msg = json_object_new();
-    json_object_set_string_member(msg, "role", "user");
-    json_object_set_string_member(msg, "content", message);
-    json_array_add_object_element(messages, msg);
+    /* Add conversation history, which ends with the message being sent */
+    llm_write_history(writer, buddy->history, aichat_history_get_length(buddy->history), openai_compat_write_turn);
+    aichat_json_writer_end_array(writer);
     
-    /* Build request */
-    json_object_set_string_member(request, "model", buddy->model ? buddy->model : "openai/gpt-3.5-turbo");
-    json_object_set_array_member(request, "messages", messages);
-    json_object_set_double_member(request, "temperature", 0.7);
+    aichat_json_writer_double_member(writer, "temperature", 0.7);
+    if (stream) {
+        aichat_json_writer_boolean_member(writer, "stream", TRUE);
+    }
+    aichat_json_writer_end_object(writer);
     
-    return request;
+    return aichat_json_writer_free_to_body(writer);
 }
 
 /* Parse a response from OpenRouter (uses OpenAI format) */
@@ -248,6 +235,9 @@ static LLMProvider openrouter_provider = {
     .max_context_length = 128000,  /* Varies by model, using conservative estimate */
     .format_request = openrouter_format_request,
     .parse_response = openrouter_parse_response,
+    .parse_response_raw = openai_compat_parse_response_raw,
+    .parse_stream_event = openai_compat_parse_stream_event,
+    .parse_usage = openai_compat_parse_usage,
     .get_auth_header = openrouter_get_auth_header,
     .validate_response = openrouter_validate_response,
     .get_chat_url = openrouter_get_chat_url,
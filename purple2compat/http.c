@@ -1645,8 +1645,10 @@ PurpleHttpConnection * purple_http_request(PurpleConnection *gc,
 
 	_purple_http_reconnect(hc);
 
-	hc->timeout_handle = purple_timeout_add_seconds(request->timeout,
-		purple_http_request_timeout, hc);
+	if (request->timeout > 0) {
+		hc->timeout_handle = purple_timeout_add_seconds(request->timeout,
+			purple_http_request_timeout, hc);
+	}
 
 	return hc;
 }
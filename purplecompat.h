@@ -245,6 +245,7 @@ purple_chat_user_set_alias(PurpleChatUser *cb, const gchar *alias)
 
 #define purple_serv_got_im                         serv_got_im
 #define purple_serv_got_typing                     serv_got_typing
+#define purple_serv_got_typing_stopped             serv_got_typing_stopped
 #define purple_serv_got_alias                      serv_got_alias
 #define purple_serv_got_chat_in                    serv_got_chat_in
 #define purple_serv_got_chat_left                  serv_got_chat_left
@@ -0,0 +1,288 @@
+/*
+ * pidgin-aichat
+ *
+ * Copyright (C) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <string.h>
+#include "sse.h"
+
+typedef enum {
+	AICHAT_SSE_MODE_UNKNOWN,   /* No body seen yet */
+	AICHAT_SSE_MODE_EVENTS,    /* text/event-stream, framed into events */
+	AICHAT_SSE_MODE_RAW        /* Anything else, kept verbatim */
+} AiChatSseMode;
+
+struct _AiChatSseParser {
+	AiChatSseEventFunc callback;
+	gpointer user_data;
+	AiChatSseMode mode;
+
+	GString *line;        /* Partial line carried over from the last feed */
+	GString *event;       /* "event:" field of the event being assembled */
+	GString *data;        /* "data:" lines of the event being assembled */
+	GString *raw;         /* Unframed body */
+	gboolean have_data;   /* At least one "data:" line since the last dispatch */
+	gboolean skip_lf;     /* Last feed ended on a CR, so a leading LF belongs to it */
+	gboolean first_line;  /* Still expecting the first line (for the BOM) */
+	gboolean ndjson;      /* Every line is an event of its own */
+};
+
+AiChatSseParser *
+aichat_sse_parser_new(AiChatSseEventFunc callback, gpointer user_data)
+{
+	AiChatSseParser *parser = g_new0(AiChatSseParser, 1);
+
+	parser->callback = callback;
+	parser->user_data = user_data;
+	parser->line = g_string_new(NULL);
+	parser->event = g_string_new(NULL);
+	parser->data = g_string_new(NULL);
+	parser->first_line = TRUE;
+
+	return parser;
+}
+
+AiChatSseParser *
+aichat_sse_parser_new_ndjson(AiChatSseEventFunc callback, gpointer user_data)
+{
+	AiChatSseParser *parser = aichat_sse_parser_new(callback, user_data);
+
+	parser->ndjson = TRUE;
+
+	return parser;
+}
+
+void
+aichat_sse_parser_free(AiChatSseParser *parser)
+{
+	if (parser == NULL) {
+		return;
+	}
+
+	g_string_free(parser->line, TRUE);
+	g_string_free(parser->event, TRUE);
+	g_string_free(parser->data, TRUE);
+	if (parser->raw != NULL) {
+		g_string_free(parser->raw, TRUE);
+	}
+	g_free(parser);
+}
+
+static void
+aichat_sse_parser_dispatch(AiChatSseParser *parser)
+{
+	/* An event without any data lines is dropped, as per the spec */
+	if (parser->have_data && parser->callback != NULL) {
+		parser->callback(parser->event->len ? parser->event->str : "message",
+			parser->data->str, parser->data->len, parser->user_data);
+	}
+
+	g_string_truncate(parser->event, 0);
+	g_string_truncate(parser->data, 0);
+	parser->have_data = FALSE;
+}
+
+static void
+aichat_sse_parser_process_line(AiChatSseParser *parser, const gchar *line, gsize len)
+{
+	const gchar *colon;
+	const gchar *value;
+	gsize name_len, value_len;
+
+	if (parser->first_line) {
+		parser->first_line = FALSE;
+		if (len >= 3 && memcmp(line, "\xEF\xBB\xBF", 3) == 0) {
+			line += 3;
+			len -= 3;
+		}
+	}
+
+	if (parser->ndjson) {
+		if (len > 0) {
+			/* Copied so the callback gets a NUL-terminated string */
+			g_string_append_len(parser->data, line, len);
+			parser->have_data = TRUE;
+			aichat_sse_parser_dispatch(parser);
+		}
+		return;
+	}
+
+	if (len == 0) {
+		aichat_sse_parser_dispatch(parser);
+		return;
+	}
+
+	/* Comment, used by servers as a keep-alive */
+	if (line[0] == ':') {
+		return;
+	}
+
+	colon = memchr(line, ':', len);
+	if (colon != NULL) {
+		name_len = colon - line;
+		value = colon + 1;
+		value_len = len - name_len - 1;
+		if (value_len > 0 && value[0] == ' ') {
+			value++;
+			value_len--;
+		}
+	} else {
+		name_len = len;
+		value = line + len;
+		value_len = 0;
+	}
+
+	if (name_len == 4 && memcmp(line, "data", 4) == 0) {
+		if (parser->have_data) {
+			g_string_append_c(parser->data, '\n');
+		}
+		g_string_append_len(parser->data, value, value_len);
+		parser->have_data = TRUE;
+	} else if (name_len == 5 && memcmp(line, "event", 5) == 0) {
+		g_string_truncate(parser->event, 0);
+		g_string_append_len(parser->event, value, value_len);
+	}
+
+	/* "id" and "retry" only matter for reconnecting, which we never do */
+}
+
+void
+aichat_sse_parser_feed(AiChatSseParser *parser, const gchar *buf, gsize len)
+{
+	const gchar *end;
+	const gchar *eol;
+
+	g_return_if_fail(parser != NULL);
+
+	if (len == 0) {
+		return;
+	}
+
+	end = buf + len;
+
+	if (parser->skip_lf) {
+		parser->skip_lf = FALSE;
+		if (*buf == '\n') {
+			buf++;
+		}
+	}
+
+	while (buf < end) {
+		for (eol = buf; eol < end && *eol != '\n' && *eol != '\r'; eol++);
+
+		if (eol == end) {
+			/* Incomplete line, wait for the rest of it */
+			g_string_append_len(parser->line, buf, end - buf);
+			break;
+		}
+
+		if (parser->line->len > 0) {
+			g_string_append_len(parser->line, buf, eol - buf);
+			aichat_sse_parser_process_line(parser, parser->line->str, parser->line->len);
+			g_string_truncate(parser->line, 0);
+		} else {
+			aichat_sse_parser_process_line(parser, buf, eol - buf);
+		}
+
+		if (*eol == '\r') {
+			if (eol + 1 == end) {
+				parser->skip_lf = TRUE;
+			} else if (eol[1] == '\n') {
+				eol++;
+			}
+		}
+
+		buf = eol + 1;
+	}
+}
+
+void
+aichat_sse_parser_finish(AiChatSseParser *parser)
+{
+	g_return_if_fail(parser != NULL);
+
+	/* Strictly an unterminated event should be discarded, but proxies
+	 * have been known to drop the final blank line, and the last event
+	 * is usually the one carrying the usage totals */
+	if (parser->line->len > 0) {
+		aichat_sse_parser_process_line(parser, parser->line->str, parser->line->len);
+		g_string_truncate(parser->line, 0);
+	}
+	aichat_sse_parser_dispatch(parser);
+}
+
+gboolean
+aichat_sse_parser_is_streaming(AiChatSseParser *parser)
+{
+	g_return_val_if_fail(parser != NULL, FALSE);
+
+	return parser->mode == AICHAT_SSE_MODE_EVENTS;
+}
+
+const gchar *
+aichat_sse_parser_get_raw(AiChatSseParser *parser, gsize *len)
+{
+	g_return_val_if_fail(parser != NULL, NULL);
+
+	if (parser->raw == NULL) {
+		if (len) {
+			*len = 0;
+		}
+		return NULL;
+	}
+
+	if (len) {
+		*len = parser->raw->len;
+	}
+	return parser->raw->str;
+}
+
+gboolean
+aichat_sse_response_writer(PurpleHttpConnection *http_conn, PurpleHttpResponse *response,
+	const gchar *buffer, size_t offset, size_t length, gpointer user_data)
+{
+	AiChatSseParser *parser = user_data;
+
+	if (parser->mode == AICHAT_SSE_MODE_UNKNOWN) {
+		const gchar *content_type = purple_http_response_get_header(response, "Content-Type");
+
+		/* Error documents, and servers that ignored the stream flag,
+		 * answer with a plain JSON body */
+		if (!purple_http_response_is_successful(response) ||
+				(content_type != NULL && g_str_has_prefix(content_type, "application/json"))) {
+			parser->mode = AICHAT_SSE_MODE_RAW;
+			parser->raw = g_string_sized_new(length);
+		} else {
+			parser->mode = AICHAT_SSE_MODE_EVENTS;
+		}
+	}
+
+	if (parser->mode == AICHAT_SSE_MODE_RAW) {
+		g_string_append_len(parser->raw, buffer, length);
+	} else {
+		aichat_sse_parser_feed(parser, buffer, length);
+	}
+
+	return TRUE;
+}
+
+void
+aichat_sse_request_set_parser(PurpleHttpRequest *request, AiChatSseParser *parser)
+{
+	purple_http_request_set_response_writer(request, aichat_sse_response_writer, parser);
+}
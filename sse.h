@@ -0,0 +1,76 @@
+/*
+ * pidgin-aichat
+ *
+ * Copyright (C) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#ifndef _SSE_H_
+#define _SSE_H_
+
+#include <glib.h>
+#include "http.h"
+
+/* Server-Sent Events framing on top of the PurpleHttp response writer.
+ *
+ * The writer is handed the response body after chunked transfer decoding
+ * and gzip/deflate inflation, in pieces of arbitrary size.  The parser
+ * carries partial lines and partially assembled events across those pieces
+ * and hands every complete event to the callback as soon as its terminating
+ * blank line arrives. */
+
+typedef struct _AiChatSseParser AiChatSseParser;
+
+/* Called once per dispatched event.  @event is the "event:" field, or
+ * "message" if the server didn't name one.  @data holds the "data:" lines
+ * joined with '\n' and is NUL-terminated.  Both are only valid for the
+ * duration of the call, and the callback must not free the parser. */
+typedef void (*AiChatSseEventFunc)(const gchar *event, const gchar *data, gsize data_len, gpointer user_data);
+
+/* Create a new parser that dispatches events to @callback */
+AiChatSseParser *aichat_sse_parser_new(AiChatSseEventFunc callback, gpointer user_data);
+
+/* Create a parser for newline-delimited JSON streams instead, which hands
+ * every non-empty line to @callback as a "message" event */
+AiChatSseParser *aichat_sse_parser_new_ndjson(AiChatSseEventFunc callback, gpointer user_data);
+
+/* Free a parser, discarding any undispatched data */
+void aichat_sse_parser_free(AiChatSseParser *parser);
+
+/* Feed raw stream bytes; may dispatch any number of events */
+void aichat_sse_parser_feed(AiChatSseParser *parser, const gchar *buf, gsize len);
+
+/* Signal end of stream, dispatching a trailing event that wasn't terminated
+ * by a blank line */
+void aichat_sse_parser_finish(AiChatSseParser *parser);
+
+/* Whether the response turned out to be an event (or line) stream.  Error responses
+ * and plain JSON bodies aren't framed; their bytes are kept verbatim and
+ * can be fetched with aichat_sse_parser_get_raw() once the request is done */
+gboolean aichat_sse_parser_is_streaming(AiChatSseParser *parser);
+
+/* Get the unframed response body, if any */
+const gchar *aichat_sse_parser_get_raw(AiChatSseParser *parser, gsize *len);
+
+/* PurpleHttpContentWriter that feeds a parser passed as @user_data */
+gboolean aichat_sse_response_writer(PurpleHttpConnection *http_conn, PurpleHttpResponse *response,
+	const gchar *buffer, size_t offset, size_t length, gpointer user_data);
+
+/* Route a request's response body through @parser.  The parser must outlive
+ * the request. */
+void aichat_sse_request_set_parser(PurpleHttpRequest *request, AiChatSseParser *parser);
+
+#endif /* _SSE_H_ */
@@ -0,0 +1,216 @@
+/*
+ * pidgin-aichat
+ *
+ * Copyright (C) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+
+#include <string.h>
+#include "stats.h"
+
+typedef struct {
+	guint requests;
+	gint64 build;           /* Sums of the phases, in microseconds */
+	gint64 connect;
+	gint64 first_byte;
+	gint64 first_token;
+	gint64 total;
+	guint connects;         /* Requests that measured each optional phase */
+	guint first_bytes;
+	guint first_tokens;
+	gint64 tokens;          /* Output tokens, and the time spent generating them */
+	gint64 generation;
+	gboolean tokens_estimated;
+	gint64 input_tokens;    /* Prompt tokens, and how many of them were cached */
+	gint64 cache_read_tokens;
+} AiChatStatsEntry;
+
+struct _AiChatStats {
+	GHashTable *by_buddy;     /* Buddy name -> AiChatStatsEntry */
+	GHashTable *by_provider;  /* Provider name -> AiChatStatsEntry */
+};
+
+void
+aichat_request_stats_start(AiChatRequestStats *request)
+{
+	memset(request, 0, sizeof(AiChatRequestStats));
+	request->start = g_get_monotonic_time();
+}
+
+void
+aichat_request_stats_mark(gint64 *point)
+{
+	if (*point == 0) {
+		*point = g_get_monotonic_time();
+	}
+}
+
+AiChatStats *
+aichat_stats_new(void)
+{
+	AiChatStats *stats = g_new0(AiChatStats, 1);
+
+	stats->by_buddy = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	stats->by_provider = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	return stats;
+}
+
+void
+aichat_stats_free(AiChatStats *stats)
+{
+	if (stats == NULL) {
+		return;
+	}
+
+	g_hash_table_destroy(stats->by_buddy);
+	g_hash_table_destroy(stats->by_provider);
+	g_free(stats);
+}
+
+static void
+aichat_stats_entry_add(GHashTable *table, const gchar *key, const AiChatRequestStats *request)
+{
+	AiChatStatsEntry *entry = g_hash_table_lookup(table, key);
+
+	if (entry == NULL) {
+		entry = g_new0(AiChatStatsEntry, 1);
+		g_hash_table_insert(table, g_strdup(key), entry);
+	}
+
+	entry->requests++;
+	entry->build += request->built - request->start;
+	entry->total += request->end - request->start;
+	entry->input_tokens += request->input_tokens;
+	entry->cache_read_tokens += request->cache_read_tokens;
+
+	/* Covers connecting (and TLS) only when no pooled connection was free,
+	 * which PurpleHttp doesn't tell us, so it's shown as time to send */
+	if (request->connected) {
+		entry->connect += request->connected - request->built;
+		entry->connects++;
+	}
+	if (request->first_byte) {
+		entry->first_byte += request->first_byte - request->built;
+		entry->first_bytes++;
+	}
+	if (request->first_token) {
+		entry->first_token += request->first_token - request->built;
+		entry->first_tokens++;
+
+		/* Rate of generation, so the wait for the first token isn't counted twice */
+		if (request->output_tokens > 0 && request->end > request->first_token) {
+			entry->tokens += request->output_tokens;
+			entry->generation += request->end - request->first_token;
+			entry->tokens_estimated |= request->tokens_estimated;
+		}
+	}
+}
+
+void
+aichat_stats_add(AiChatStats *stats, const gchar *buddy, const gchar *provider, const AiChatRequestStats *request)
+{
+	g_return_if_fail(stats != NULL);
+	g_return_if_fail(request->end != 0 && request->built != 0);
+
+	if (buddy != NULL) {
+		aichat_stats_entry_add(stats->by_buddy, buddy, request);
+	}
+	if (provider != NULL) {
+		aichat_stats_entry_add(stats->by_provider, provider, request);
+	}
+}
+
+static void
+aichat_stats_entry_to_html(GString *html, const gchar *name, const AiChatStatsEntry *entry)
+{
+	gchar *escaped = g_markup_escape_text(name, -1);
+
+#define AVERAGE_MS(sum, count) ((count) ? (sum) / 1000.0 / (count) : 0.0)
+
+	g_string_append_printf(html, "<b>%s</b>: %u request%s<br>", escaped,
+		entry->requests, entry->requests == 1 ? "" : "s");
+	g_string_append_printf(html, "&nbsp;&nbsp;build %.1f ms", AVERAGE_MS(entry->build, entry->requests));
+	if (entry->connects) {
+		g_string_append_printf(html, ", send %.0f ms", AVERAGE_MS(entry->connect, entry->connects));
+	}
+	if (entry->first_bytes) {
+		g_string_append_printf(html, ", first byte %.0f ms", AVERAGE_MS(entry->first_byte, entry->first_bytes));
+	}
+	if (entry->first_tokens) {
+		g_string_append_printf(html, ", first token %.0f ms", AVERAGE_MS(entry->first_token, entry->first_tokens));
+	}
+	g_string_append_printf(html, ", total %.0f ms", AVERAGE_MS(entry->total, entry->requests));
+	if (entry->generation > 0) {
+		g_string_append_printf(html, ", %s%.1f tokens/s", entry->tokens_estimated ? "~" : "",
+			entry->tokens * 1000000.0 / entry->generation);
+	}
+	if (entry->cache_read_tokens > 0 && entry->input_tokens > 0) {
+		g_string_append_printf(html, ", %.0f%% of prompt cached",
+			entry->cache_read_tokens * 100.0 / entry->input_tokens);
+	}
+	g_string_append(html, "<br>");
+
+#undef AVERAGE_MS
+
+	g_free(escaped);
+}
+
+static void
+aichat_stats_table_to_html(GString *html, GHashTable *table)
+{
+	GList *keys = g_list_sort(g_hash_table_get_keys(table), (GCompareFunc) g_strcmp0);
+	GList *l;
+
+	for (l = keys; l != NULL; l = l->next) {
+		aichat_stats_entry_to_html(html, l->data, g_hash_table_lookup(table, l->data));
+	}
+
+	g_list_free(keys);
+}
+
+gchar *
+aichat_stats_to_html(AiChatStats *stats, const gchar *buddy)
+{
+	GString *html;
+
+	g_return_val_if_fail(stats != NULL, NULL);
+
+	html = g_string_new(NULL);
+
+	if (buddy != NULL) {
+		AiChatStatsEntry *entry = g_hash_table_lookup(stats->by_buddy, buddy);
+
+		if (entry == NULL) {
+			g_string_append(html, "No replies measured yet<br>");
+		} else {
+			aichat_stats_entry_to_html(html, buddy, entry);
+		}
+	} else if (g_hash_table_size(stats->by_buddy) > 0) {
+		g_string_append(html, "<u>By buddy</u><br>");
+		aichat_stats_table_to_html(html, stats->by_buddy);
+	}
+
+	if (g_hash_table_size(stats->by_provider) > 0) {
+		g_string_append(html, "<u>By provider</u><br>");
+		aichat_stats_table_to_html(html, stats->by_provider);
+	} else if (buddy == NULL) {
+		g_string_append(html, "No replies measured yet<br>");
+	}
+
+	return g_string_free(html, FALSE);
+}
@@ -0,0 +1,66 @@
+/*
+ * pidgin-aichat
+ *
+ * Copyright (C) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <glib.h>
+
+/* Client-side latency measurements.
+ *
+ * Each chat request fills in an AiChatRequestStats as it goes; once it has
+ * completed it is folded into the per-buddy and per-provider averages of
+ * the account's AiChatStats. */
+
+/* Points in the life of one request, as g_get_monotonic_time() values, or 0
+ * if the request never got there */
+typedef struct _AiChatRequestStats {
+	gint64 start;           /* Started building the request */
+	gint64 built;           /* Request handed to the HTTP stack */
+	gint64 connected;       /* Request being written, on a new connection or one from the keepalive pool */
+	gint64 first_byte;      /* First byte of the response body */
+	gint64 first_token;     /* First reply text */
+	gint64 end;             /* Reply complete */
+	gint64 input_tokens;    /* Prompt tokens, as reported by the provider */
+	gint64 cache_read_tokens;  /* Of those, read from the provider's prompt cache */
+	gint64 output_tokens;   /* Completion tokens */
+	gboolean tokens_estimated;  /* The provider didn't report usage, output_tokens is a guess */
+} AiChatRequestStats;
+
+typedef struct _AiChatStats AiChatStats;
+
+/* Reset @request and mark its start */
+void aichat_request_stats_start(AiChatRequestStats *request);
+
+/* Record the current time in @point, unless it's already been reached */
+void aichat_request_stats_mark(gint64 *point);
+
+AiChatStats *aichat_stats_new(void);
+void aichat_stats_free(AiChatStats *stats);
+
+/* Add a completed request to the averages for @buddy and @provider */
+void aichat_stats_add(AiChatStats *stats, const gchar *buddy, const gchar *provider, const AiChatRequestStats *request);
+
+/* Summarise the averages as HTML, for one buddy (and all providers) or, if
+ * @buddy is NULL, for everything */
+gchar *aichat_stats_to_html(AiChatStats *stats, const gchar *buddy);
+
+#endif /* _STATS_H_ */
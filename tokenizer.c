@@ -0,0 +1,346 @@
+/*
+ * pidgin-aichat
+ *
+ * Copyright (C) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "tokenizer.h"
+
+/* Longer words are counted in pieces of this size, since merging is
+ * quadratic in the length of a word; only runs of whitespace or of one
+ * repeated character ever get this long */
+#define AICHAT_TOKENIZER_MAX_WORD 256
+
+#define AICHAT_TOKENIZER_NO_RANK G_MAXUINT32
+
+typedef struct {
+	guint32 offset;  /* Into the token bytes, 0 for an empty slot */
+	guint32 len;
+	guint32 rank;
+} AiChatTokenizerSlot;
+
+struct _AiChatTokenizer {
+	GByteArray *bytes;           /* Every token's bytes, end to end */
+	AiChatTokenizerSlot *slots;  /* Open addressing table of the tokens */
+	guint32 mask;                /* Number of slots - 1 */
+	guint size;
+};
+
+static guint32
+aichat_tokenizer_hash(const guint8 *data, gsize len)
+{
+	guint32 hash = 2166136261u;
+	gsize i;
+
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ data[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+static guint32
+aichat_tokenizer_lookup(const AiChatTokenizer *tokenizer, const guint8 *data, gsize len)
+{
+	guint32 i = aichat_tokenizer_hash(data, len) & tokenizer->mask;
+
+	for (;; i = (i + 1) & tokenizer->mask) {
+		const AiChatTokenizerSlot *slot = &tokenizer->slots[i];
+
+		if (slot->offset == 0) {
+			return AICHAT_TOKENIZER_NO_RANK;
+		}
+		if (slot->len == len && memcmp(tokenizer->bytes->data + slot->offset, data, len) == 0) {
+			return slot->rank;
+		}
+	}
+}
+
+static void
+aichat_tokenizer_insert(AiChatTokenizer *tokenizer, guint32 offset, guint32 len, guint32 rank)
+{
+	const guint8 *data = tokenizer->bytes->data + offset;
+	guint32 i = aichat_tokenizer_hash(data, len) & tokenizer->mask;
+
+	for (; tokenizer->slots[i].offset != 0; i = (i + 1) & tokenizer->mask) {
+		AiChatTokenizerSlot *slot = &tokenizer->slots[i];
+
+		/* Keep the first rank of a duplicated token */
+		if (slot->len == len && memcmp(tokenizer->bytes->data + slot->offset, data, len) == 0) {
+			return;
+		}
+	}
+
+	tokenizer->slots[i].offset = offset;
+	tokenizer->slots[i].len = len;
+	tokenizer->slots[i].rank = rank;
+	tokenizer->size++;
+}
+
+AiChatTokenizer *
+aichat_tokenizer_new_from_file(const gchar *filename, GError **error)
+{
+	AiChatTokenizer *tokenizer;
+	gchar *contents;
+	gsize length;
+	gchar *line, *next;
+	guint lines = 0;
+	guint32 *spans;
+	guint i, n = 0;
+	guint32 capacity;
+
+	if (!g_file_get_contents(filename, &contents, &length, error)) {
+		return NULL;
+	}
+
+	for (i = 0; i < length; i++) {
+		if (contents[i] == '\n') {
+			lines++;
+		}
+	}
+	lines++;
+
+	tokenizer = g_new0(AiChatTokenizer, 1);
+	/* Offset 0 marks empty slots, so the first token starts at 1 */
+	tokenizer->bytes = g_byte_array_sized_new(length / 2 + 1);
+	g_byte_array_set_size(tokenizer->bytes, 1);
+	spans = g_new(guint32, lines * 3);
+
+	/* Decode every line first; the table is sized once the count is known */
+	for (line = contents; line != NULL && line < contents + length; line = next) {
+		gchar *space, *end;
+		guint64 rank;
+		gsize decoded_len;
+		guchar *decoded;
+
+		next = memchr(line, '\n', contents + length - line);
+		if (next != NULL) {
+			*next++ = '\0';
+		}
+
+		space = strchr(line, ' ');
+		if (space == NULL || space == line) {
+			continue;
+		}
+		*space = '\0';
+		rank = g_ascii_strtoull(space + 1, &end, 10);
+		if (end == space + 1 || rank >= AICHAT_TOKENIZER_NO_RANK) {
+			continue;
+		}
+
+		decoded = g_base64_decode(line, &decoded_len);
+		if (decoded_len > 0) {
+			spans[n * 3] = tokenizer->bytes->len;
+			spans[n * 3 + 1] = decoded_len;
+			spans[n * 3 + 2] = rank;
+			n++;
+			g_byte_array_append(tokenizer->bytes, decoded, decoded_len);
+		}
+		g_free(decoded);
+	}
+	g_free(contents);
+
+	if (n == 0) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+			"%s doesn't contain any tokens", filename);
+		g_free(spans);
+		aichat_tokenizer_free(tokenizer);
+		return NULL;
+	}
+
+	/* At most half full */
+	for (capacity = 1024; capacity < n * 2; capacity <<= 1);
+	tokenizer->slots = g_new0(AiChatTokenizerSlot, capacity);
+	tokenizer->mask = capacity - 1;
+
+	for (i = 0; i < n; i++) {
+		aichat_tokenizer_insert(tokenizer, spans[i * 3], spans[i * 3 + 1], spans[i * 3 + 2]);
+	}
+	g_free(spans);
+
+	return tokenizer;
+}
+
+void
+aichat_tokenizer_free(AiChatTokenizer *tokenizer)
+{
+	if (tokenizer == NULL) {
+		return;
+	}
+
+	g_byte_array_free(tokenizer->bytes, TRUE);
+	g_free(tokenizer->slots);
+	g_free(tokenizer);
+}
+
+guint
+aichat_tokenizer_get_size(const AiChatTokenizer *tokenizer)
+{
+	g_return_val_if_fail(tokenizer != NULL, 0);
+
+	return tokenizer->size;
+}
+
+/* Count the tokens byte-pair encoding turns one word into */
+static guint
+aichat_tokenizer_count_word(const AiChatTokenizer *tokenizer, const guint8 *word, gsize len)
+{
+	guint32 starts[AICHAT_TOKENIZER_MAX_WORD + 1];
+	guint32 ranks[AICHAT_TOKENIZER_MAX_WORD];
+	gsize parts, i;
+
+	if (len == 1 || aichat_tokenizer_lookup(tokenizer, word, len) != AICHAT_TOKENIZER_NO_RANK) {
+		return 1;
+	}
+
+	/* starts[i] is where part i begins, and ranks[i] the rank of part i
+	 * merged with part i + 1 */
+	parts = len;
+	for (i = 0; i <= len; i++) {
+		starts[i] = i;
+	}
+	for (i = 0; i + 1 < parts; i++) {
+		ranks[i] = aichat_tokenizer_lookup(tokenizer, word + i, 2);
+	}
+
+	while (parts > 1) {
+		guint32 best = AICHAT_TOKENIZER_NO_RANK;
+		gsize at = 0;
+
+		for (i = 0; i + 1 < parts; i++) {
+			if (ranks[i] < best) {
+				best = ranks[i];
+				at = i;
+			}
+		}
+		if (best == AICHAT_TOKENIZER_NO_RANK) {
+			break;
+		}
+
+		/* Merge part at + 1 into part at */
+		memmove(&starts[at + 1], &starts[at + 2], (parts - at - 1) * sizeof(starts[0]));
+		if (at + 2 < parts) {
+			memmove(&ranks[at + 1], &ranks[at + 2], (parts - at - 3) * sizeof(ranks[0]));
+		}
+		parts--;
+
+		if (at + 1 < parts) {
+			ranks[at] = aichat_tokenizer_lookup(tokenizer, word + starts[at], starts[at + 2] - starts[at]);
+		}
+		if (at > 0) {
+			ranks[at - 1] = aichat_tokenizer_lookup(tokenizer, word + starts[at - 1], starts[at + 1] - starts[at - 1]);
+		}
+	}
+
+	return parts;
+}
+
+#define IS_LETTER(c) (g_ascii_isalpha(c) || (c) >= 0x80)
+#define IS_NEWLINE(c) ((c) == '\r' || (c) == '\n')
+#define IS_SPACE(c) (g_ascii_isspace(c))
+
+/* Find the end of the word starting at @p, following
+ *   's|'t|'re|'ve|'m|'ll|'d|.?\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+
+ * with the leading character of a letter run being any non-letter, non-digit,
+ * non-newline character as in cl100k */
+static const guint8 *
+aichat_tokenizer_next_word(const guint8 *p, const guint8 *end)
+{
+	const guint8 *q;
+	guint8 c = *p;
+
+	if (c == '\'' && p + 1 < end) {
+		guint8 c1 = g_ascii_tolower(p[1]);
+		guint8 c2 = p + 2 < end ? g_ascii_tolower(p[2]) : 0;
+
+		if ((c1 == 'l' && c2 == 'l') || (c1 == 'v' && c2 == 'e') || (c1 == 'r' && c2 == 'e')) {
+			return p + 3;
+		}
+		if (c1 == 's' || c1 == 't' || c1 == 'm' || c1 == 'd') {
+			return p + 2;
+		}
+	}
+
+	if (IS_LETTER(c) || (!g_ascii_isdigit(c) && !IS_NEWLINE(c) && p + 1 < end && IS_LETTER(p[1]))) {
+		for (q = p + 1; q < end && IS_LETTER(*q); q++);
+		return q;
+	}
+
+	if (g_ascii_isdigit(c)) {
+		for (q = p + 1; q < end && q < p + 3 && g_ascii_isdigit(*q); q++);
+		return q;
+	}
+
+	if (!IS_SPACE(c) || (c == ' ' && p + 1 < end && !IS_SPACE(p[1]) && !g_ascii_isdigit(p[1]))) {
+		for (q = p + 1; q < end && !IS_SPACE(*q) && !IS_LETTER(*q) && !g_ascii_isdigit(*q); q++);
+		for (; q < end && IS_NEWLINE(*q); q++);
+		return q;
+	}
+
+	/* Whitespace, up to its last newline if it has any */
+	{
+		const guint8 *last_newline = NULL;
+
+		for (q = p; q < end && IS_SPACE(*q); q++) {
+			if (IS_NEWLINE(*q)) {
+				last_newline = q;
+			}
+		}
+		if (last_newline != NULL) {
+			return last_newline + 1;
+		}
+		/* Leave the last space to start the next word */
+		if (q < end && q - p > 1) {
+			return q - 1;
+		}
+		return q;
+	}
+}
+
+guint
+aichat_tokenizer_count(const AiChatTokenizer *tokenizer, const gchar *text, gssize len)
+{
+	const guint8 *p, *end;
+	guint count = 0;
+
+	g_return_val_if_fail(tokenizer != NULL, 0);
+
+	if (text == NULL) {
+		return 0;
+	}
+	if (len < 0) {
+		len = strlen(text);
+	}
+
+	p = (const guint8 *) text;
+	end = p + len;
+
+	while (p < end) {
+		const guint8 *word_end = aichat_tokenizer_next_word(p, end);
+
+		while (word_end - p > AICHAT_TOKENIZER_MAX_WORD) {
+			count += aichat_tokenizer_count_word(tokenizer, p, AICHAT_TOKENIZER_MAX_WORD);
+			p += AICHAT_TOKENIZER_MAX_WORD;
+		}
+		count += aichat_tokenizer_count_word(tokenizer, p, word_end - p);
+		p = word_end;
+	}
+
+	return count;
+}
@@ -0,0 +1,50 @@
+/*
+ * pidgin-aichat
+ *
+ * Copyright (C) 2025
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ */
+
+#ifndef _TOKENIZER_H_
+#define _TOKENIZER_H_
+
+#include <glib.h>
+
+/* Byte-pair encoding token counter for tiktoken-style vocabularies.
+ *
+ * A vocabulary file has one token per line: the token's bytes in base64,
+ * a space, and its rank, as in the cl100k_base and o200k_base files that
+ * OpenAI publishes.  Text is split into words with a hand-written scanner
+ * that follows the cl100k pre-tokenization pattern, treating all non-ASCII
+ * characters as letters, and each word is then merged lowest rank first.
+ * Counts only, no token ids are produced. */
+
+typedef struct _AiChatTokenizer AiChatTokenizer;
+
+/* Load the vocabulary in @filename.  Returns NULL and sets @error if the
+ * file can't be read or has no usable lines. */
+AiChatTokenizer *aichat_tokenizer_new_from_file(const gchar *filename, GError **error);
+
+void aichat_tokenizer_free(AiChatTokenizer *tokenizer);
+
+/* Get the number of tokens in the vocabulary */
+guint aichat_tokenizer_get_size(const AiChatTokenizer *tokenizer);
+
+/* Count the tokens in @len bytes of @text, or all of it if @len is
+ * negative */
+guint aichat_tokenizer_count(const AiChatTokenizer *tokenizer, const gchar *text, gssize len);
+
+#endif /* _TOKENIZER_H_ */